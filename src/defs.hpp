@@ -7,6 +7,25 @@
 
 #define PLUGIN_HOTKEY "ALT-F9"
 
+// plugin argument flags (see plugins.cfg)
+// dedupe the same types from all the compilation units
+#define PLUGIN_ARG_DEDUPE_TYPES 0x01
+// keep an index of the applied compilation units in the database,
+// the next runs skip the unchanged ones
+#define PLUGIN_ARG_PERSIST_INDEX 0x02
+// batch mode (idag -A, IDC RunPlugin calls): no dialog, no macros UI
+#define PLUGIN_ARG_BATCH 0x04
+// phase selection (the types are always retrieved)
+#define PLUGIN_ARG_SKIP_FUNCS 0x08
+#define PLUGIN_ARG_SKIP_GLOBALS 0x10
+#define PLUGIN_ARG_SKIP_MACROS 0x20
+// show the phase timers and counters (see profiling.hpp)
+#define PLUGIN_ARG_PROFILE 0x40
+// only index the address ranges of the compilation units,
+// import them when they are reached (see lazy_import.hpp)
+// the persistent index is not used in this mode
+#define PLUGIN_ARG_LAZY 0x80
+
 // only to overcome a namespace problem
 // I swear I don't use dangerous functions
 #define USE_DANGEROUS_FUNCTIONS
@@ -1,25 +1,194 @@
 #include "die_cache.hpp"
 
+// standard headers
+#include <algorithm>
+
+// DIE_TYPE cache flags (with the die type in the first byte)
+#define PACKED_SECOND_PASS 0x04
+#define PACKED_TYPE_HASH 0x08
+#define PACKED_VAR_SHIFT 2
+
+// the unsigned values are stored in ULEB128
+static uchar *pack_value(uchar *buf, uint64 value) throw()
+{
+  do
+  {
+    uchar byte = static_cast<uchar>(value & 0x7F);
+
+    value >>= 7;
+    if(value != 0)
+    {
+      byte |= 0x80;
+    }
+
+    *buf++ = byte;
+  } while(value != 0);
+
+  return buf;
+}
+
+// returns NULL if the value goes past the end
+static uchar const *unpack_value(uchar const *buf, uchar const *end,
+                                 uint64 *value) throw()
+{
+  uint64 result = 0;
+  int shift = 0;
+  bool more = true;
+
+  while(buf != NULL && more)
+  {
+    if(buf == end || shift >= 64)
+    {
+      buf = NULL;
+    }
+    else
+    {
+      result |= static_cast<uint64>(*buf & 0x7F) << shift;
+      more = ((*buf & 0x80) != 0);
+      shift += 7;
+      buf++;
+    }
+  }
+
+  *value = result;
+
+  return buf;
+}
+
+size_t pack_die_cache(die_cache const &cache, uchar *buf) throw()
+{
+  uchar *pos = buf + 1;
+
+  buf[0] = static_cast<uchar>(cache.type);
+
+  switch(cache.type)
+  {
+  case DIE_TYPE:
+    if(cache.second_pass)
+    {
+      buf[0] |= PACKED_SECOND_PASS;
+    }
+    pos = pack_value(pos, cache.ordinal);
+    pos = pack_value(pos, cache.base_ordinal);
+    // the hash bits are spread, no ULEB128 for it
+    if(cache.type_hash != 0)
+    {
+      buf[0] |= PACKED_TYPE_HASH;
+      for(int idx = 0; idx < 8; ++idx)
+      {
+        *pos++ = static_cast<uchar>(cache.type_hash >> (idx * 8));
+      }
+    }
+    break;
+  case DIE_FUNC:
+    pos = pack_value(pos, cache.startEA);
+    break;
+  case DIE_VAR:
+    buf[0] |= static_cast<uchar>(cache.vtype << PACKED_VAR_SHIFT);
+    // BADADDR (no function) is packed in 1 byte
+    pos = pack_value(pos, static_cast<ea_t>(cache.func_startEA + 1));
+    break;
+  default:
+    break;
+  }
+
+  return static_cast<size_t>(pos - buf);
+}
+
+bool unpack_die_cache(uchar const *buf, size_t const size, die_cache *cache) throw()
+{
+  uchar const *end = buf + size;
+  uchar const *pos = (size == 0) ? NULL : buf + 1;
+  uint64 value1 = 0;
+  uint64 value2 = 0;
+
+  memset(cache, 0, sizeof(*cache));
+
+  if(pos != NULL)
+  {
+    cache->type = static_cast<die_type>(buf[0] & 0x03);
+
+    switch(cache->type)
+    {
+    case DIE_TYPE:
+      pos = unpack_value(pos, end, &value1);
+      pos = unpack_value(pos, end, &value2);
+      cache->ordinal = static_cast<uint32>(value1);
+      cache->second_pass = ((buf[0] & PACKED_SECOND_PASS) != 0);
+      cache->base_ordinal = static_cast<uint32>(value2);
+      if((buf[0] & PACKED_TYPE_HASH) != 0)
+      {
+        pos = (pos == NULL || end - pos < 8) ? NULL : pos;
+        for(int idx = 0; pos != NULL && idx < 8; ++idx)
+        {
+          cache->type_hash |= static_cast<uint64>(*pos++) << (idx * 8);
+        }
+      }
+      break;
+    case DIE_FUNC:
+      pos = unpack_value(pos, end, &value1);
+      cache->startEA = static_cast<ea_t>(value1);
+      break;
+    case DIE_VAR:
+      pos = unpack_value(pos, end, &value1);
+      cache->vtype = static_cast<var_type>(buf[0] >> PACKED_VAR_SHIFT);
+      cache->func_startEA = static_cast<ea_t>(value1) - 1;
+      break;
+    default:
+      break;
+    }
+  }
+
+  return (pos == end);
+}
+
+// the DIE cache netnode of the older versions
+// (only the DIE index is kept in the database now, see DieIndex)
+#define DIES_NODE_NAME "$ " PLUGIN_NAME " dies"
+
 void DieCache::clean(void) throw()
 {
-  if(m_dies_node != NULL)
+  netnode dies_node(DIES_NODE_NAME);
+
+  clear();
+
+  if(dies_node != BADNODE)
   {
-    m_dies_node->kill();
-    delete m_dies_node, m_dies_node = NULL;
+    dies_node.kill();
   }
 }
 
+void DieCache::clear(void) throw()
+{
+  m_caches.clear();
+  m_useless.clear();
+  m_offsets.clear();
+  m_sorted_offsets.clear();
+  m_new_offsets.clear();
+  m_added_offsets.clear();
+  m_nb_sorted_added = 0;
+}
+
 bool DieCache::get_cache(Dwarf_Off const offset, die_cache *cache) throw()
 {
+  die_cache const *found_cache = m_caches.find(offset);
   bool ret = false;
-  ssize_t size = m_dies_node->supval(static_cast<sval_t>(offset), cache, sizeof(*cache));
 
   // found?
-  if(size != -1)
+  if(found_cache != NULL)
+  {
+    *cache = *found_cache;
+    ret = true;
+  }
+  else if(m_useless.test(offset))
   {
+    memset(cache, 0, sizeof(*cache));
+    cache->type = DIE_USELESS;
     ret = true;
   }
 
+  profiler.count(ret ? COUNTER_CACHE_HITS : COUNTER_CACHE_MISSES);
+
   return ret;
 }
 
@@ -52,9 +221,14 @@ bool DieCache::get_cache_type_ordinal(Dwarf_Off const offset, uint32 *ordinal)
 bool DieCache::get_offset(sval_t const reverse, die_type const type,
                           Dwarf_Off *offset) throw()
 {
-  ssize_t const size = m_dies_node->supval(reverse, offset, sizeof(*offset), type);
+  Dwarf_Off const *found_offset = m_offsets.find(get_reverse_key(reverse, type));
+
+  if(found_offset != NULL)
+  {
+    *offset = *found_offset;
+  }
 
-  return (size != -1);
+  return (found_offset != NULL);
 }
 
 bool DieCache::get_cache_by_ordinal(uint32 const ordinal, die_cache *cache) throw()
@@ -70,18 +244,116 @@ bool DieCache::get_cache_by_ordinal(uint32 const ordinal, die_cache *cache) thro
   return found;
 }
 
+uint64 DieCache::get_type_hash(uint32 const ordinal) throw()
+{
+  die_cache cache;
+  bool const found = (get_cache_by_ordinal(ordinal, &cache) && cache.type == DIE_TYPE);
+
+  return found ? cache.type_hash : 0;
+}
+
 void DieCache::cache_useless(Dwarf_Off const offset) throw()
 {
   if(!in_cache(offset))
   {
-    die_cache cache = { DIE_USELESS, { 0 } };
+    m_useless.set(offset);
+  }
+}
+
+void DieCache::set_cache(Dwarf_Off const offset, die_cache const *cache,
+                         bool const restored) throw()
+{
+  if(cache->type == DIE_USELESS)
+  {
+    if(m_caches.find(offset) == NULL)
+    {
+      m_useless.set(offset);
+    }
+  }
+  else
+  {
+    bool added = false;
+
+    m_caches.get(offset, &added) = *cache;
+    m_useless.reset(offset);
+
+    if(added)
+    {
+      m_new_offsets.push_back(offset);
+      if(!restored)
+      {
+        m_added_offsets.push_back(offset);
+      }
+    }
+  }
+}
+
+// only sort the offsets after the sorted ones,
+// then merge them with the already sorted ones
+static void merge_offsets(qvector<Dwarf_Off> &offsets, size_t const nb_sorted) throw()
+{
+  if(nb_sorted != offsets.size())
+  {
+    sort(offsets.begin() + nb_sorted, offsets.end());
+    inplace_merge(offsets.begin(), offsets.begin() + nb_sorted, offsets.end());
+  }
+}
+
+void DieCache::sort_offsets(void) throw()
+{
+  if(!m_new_offsets.empty())
+  {
+    size_t const nb_sorted = m_sorted_offsets.size();
+
+    m_sorted_offsets.reserve(nb_sorted + m_new_offsets.size());
+
+    for(size_t idx = 0; idx < m_new_offsets.size(); ++idx)
+    {
+      m_sorted_offsets.push_back(m_new_offsets[idx]);
+    }
 
-    m_dies_node->supset(static_cast<sval_t>(offset), &cache, sizeof(cache));
+    merge_offsets(m_sorted_offsets, nb_sorted);
+    m_new_offsets.clear();
   }
 }
 
+nodeidx_t DieCache::find_added_offset(Dwarf_Off const offset) throw()
+{
+  Dwarf_Off const *found = NULL;
+
+  // DIEs may have been cached while iterating
+  merge_offsets(m_added_offsets, m_nb_sorted_added);
+  m_nb_sorted_added = m_added_offsets.size();
+
+  found = lower_bound(m_added_offsets.begin(), m_added_offsets.end(), offset);
+
+  return (found == m_added_offsets.end() ? BADNODE : static_cast<nodeidx_t>(*found));
+}
+
+nodeidx_t DieCache::find_offset(Dwarf_Off const offset, bool const useful_only) throw()
+{
+  Dwarf_Off const *useful = NULL;
+  uint64 found = OffsetBitmap::NO_OFFSET;
+
+  // DIEs may have been cached while iterating
+  sort_offsets();
+
+  useful = lower_bound(m_sorted_offsets.begin(), m_sorted_offsets.end(), offset);
+  if(useful != m_sorted_offsets.end())
+  {
+    found = *useful;
+  }
+
+  if(!useful_only)
+  {
+    found = qmin(found, m_useless.find_next(offset));
+  }
+
+  return (found == OffsetBitmap::NO_OFFSET ? BADNODE : static_cast<nodeidx_t>(found));
+}
+
 void DieCache::cache_useful(Dwarf_Off const offset, sval_t const reverse,
-                            die_cache const *cache) throw()
+                            die_cache const *cache, bool const restored) throw()
 {
   die_cache existing_cache;
   Dwarf_Off orig_offset = 0;
@@ -93,11 +365,9 @@ void DieCache::cache_useful(Dwarf_Off const offset, sval_t const reverse,
     ok = get_cache(orig_offset, &existing_cache);
     if(ok)
     {
-      nodeidx_t const offset_idx = static_cast<nodeidx_t>(offset);
-
       // set the same cache infos
       // but don't touch the existing reverse mapping!
-      m_dies_node->supset(offset_idx, &existing_cache, sizeof(existing_cache));
+      set_cache(offset, &existing_cache, restored);
     }
   }
   else
@@ -111,14 +381,11 @@ void DieCache::cache_useful(Dwarf_Off const offset, sval_t const reverse,
     }
     else
     {
-      nodeidx_t const offset_idx = static_cast<nodeidx_t>(offset);
-
-      m_dies_node->supset(offset_idx, cache, sizeof(*cache));
-      m_dies_node->altset(reverse, offset_idx, cache->type);
+      set_cache(offset, cache, restored);
+      m_offsets.set(get_reverse_key(reverse, cache->type), offset);
     }
   }
 }
-
 void DieCache::cache_type(Dwarf_Off const offset, uint32 const ordinal,
                           bool second_pass, uint32 base_ordinal) throw()
 {
@@ -130,16 +397,30 @@ void DieCache::cache_type(Dwarf_Off const offset, uint32 const ordinal,
     cache.ordinal = ordinal;
     cache.second_pass = second_pass;
     cache.base_ordinal = base_ordinal;
+    cache.type_hash = 0;
 
     cache_useful(offset, static_cast<sval_t>(ordinal), &cache);
   }
 }
 
+void DieCache::set_type_hash(Dwarf_Off const offset, uint64 const type_hash) throw()
+{
+  die_cache *cache = m_caches.find(offset);
+
+  if(cache != NULL && cache->type == DIE_TYPE)
+  {
+    cache->type_hash = type_hash;
+  }
+}
+
 void DieCache::cache_func(Dwarf_Off const offset, ea_t const startEA) throw()
 {
   if(startEA != BADADDR)
   {
-    die_cache const cache = { DIE_FUNC, { startEA } };
+    die_cache cache;
+
+    cache.type = DIE_FUNC;
+    cache.startEA = startEA;
 
     cache_useful(offset, static_cast<sval_t>(startEA), &cache);
   }
@@ -156,3 +437,22 @@ void DieCache::cache_var(Dwarf_Off const offset, var_type const type,
 
   cache_useful(offset, static_cast<sval_t>(func_startEA), &cache);
 }
+
+void DieCache::restore_cache(Dwarf_Off const offset, die_cache const &cache) throw()
+{
+  switch(cache.type)
+  {
+  case DIE_TYPE:
+    cache_useful(offset, static_cast<sval_t>(cache.ordinal), &cache, true);
+    break;
+  case DIE_FUNC:
+    cache_useful(offset, static_cast<sval_t>(cache.startEA), &cache, true);
+    break;
+  case DIE_VAR:
+    cache_useful(offset, static_cast<sval_t>(cache.func_startEA), &cache, true);
+    break;
+  default:
+    cache_useless(offset);
+    break;
+  }
+}
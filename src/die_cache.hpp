@@ -8,6 +8,9 @@
 // local headers
 #include "defs.hpp"
 #include "ida_utils.hpp"
+#include "offset_bitmap.hpp"
+#include "offset_table.hpp"
+#include "profiling.hpp"
 
 using namespace std;
 
@@ -29,6 +32,8 @@ struct die_cache
       uint32 ordinal; // type ordinal
       bool second_pass; // cannot get the complete type
       uint32 base_ordinal; // ordinal of the type without any modifiers
+      // members hash of a struct/union/enum (0 if none, see TypeGraph::get_members_hash)
+      uint64 type_hash;
     };
     // DIE_FUNC specific member
     ea_t startEA;
@@ -41,29 +46,47 @@ struct die_cache
   };
 };
 
+// packed (variable length) cache, to store it in a netnode (see DieIndex)
+// a useless cache is 1 byte long, most of the others 2 to 6 bytes
+// (16 to 19 bytes for the types with a structural hash)
+#define MAX_PACKED_CACHE_SIZE 32
+
+// returns the packed size
+size_t pack_die_cache(die_cache const &cache, uchar *buf) throw();
+
+// returns false if the buffer is not a packed cache
+bool unpack_die_cache(uchar const *buf, size_t const size, die_cache *cache) throw();
+
 // caching stuff
+// the cache only lives in memory during the retrieval
+// (the persistent index keeps the cache of the applied CUs, see DieIndex)
 class DieCache
 {
 public:
-  DieCache(void)
-    : m_dies_node(new netnode("$ " PLUGIN_NAME " dies", 0, true))
+  DieCache(void) throw()
+    : m_nb_sorted_added(0)
   {
 
   }
 
+  // the database may be closed already: only the memory is freed
   virtual ~DieCache(void) throw()
   {
-    clean();
+    clear();
   }
 
+  // also drops the DIE cache netnode left by the older versions
   void clean(void) throw();
 
   // cache predicates
 
   bool in_cache(Dwarf_Off const offset) throw()
   {
-    return (m_dies_node->supval(static_cast<sval_t>(offset), NULL,
-                               sizeof(die_cache)) != -1);
+    bool const found = (m_useless.test(offset) || m_caches.find(offset) != NULL);
+
+    profiler.count(found ? COUNTER_CACHE_HITS : COUNTER_CACHE_MISSES);
+
+    return found;
   }
 
   // cache getters
@@ -84,16 +107,34 @@ public:
 
   bool get_cache_by_ordinal(uint32 const ordinal, die_cache *cache) throw();
 
-  nodeidx_t get_first_offset(void) throw()
+  // members hash of the DIE which gave a type ordinal (0 if none)
+  uint64 get_type_hash(uint32 const ordinal) throw();
+
+  // iterate over the cached offsets in ascending order
+  // (useful_only: skip the DIE_USELESS ones)
+  nodeidx_t get_first_offset(bool const useful_only=false) throw()
+  {
+    return find_offset(0, useful_only);
+  }
+
+  nodeidx_t get_next_offset(nodeidx_t idx, bool const useful_only=false) throw()
   {
-    return m_dies_node->sup1st();
+    return find_offset(static_cast<Dwarf_Off>(idx) + 1, useful_only);
   }
 
-  nodeidx_t get_next_offset(nodeidx_t idx) throw()
+  // the useful DIEs cached since the start of the traversal
+  // (a lazy import keeps the cache of the previous traversals,
+  // their finishers only go over the DIEs they added, see CacheIterator)
+  void start_traversal(void) throw()
   {
-    return m_dies_node->supnxt(idx);
+    m_added_offsets.clear();
+    m_nb_sorted_added = 0;
   }
 
+  // first added offset not below the given one (BADNODE if none)
+  // iterating with it goes over the added DIEs in ascending order
+  nodeidx_t find_added_offset(Dwarf_Off const offset) throw();
+
   // cache setters
 
   void cache_useless(Dwarf_Off const offset) throw();
@@ -106,12 +147,51 @@ public:
   void cache_var(Dwarf_Off const offset, var_type const type,
                  ea_t const func_startEA=BADADDR) throw();
 
+  // only for a DIE already cached as a type
+  void set_type_hash(Dwarf_Off const offset, uint64 const type_hash) throw();
+
+  // cache from a previous run (see DieIndex)
+  void restore_cache(Dwarf_Off const offset, die_cache const &cache) throw();
+
 private:
-// DIEs cache (ordered by offset in .debug_info)
-  netnode *m_dies_node;
+  // useful DIEs cache, by offset in .debug_info
+  OffsetTable<die_cache> m_caches;
+  // offsets of the useless DIEs
+  // (most of the DIEs, they do not get a cache entry)
+  OffsetBitmap m_useless;
+  // reverse mapping (ordinal, startEA, ...) to the offset
+  OffsetTable<Dwarf_Off> m_offsets;
+  // useful cached offsets in ascending order
+  qvector<Dwarf_Off> m_sorted_offsets;
+  // offsets cached since the last sort
+  qvector<Dwarf_Off> m_new_offsets;
+  // offsets cached since the start of the traversal (restored ones excluded)
+  // the first ones are sorted, the others are merged when iterating
+  qvector<Dwarf_Off> m_added_offsets;
+  size_t m_nb_sorted_added;
+
+  void clear(void) throw();
+
+  // no copying or assignment
+  DieCache(DieCache const &);
+  DieCache &operator=(DieCache const &);
+
+  static uint64 get_reverse_key(sval_t const reverse, die_type const type) throw()
+  {
+    return ((static_cast<uint64>(type) << 32) |
+            static_cast<uint32>(reverse));
+  }
+
+  void set_cache(Dwarf_Off const offset, die_cache const *cache,
+                 bool const restored) throw();
+
+  void sort_offsets(void) throw();
+
+  // first cached offset not below the given one (BADNODE if none)
+  nodeidx_t find_offset(Dwarf_Off const offset, bool const useful_only) throw();
 
   void cache_useful(Dwarf_Off const offset, sval_t const reverse,
-                    die_cache const *cache) throw();
+                    die_cache const *cache, bool const restored=false) throw();
 };
 
 #endif // IDADWARF_CACHE_HPP
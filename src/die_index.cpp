@@ -0,0 +1,447 @@
+#include "die_index.hpp"
+
+// standard headers
+#include <algorithm>
+
+// IDA headers
+#include <funcs.hpp>
+#include <typeinf.hpp>
+
+// local headers
+#include "dwarf_file.hpp"
+#include "string_pool.hpp"
+
+extern DieCache diecache;
+
+#define INDEX_NODE_NAME "$ " PLUGIN_NAME " index"
+// netnode tags
+#define INDEX_KEY_TAG 'K'
+#define INDEX_CU_TAG 'C'
+#define INDEX_DIE_TAG 'D'
+#define INDEX_USELESS_TAG 'U'
+// changed with the storage format of the records
+#define INDEX_FORMAT 3
+
+static uint64 combine_hash(uint64 const hash, uint64 const value) throw()
+{
+  return (hash ^ value) * 0x100000001b3ULL;
+}
+
+static uint64 hash_bytes(void const *ptr, size_t const size) throw()
+{
+  return StringPool::hash(static_cast<char const *>(ptr), size);
+}
+
+static uint64 hash_str(char const *str) throw()
+{
+  return (str == NULL) ? 0 : hash_bytes(str, strlen(str));
+}
+
+// the useless DIEs of a CU are stored in one blob:
+// ULEB128 offset deltas from the CU start
+static void add_useless_offset(qvector<uchar> &blob, Dwarf_Off *last_offset,
+                               Dwarf_Off const offset) throw()
+{
+  uint64 delta = offset - *last_offset;
+
+  do
+  {
+    uchar byte = static_cast<uchar>(delta & 0x7F);
+
+    delta >>= 7;
+    blob.push_back((delta != 0) ? (byte | 0x80) : byte);
+  } while(delta != 0);
+
+  *last_offset = offset;
+}
+
+static void get_useless_offsets(qvector<uchar> const &blob, Dwarf_Off offset,
+                                qvector<Dwarf_Off> &offsets) throw()
+{
+  uint64 delta = 0;
+  int shift = 0;
+
+  for(size_t idx = 0; idx < blob.size(); ++idx)
+  {
+    delta |= static_cast<uint64>(blob[idx] & 0x7F) << shift;
+    shift += 7;
+
+    if((blob[idx] & 0x80) == 0)
+    {
+      offset += delta;
+      offsets.push_back(offset);
+      delta = 0;
+      shift = 0;
+    }
+  }
+}
+
+bool DieIndex::open(CUsHolder const &cus_holder) throw()
+{
+  DwarfFile *file = cus_holder.get_file();
+  uint64 info_size = 0;
+  uint64 abbrev_size = 0;
+  uchar const *info = (file == NULL) ? NULL :
+    file->get_section_data(".debug_info", &info_size);
+  uchar const *abbrev = (info == NULL) ? NULL :
+    file->get_section_data(".debug_abbrev", &abbrev_size);
+  uint64 types_size = 0;
+  uchar const *types = (abbrev == NULL) ? NULL :
+    file->get_section_data(".debug_types", &types_size);
+  qvector<IndexedCU> headers;
+  bool const ok = (abbrev != NULL);
+
+  if(!ok)
+  {
+    MSG("the DIE index needs the debug sections from the file mapping, not used\n");
+  }
+  else
+  {
+    uint64 stored_key = 0;
+
+    m_key = combine_hash(hash_bytes(abbrev, static_cast<size_t>(abbrev_size)), info_size);
+    m_key = combine_hash(m_key, INDEX_FORMAT);
+
+    // (the indexes of the files without type units are kept)
+    if(types_size != 0)
+    {
+      m_key = combine_hash(m_key, types_size);
+    }
+
+    add_units(*file, info, info_size, 0, headers);
+
+    // the type units are after the CUs in the offset space
+    if(types != NULL && CUsHolder::get_types_base() != CUsHolder::NO_TYPES_BASE)
+    {
+      add_units(*file, types, types_size, CUsHolder::get_types_base(), headers);
+    }
+
+    // the CUs (then the type units) of the holder (the partial units are not there)
+    for(size_t idx = 0; idx < cus_holder.size(); ++idx)
+    {
+      IndexedCU cu;
+
+      memset(&cu, 0, sizeof(cu));
+      cu.state = CU_FAILED;
+
+      try
+      {
+        DieHolder cu_holder(cus_holder.get_dbg(), cus_holder[idx], false);
+        IndexedCU const *header = NULL;
+
+        cu.die_offset = cu_holder.get_offset();
+        header = upper_bound(headers.begin(), headers.end(), cu.die_offset,
+                             is_before);
+
+        if(header != headers.begin() && cu.die_offset < (header - 1)->end)
+        {
+          cu.start = (header - 1)->start;
+          cu.end = (header - 1)->end;
+          cu.record.hash = (header - 1)->record.hash;
+          cu.state = CU_UNKNOWN;
+        }
+      }
+      catch(DieException const &exc)
+      {
+        MSG("cannot index compilation unit: %s (skipping)\n", exc.what());
+      }
+
+      // keep the CUs ordered even when not found
+      if(cu.state == CU_FAILED)
+      {
+        cu.start = cu.end = cu.die_offset;
+      }
+
+      m_cus.push_back(cu);
+    }
+
+    delete m_node;
+    m_node = new netnode(INDEX_NODE_NAME, 0, true);
+
+    // not indexed from the same DWARF infos, drop everything
+    if(m_node->supval(0, &stored_key, sizeof(stored_key), INDEX_KEY_TAG) !=
+       static_cast<ssize_t>(sizeof(stored_key)) || stored_key != m_key)
+    {
+      m_node->kill();
+      m_node->create(INDEX_NODE_NAME);
+      m_node->supset(0, &m_key, sizeof(m_key), INDEX_KEY_TAG);
+    }
+  }
+
+  return ok;
+}
+
+bool DieIndex::is_unchanged(size_t const cu_idx) const throw()
+{
+  CURecord record;
+
+  return read_unchanged(cu_idx, &record);
+}
+
+bool DieIndex::read_unchanged(size_t const cu_idx, CURecord *record) const throw()
+{
+  IndexedCU const &indexed_cu = m_cus[cu_idx];
+
+  return (indexed_cu.state == CU_UNKNOWN &&
+          m_node->supval(static_cast<sval_t>(indexed_cu.die_offset), record,
+                         sizeof(*record), INDEX_CU_TAG) ==
+          static_cast<ssize_t>(sizeof(*record)) &&
+          record->hash == indexed_cu.record.hash);
+}
+
+bool DieIndex::restore_cu(size_t const cu_idx) throw()
+{
+  IndexedCU &indexed_cu = m_cus[cu_idx];
+  CURecord record;
+  bool restored = false;
+
+  if(read_unchanged(cu_idx, &record))
+  {
+    qvector<die_cache> caches;
+    qvector<Dwarf_Off> offsets;
+    qvector<Dwarf_Off> useless_offsets;
+    size_t blob_size = m_node->blobsize(static_cast<nodeidx_t>(indexed_cu.die_offset),
+                                        INDEX_USELESS_TAG);
+    uint64 types_hash = 0;
+    // the DIE records of the CU are the ones between its start and its end
+    nodeidx_t idx = (indexed_cu.start == 0) ?
+      m_node->sup1st(INDEX_DIE_TAG) :
+      m_node->supnxt(static_cast<nodeidx_t>(indexed_cu.start - 1), INDEX_DIE_TAG);
+
+    if(blob_size != 0)
+    {
+      qvector<uchar> blob;
+
+      blob.resize(blob_size);
+      if(m_node->getblob(&blob[0], &blob_size, static_cast<nodeidx_t>(indexed_cu.die_offset),
+                         INDEX_USELESS_TAG) != NULL)
+      {
+        blob.resize(blob_size);
+        get_useless_offsets(blob, indexed_cu.start, useless_offsets);
+      }
+    }
+
+    for(; idx != BADNODE && idx < indexed_cu.end; idx = m_node->supnxt(idx, INDEX_DIE_TAG))
+    {
+      uchar buf[MAX_PACKED_CACHE_SIZE];
+      ssize_t const size = m_node->supval(static_cast<sval_t>(idx), buf, sizeof(buf),
+                                          INDEX_DIE_TAG);
+      die_cache cache;
+
+      if(size > 0 && unpack_die_cache(buf, static_cast<size_t>(size), &cache))
+      {
+        types_hash += hash_cache(cache);
+        caches.push_back(cache);
+        offsets.push_back(static_cast<Dwarf_Off>(idx));
+      }
+    }
+
+    for(size_t useless_idx = 0; useless_idx < useless_offsets.size(); ++useless_idx)
+    {
+      die_cache cache;
+
+      memset(&cache, 0, sizeof(cache));
+      cache.type = DIE_USELESS;
+      types_hash += hash_cache(cache);
+      caches.push_back(cache);
+      offsets.push_back(useless_offsets[useless_idx]);
+    }
+
+    // the types (or functions) used by the CU have changed since?
+    restored = (caches.size() == record.nb_dies && types_hash == record.types_hash);
+
+    for(size_t cache_idx = 0; restored && cache_idx < caches.size(); ++cache_idx)
+    {
+      diecache.restore_cache(offsets[cache_idx], caches[cache_idx]);
+    }
+  }
+
+  if(indexed_cu.state == CU_UNKNOWN)
+  {
+    indexed_cu.state = restored ? CU_RESTORED : CU_APPLIED;
+  }
+
+  return restored;
+}
+
+void DieIndex::save(void) throw()
+{
+  uint32 nb_restored = 0;
+  uint32 nb_saved = 0;
+
+  // forget what was indexed for the CUs applied again
+  for(size_t idx = 0; idx < m_cus.size(); ++idx)
+  {
+    IndexedCU &cu = m_cus[idx];
+
+    if(cu.state == CU_APPLIED || cu.state == CU_FAILED)
+    {
+      del_dies(cu);
+      m_node->delblob(static_cast<nodeidx_t>(cu.die_offset), INDEX_USELESS_TAG);
+      m_node->supdel(static_cast<sval_t>(cu.die_offset), INDEX_CU_TAG);
+      cu.record.types_hash = 0;
+      cu.record.nb_dies = 0;
+    }
+  }
+
+  // useless DIE offsets of the CUs, by CU index
+  qvector<qvector<uchar> > useless_blobs;
+  qvector<Dwarf_Off> last_offsets;
+
+  useless_blobs.resize(m_cus.size());
+  last_offsets.resize(m_cus.size());
+  for(size_t idx = 0; idx < m_cus.size(); ++idx)
+  {
+    last_offsets[idx] = m_cus[idx].start;
+  }
+
+  for(nodeidx_t offset = diecache.get_first_offset(); offset != BADNODE;
+      offset = diecache.get_next_offset(offset))
+  {
+    IndexedCU *cu = find_cu(offset);
+    die_cache cache;
+
+    if(cu != NULL && cu->state == CU_APPLIED && diecache.get_cache(offset, &cache))
+    {
+      if(cache.type == DIE_USELESS)
+      {
+        size_t const cu_idx = static_cast<size_t>(cu - m_cus.begin());
+
+        add_useless_offset(useless_blobs[cu_idx], &last_offsets[cu_idx], offset);
+      }
+      else
+      {
+        uchar buf[MAX_PACKED_CACHE_SIZE];
+        size_t const size = pack_die_cache(cache, buf);
+
+        m_node->supset(static_cast<sval_t>(offset), buf, size, INDEX_DIE_TAG);
+      }
+
+      cu->record.types_hash += hash_cache(cache);
+      cu->record.nb_dies++;
+    }
+  }
+
+  for(size_t idx = 0; idx < m_cus.size(); ++idx)
+  {
+    IndexedCU const &cu = m_cus[idx];
+
+    if(cu.state == CU_APPLIED)
+    {
+      if(!useless_blobs[idx].empty())
+      {
+        m_node->setblob(&useless_blobs[idx][0], useless_blobs[idx].size(),
+                        static_cast<nodeidx_t>(cu.die_offset), INDEX_USELESS_TAG);
+      }
+
+      m_node->supset(static_cast<sval_t>(cu.die_offset), &cu.record,
+                     sizeof(cu.record), INDEX_CU_TAG);
+      nb_saved++;
+    }
+    else if(cu.state == CU_RESTORED)
+    {
+      nb_restored++;
+    }
+  }
+
+  MSG("DIE index: %u compilation units restored, %u indexed\n",
+      nb_restored, nb_saved);
+}
+
+// hash each unit (header included) until the end of the section
+void DieIndex::add_units(DwarfFile const &file, uchar const *data, uint64 const size,
+                         Dwarf_Off const base, qvector<IndexedCU> &units) throw()
+{
+  Dwarf_Off offset = 0;
+
+  while(offset + 4 <= size)
+  {
+    uint64 length = file.read_value(data + offset, 4);
+    uint64 length_size = 4;
+    IndexedCU cu;
+
+    // 64-bit DWARF
+    if(length == 0xFFFFFFFF && offset + 12 <= size)
+    {
+      length = file.read_value(data + offset + 4, 8);
+      length_size = 12;
+    }
+
+    // truncated unit?
+    if(length > size - offset - length_size)
+    {
+      break;
+    }
+
+    memset(&cu, 0, sizeof(cu));
+    cu.start = base + offset;
+    cu.end = base + offset + length_size + length;
+    cu.record.hash = hash_bytes(data + offset, static_cast<size_t>(length_size + length));
+    units.push_back(cu);
+
+    offset += length_size + length;
+  }
+}
+
+DieIndex::IndexedCU *DieIndex::find_cu(Dwarf_Off const offset) throw()
+{
+  IndexedCU *cu = upper_bound(m_cus.begin(), m_cus.end(), offset, is_before);
+
+  return (cu == m_cus.begin() || offset >= (cu - 1)->end) ? NULL : cu - 1;
+}
+
+void DieIndex::del_dies(IndexedCU const &cu) throw()
+{
+  nodeidx_t idx = (cu.start == 0) ?
+    m_node->sup1st(INDEX_DIE_TAG) :
+    m_node->supnxt(static_cast<nodeidx_t>(cu.start - 1), INDEX_DIE_TAG);
+
+  while(idx != BADNODE && idx < cu.end)
+  {
+    nodeidx_t const next_idx = m_node->supnxt(idx, INDEX_DIE_TAG);
+
+    m_node->supdel(static_cast<sval_t>(idx), INDEX_DIE_TAG);
+    idx = next_idx;
+  }
+}
+
+// also covers what the cache refers to in the database:
+// the local type of the DIE (name, type string and fields)
+// and the function of the DIE
+uint64 DieIndex::hash_cache(die_cache const &cache) throw()
+{
+  uint64 hash = combine_hash(0, cache.type);
+
+  switch(cache.type)
+  {
+  case DIE_TYPE:
+    {
+      type_t const *type = NULL;
+      p_list const *fields = NULL;
+
+      hash = combine_hash(hash, cache.ordinal);
+      hash = combine_hash(hash, cache.second_pass);
+      hash = combine_hash(hash, cache.base_ordinal);
+
+      if(get_numbered_type(idati, cache.ordinal, &type, &fields))
+      {
+        hash = combine_hash(hash, hash_str(get_numbered_type_name(idati, cache.ordinal)));
+        hash = combine_hash(hash, hash_str(reinterpret_cast<char const *>(type)));
+        hash = combine_hash(hash, hash_str(reinterpret_cast<char const *>(fields)));
+      }
+    }
+    break;
+  case DIE_FUNC:
+    hash = combine_hash(hash, cache.startEA);
+    hash = combine_hash(hash, get_func(cache.startEA) != NULL);
+    break;
+  case DIE_VAR:
+    hash = combine_hash(hash, cache.vtype);
+    hash = combine_hash(hash, cache.func_startEA);
+    break;
+  default:
+    break;
+  }
+
+  return hash;
+}
@@ -0,0 +1,111 @@
+#ifndef IDADWARF_DIE_INDEX_HPP
+#define IDADWARF_DIE_INDEX_HPP
+
+// IDA headers
+#include <pro.h>
+#include <netnode.hpp>
+
+// additional libs headers
+#include <dwarf.h>
+#include <libdwarf.h>
+
+// local headers
+#include "die_cache.hpp"
+#include "die_utils.hpp"
+
+// persistent index of the applied compilation units
+// unlike the DIE cache (only in memory), it is kept in the database between runs:
+// each applied CU gets a record (hash of its bytes in .debug_info,
+// hash of the local types it uses) and the cache of its DIEs
+// (packed, the useless DIEs only get an offset in a blob of the CU).
+// the next runs restore the cache of the CUs with the same hashes
+// instead of applying them again.
+// the whole index is dropped when .debug_abbrev or the size
+// of .debug_info (or .debug_types) changes.
+// the type units are indexed like the CUs, by offset in the offset space.
+class DieIndex
+{
+public:
+  DieIndex(void) throw()
+    : m_node(NULL), m_key(0)
+  {
+
+  }
+
+  virtual ~DieIndex(void) throw()
+  {
+    delete m_node, m_node = NULL;
+  }
+
+  // hash the CUs of the holder (in its order)
+  // returns false if the index cannot be used
+  // (.debug_info is only hashed from the file mapping)
+  bool open(CUsHolder const &cus_holder) throw();
+
+  // has the CU not changed since it was indexed?
+  // (it will be restored, unless it is already)
+  bool is_unchanged(size_t const cu_idx) const throw();
+
+  // restore the cache of the CU DIEs if the CU has not changed
+  // (before the CU is walked, it is not walked at all if restored)
+  // otherwise the CU will be indexed when saving
+  bool restore_cu(size_t const cu_idx) throw();
+
+  // a DIE of the CU could not be applied, do not index it
+  void set_cu_failed(size_t const cu_idx) throw()
+  {
+    m_cus[cu_idx].state = CU_FAILED;
+  }
+
+  // index the applied CUs (before the DIE cache is cleaned)
+  void save(void) throw();
+
+private:
+  enum cu_state { CU_UNKNOWN, CU_RESTORED, CU_APPLIED, CU_FAILED };
+
+  // stored in the netnode, by CU DIE offset
+  struct CURecord
+  {
+    uint64 hash;
+    uint64 types_hash;
+    uint32 nb_dies;
+  };
+
+  struct IndexedCU
+  {
+    Dwarf_Off start; // CU header offset
+    Dwarf_Off end; // next CU header offset
+    Dwarf_Off die_offset;
+    CURecord record;
+    cu_state state;
+  };
+
+  netnode *m_node;
+  uint64 m_key;
+  qvector<IndexedCU> m_cus;
+
+  // no copying or assignment
+  DieIndex(DieIndex const &);
+  DieIndex &operator=(DieIndex const &);
+
+  static bool is_before(Dwarf_Off const offset, IndexedCU const &cu) throw()
+  {
+    return offset < cu.start;
+  }
+
+  // returns NULL if the DIE is not in a CU of the holder
+  IndexedCU *find_cu(Dwarf_Off const offset) throw();
+
+  // the unit offsets are moved by the base
+  static void add_units(DwarfFile const &file, uchar const *data, uint64 const size,
+                        Dwarf_Off const base, qvector<IndexedCU> &units) throw();
+
+  // the record of the CU, if it has the same hash
+  bool read_unchanged(size_t const cu_idx, CURecord *record) const throw();
+
+  void del_dies(IndexedCU const &cu) throw();
+
+  static uint64 hash_cache(die_cache const &cache) throw();
+};
+
+#endif // IDADWARF_DIE_INDEX_HPP
@@ -1,45 +1,167 @@
 #include "die_utils.hpp"
 
+// standard headers
+#include <algorithm>
+
+// local headers
+#include "loclist_cache.hpp"
+
 extern DieCache diecache;
+extern LocListCache loclist_cache;
+extern StringPool die_names;
 
-// RAII dwarf_dealloc wrapper for multiple deallocs
-class DwarfDealloc
+void OffsetAreas::add(OffsetArea const &area)
 {
-public:
-  DwarfDealloc(Dwarf_Debug dbg) throw()
-    : m_dbg(dbg)
+  OffsetArea new_area(area);
+
+  if(!m_areas.empty() && m_areas.back().endEA > new_area.startEA)
+  {
+    new_area.startEA = m_areas.back().endEA;
+  }
+
+  // (location blocks give an empty BADADDR area)
+  if(m_areas.empty() || new_area.startEA < new_area.endEA)
   {
+    if(m_first_fp == m_areas.size() && !new_area.use_fp)
+    {
+      m_first_fp++;
+    }
 
+    m_areas.push_back(new_area);
   }
+}
+
+void OffsetAreas::find_all(qvector<Dwarf_Locdesc> const &descs,
+                           qvector<OffsetArea const *> &found) const
+{
+  size_t area_idx = 0;
+
+  found.resize(descs.size(), NULL);
 
-  virtual ~DwarfDealloc(void) throw()
+  for(size_t idx = 0; idx < descs.size() && !m_areas.empty(); ++idx)
   {
-    for(size_t idx = m_deallocs.size(); idx > 0; --idx)
+    Dwarf_Locdesc const &desc = descs[idx];
+
+    if(!desc.ld_from_loclist)
+    {
+      found[idx] = find_whole_func();
+    }
+    else
     {
-      DeallocPair &dealloc_pair = m_deallocs[idx - 1];
+      area_t const range(static_cast<ea_t>(desc.ld_lopc), static_cast<ea_t>(desc.ld_hipc));
 
-      dwarf_dealloc(m_dbg, dealloc_pair.first, dealloc_pair.second);
-      dealloc_pair.first = NULL;
+      // the areas and the descriptions are both sorted,
+      // the area index only goes forward
+      while(area_idx + 1 < m_areas.size() && m_areas[area_idx + 1].startEA <= range.startEA)
+      {
+        area_idx++;
+      }
+
+      if(m_areas[area_idx].startEA <= range.startEA)
+      {
+        found[idx] = get_usable(area_idx, range);
+      }
     }
   }
+}
+
+OffsetArea const *OffsetAreas::find_whole_func(void) const throw()
+{
+  // first area after the stack base, or first ebp based one
+  size_t idx = m_first_fp;
 
-  void add(void *ptr, Dwarf_Unsigned dealloc_type) throw()
+  if(m_rel_addr != BADADDR)
   {
-    m_deallocs.push_back(make_pair(ptr, dealloc_type));
+    size_t const base_idx = find_idx(m_rel_addr);
+
+    // the area beginning before the base cannot be used
+    if(base_idx == m_areas.size())
+    {
+      idx = 0;
+    }
+    else
+    {
+      idx = qmin(idx, (m_areas[base_idx].startEA == m_rel_addr) ?
+                 base_idx : base_idx + 1);
+    }
   }
 
-private:
-  Dwarf_Debug m_dbg;
-  typedef pair<void *, Dwarf_Unsigned> DeallocPair;
-  qvector<DeallocPair> m_deallocs;
+  return (idx < m_areas.size()) ? &m_areas[idx] : NULL;
+}
 
-  // no copying or assignment
-  DwarfDealloc(DwarfDealloc const &);
-  DwarfDealloc &operator=(DwarfDealloc const &);
-};
+OffsetArea const *OffsetAreas::get_usable(size_t const idx, area_t const &range) const throw()
+{
+  OffsetArea const *found = NULL;
+
+  if(idx < m_areas.size())
+  {
+    OffsetArea const &offset_area = m_areas[idx];
+
+    // esp based, but the location is before the "base stack address"
+    // we cannot do anything
+    if(offset_area.contains(range) &&
+       (offset_area.use_fp || after_base(range.startEA)))
+    {
+      found = &offset_area;
+    }
+  }
+
+  return found;
+}
+
+size_t OffsetAreas::find_idx(ea_t const addr) const throw()
+{
+  // binary search for the first area beginning after the address
+  size_t low = 0;
+  size_t high = m_areas.size();
+
+  while(low < high)
+  {
+    size_t const middle = low + (high - low) / 2;
+
+    if(m_areas[middle].startEA <= addr)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  return (low == 0) ? m_areas.size() : low - 1;
+}
 
 // DWARF utility funs
 
+// only that many messages of each error kind are logged
+#define MAX_LOGGED_ERRORS 16
+
+static uint32 dwarf_error_counts[NB_DWERR_KINDS];
+
+bool count_dwarf_error(dwarf_error_kind const kind) throw()
+{
+  return (++dwarf_error_counts[kind] <= MAX_LOGGED_ERRORS);
+}
+
+void report_dwarf_errors(void) throw()
+{
+  static char const *names[NB_DWERR_KINDS] = { "libdwarf errors",
+                                               "unexpected attribute forms",
+                                               "skipped DIEs",
+                                               "unknown type signatures" };
+
+  for(int kind = 0; kind < NB_DWERR_KINDS; ++kind)
+  {
+    if(dwarf_error_counts[kind] != 0)
+    {
+      MSG("%u %s%s\n", dwarf_error_counts[kind], names[kind],
+          (dwarf_error_counts[kind] > MAX_LOGGED_ERRORS) ? " (only the first ones logged)" : "");
+      dwarf_error_counts[kind] = 0;
+    }
+  }
+}
+
 int get_small_encoding_value(Dwarf_Attribute attrib, Dwarf_Signed *val, Dwarf_Error *err)
 {
   Dwarf_Unsigned uval = 0;
@@ -71,7 +193,8 @@ DieHolder::DieHolder(Dwarf_Debug dbg, Dwarf_Off offset, bool const dealloc_die)
   Dwarf_Die die = NULL;
   Dwarf_Error err = NULL;
 
-  CHECK_DWERR(dwarf_offdie(dbg, offset, &die, &err), err,
+  profiler.count(COUNTER_OFFDIE);
+  CHECK_DWERR(get_die_from_offset(dbg, offset, &die, &err), err,
               "cannot retrieve DIE from offset 0x%" DW_PR_DUx, offset);
 
   init(dbg, die, dealloc_die);
@@ -79,22 +202,29 @@ DieHolder::DieHolder(Dwarf_Debug dbg, Dwarf_Off offset, bool const dealloc_die)
 
 DieHolder::~DieHolder(void) throw()
 {
-  m_origin_holder.reset();
+  clean();
+}
 
-  if(m_name != NULL)
-  {
-    dwarf_dealloc(m_dbg, m_name, DW_DLA_STRING);
-    m_name = NULL;
-  }
+void DieHolder::reset(Dwarf_Debug dbg, Dwarf_Die die, bool const dealloc_die) throw()
+{
+  clean();
+  init(dbg, die, dealloc_die);
+}
 
-  for(MapAttrs::iterator iter = m_attrs.begin();
-      iter != m_attrs.end(); ++iter)
+void DieHolder::clean(void) throw()
+{
+  m_origin_holder.reset();
+
+  if(m_attrs != NULL)
   {
-    if(iter->second != NULL)
+    for(Dwarf_Signed idx = 0; idx < m_nb_attrs; ++idx)
     {
-      dwarf_dealloc(m_dbg, iter->second, DW_DLA_ATTR);
-      iter->second = NULL;
+      dwarf_dealloc(m_dbg, m_attrs[idx], DW_DLA_ATTR);
+      m_attrs[idx] = NULL;
     }
+
+    dwarf_dealloc(m_dbg, m_attrs, DW_DLA_LIST);
+    m_attrs = NULL;
   }
 
   if(m_dealloc_die)
@@ -107,54 +237,52 @@ DieHolder::~DieHolder(void) throw()
 
 char const *DieHolder::get_name(void)
 {
-  char const *name = m_name;
+  return die_names.get(get_name_id());
+}
 
-  if(name == NULL)
+uint32 DieHolder::get_name_id(void)
+{
+  if(!m_name_fetched)
   {
-    Dwarf_Error err = NULL;
-
-    // name may be NULL
-    CHECK_DWERR2(dwarf_diename(m_die, &m_name, &err) == DW_DLV_ERROR, err,
-                 "cannot get DIE name");
+    Dwarf_Attribute attrib = get_attr(DW_AT_name);
 
-    if(m_name != NULL)
-    {
-      name = m_name;
-    }
-    else if(m_origin_holder.get() != NULL)
+    if(attrib != NULL)
     {
-      name = m_origin_holder->get_name();
+      char *name = NULL;
+      Dwarf_Error err = NULL;
+
+      // points in the string section (or in the DIE), nothing to deallocate
+      CHECK_DWERR(dwarf_formstring(attrib, &name, &err), err,
+                  "cannot get DIE name");
+      m_name_id = die_names.intern(name);
     }
+
+    m_name_fetched = true;
   }
 
-  return name;
+  return (m_name_id == StringPool::NO_STRING && m_origin_holder.get() != NULL) ?
+    m_origin_holder->get_name_id() : m_name_id;
 }
 
 Dwarf_Attribute DieHolder::get_attr(int attr)
 {
   Dwarf_Attribute attrib = NULL;
-  MapAttrs::const_iterator iter = m_attrs.find(attr);
-
-  if(iter == m_attrs.end())
-  {
-    Dwarf_Error err = NULL;
 
-    // atribute may be NULL
-    CHECK_DWERR2(dwarf_attr(m_die, attr, &attrib, &err) == DW_DLV_ERROR, err,
-                 "cannot get DIE attribute %d", attr);
+  prefetch_attrs();
 
-    if(attrib != NULL)
-    {
-      m_attrs[attr] = attrib;
-    }
-    else if(m_origin_holder.get() != NULL)
+  // a DIE only has a few attributes, a linear scan is enough
+  for(Dwarf_Signed idx = 0; attrib == NULL && idx < m_nb_attrs; ++idx)
+  {
+    if(get_attr_code(idx) == attr)
     {
-      attrib = m_origin_holder->get_attr(attr);
+      attrib = m_attrs[idx];
     }
   }
-  else
+
+  // atribute may be NULL
+  if(attrib == NULL && m_origin_holder.get() != NULL)
   {
-    attrib = iter->second;
+    attrib = m_origin_holder->get_attr(attr);
   }
 
   return attrib;
@@ -162,37 +290,19 @@ Dwarf_Attribute DieHolder::get_attr(int attr)
 
 Dwarf_Signed DieHolder::get_nb_attrs(void)
 {
-  Dwarf_Attribute *attrlist = NULL;
-  Dwarf_Signed nb_attrs = 0;
-  Dwarf_Error err = NULL;
-
-  CHECK_DWERR2(dwarf_attrlist(m_die, &attrlist, &nb_attrs, &err) == DW_DLV_ERROR, err,
-               "error when getting the list of attributes");
+  prefetch_attrs();
 
-  // do not use the attributes
-  // TODO: maybe we can put them in the attributes map later...
-  if(nb_attrs != 0)
-  {
-    for(Dwarf_Signed idx = 0; idx < nb_attrs; ++idx)
-    {
-      dwarf_dealloc(m_dbg, attrlist[idx], DW_DLA_ATTR);
-    }
-
-    dwarf_dealloc(m_dbg, attrlist, DW_DLA_LIST);
-  }
-
-  return nb_attrs;
+  return m_nb_attrs;
 }
 
 Dwarf_Addr DieHolder::get_addr_from_attr(int attr)
 {
   Dwarf_Addr addr = 0;
   Dwarf_Error err = NULL;
-  Dwarf_Attribute attrib = get_attr(attr);
+  int const ret = read_addr_attr(attr, &addr, &err);
 
-  CHECK_DWERR2(attrib == NULL, NULL, "cannot find DIE attribute %d\n", attr);
-  CHECK_DWERR(dwarf_formaddr(attrib, &addr, &err), err,
-              "cannot get address");
+  CHECK_DWERR2(ret == DW_DLV_NO_ENTRY, NULL, "cannot find DIE attribute %d\n", attr);
+  CHECK_DWERR(ret, err, "cannot get address");
 
   return addr;
 }
@@ -200,93 +310,116 @@ Dwarf_Addr DieHolder::get_addr_from_attr(int attr)
 Dwarf_Off DieHolder::get_ref_from_attr(int attr)
 {
   Dwarf_Off offset = 0;
-  Dwarf_Half form = 0;
   Dwarf_Error err = NULL;
+  int const ret = read_ref_attr(attr, &offset, &err);
+
+  CHECK_DWERR2(ret == DW_DLV_NO_ENTRY, NULL, "cannot find DIE attribute %d\n", attr);
+  CHECK_DWERR(ret, err, "cannot get reference address from attribute %d", attr);
+
+  return offset;
+}
+
+bool DieHolder::get_addr_from_attr(int attr, Dwarf_Addr *addr)
+{
+  Dwarf_Error err = NULL;
+
+  return check_status(read_addr_attr(attr, addr, &err), err);
+}
+
+bool DieHolder::get_ref_from_attr(int attr, Dwarf_Off *offset)
+{
+  Dwarf_Error err = NULL;
+
+  return check_status(read_ref_attr(attr, offset, &err), err);
+}
+
+bool DieHolder::get_attr_small_val(int attr, Dwarf_Signed *val)
+{
+  Dwarf_Error err = NULL;
+
+  return check_status(read_small_val_attr(attr, val, &err), err);
+}
+
+bool DieHolder::get_member_offset(Dwarf_Unsigned *offset)
+{
+  Dwarf_Error err = NULL;
+
+  return check_status(read_member_offset(offset, &err), err);
+}
+
+int DieHolder::read_addr_attr(int attr, Dwarf_Addr *addr, Dwarf_Error *err)
+{
   Dwarf_Attribute attrib = get_attr(attr);
 
-  CHECK_DWERR2(attrib == NULL, NULL, "cannot find DIE attribute %d\n", attr);
-  CHECK_DWERR(dwarf_whatform(attrib, &form, &err), err,
-              "cannot get form of the DIE attribute %d", attr);
+  return (attrib == NULL) ? DW_DLV_NO_ENTRY : dwarf_formaddr(attrib, addr, err);
+}
 
-  switch(form)
-  {
-  case DW_FORM_ref_addr:
-    CHECK_DWERR(dwarf_global_formref(attrib, &offset, &err), err,
-                "cannot get global reference address");
-    break;
-  case DW_FORM_ref1:
-  case DW_FORM_ref2:
-  case DW_FORM_ref4:
-  case DW_FORM_ref8:
-  case DW_FORM_ref_udata:
-  {
-    Dwarf_Off cu_offset = 0;
-    Dwarf_Off cu_length = 0;
+int DieHolder::read_ref_attr(int attr, Dwarf_Off *offset, Dwarf_Error *err)
+{
+  uint64 signature = 0;
+  int const ret = read_die_ref(m_die, get_offset(), get_attr(attr), offset, &signature, err);
 
-    CHECK_DWERR(dwarf_formref(attrib, &offset, &err), err,
-                "cannot get reference address");
-    cu_offset = get_CU_offset_range(&cu_length);
-    offset += cu_offset;
-  }
-  break;
-  default:
-    THROW_DWERR("unknown reference form=%d\n", form);
-    break;
+  // not counted again as an unexpected form
+  if(ret == DW_DLV_NO_ENTRY && signature != 0 && count_dwarf_error(DWERR_UNKNOWN_SIGNATURE))
+  {
+    MSG("no type unit for the signature 0x%" FMT_64 "x of DIE at offset 0x%" DW_PR_DUx "\n",
+        signature, get_offset());
   }
 
-  return offset;
+  return ret;
 }
 
-bool DieHolder::get_operand(int const attr, ea_t const rel_addr, Dwarf_Small const atom,
-                            Dwarf_Unsigned *operand, bool only_locblock)
+int DieHolder::read_small_val_attr(int attr, Dwarf_Signed *val, Dwarf_Error *err)
 {
   Dwarf_Attribute attrib = get_attr(attr);
-  Dwarf_Locdesc **llbuf = NULL;
-  Dwarf_Locdesc *locdesc = NULL;
-  Dwarf_Signed count = 0;
-  Dwarf_Error err = NULL;
-  DwarfDealloc dealloc(m_dbg);
-  bool found = false;
-  bool ret = false;
 
-  CHECK_DWERR2(attrib == NULL, NULL,
-               "retrieving an operand implies finding the attribute...");
+  return (attrib == NULL) ? DW_DLV_NO_ENTRY : get_small_encoding_value(attrib, val, err);
+}
 
-  CHECK_DWERR(dwarf_loclist_n(attrib, &llbuf, &count, &err), err,
-              "cannot get location descriptions");
+int DieHolder::read_member_offset(Dwarf_Unsigned *offset, Dwarf_Error *err)
+{
+  return read_die_member_offset(m_dbg, get_offset(), get_attr(DW_AT_data_member_location),
+                                offset, err);
+}
 
-  dealloc.add(llbuf, DW_DLA_LIST);
-  for(Dwarf_Signed idx = 0; idx < count; ++idx)
-  {
-    locdesc = llbuf[idx];
-    // handle deallocation too
-    dealloc.add(llbuf[idx], DW_DLA_LOCDESC);
-    dealloc.add(llbuf[idx]->ld_s, DW_DLA_LOC_BLOCK);
+bool DieHolder::check_status(int const ret, Dwarf_Error err) throw()
+{
+  profiler.count(COUNTER_DWARF_CALLS);
 
-    if(!found)
+  if(ret == DW_DLV_ERROR)
+  {
+    if(err != NULL)
     {
-      // from a location block?
-      if(!locdesc->ld_from_loclist)
+      if(count_dwarf_error(DWERR_LIBDWARF))
       {
-        // no need to check the address
-        found = true;
-      }
-      // this loc desc is from a location list
-      else if(!only_locblock &&
-              (locdesc->ld_lopc <= rel_addr &&
-               locdesc->ld_hipc > rel_addr))
-      {
-        found = true;
+        DEBUG("libdwarf error (%d: %s)\n", static_cast<int>(dwarf_errno(err)),
+              dwarf_errmsg(err));
       }
+
+      dwarf_dealloc(m_dbg, err, DW_DLA_ERROR);
+    }
+    else
+    {
+      count_dwarf_error(DWERR_BAD_FORM);
     }
   }
 
-  if(found)
+  return (ret == DW_DLV_OK);
+}
+
+bool DieHolder::get_operand(int const attr, ea_t const rel_addr, Dwarf_Small const atom,
+                            Dwarf_Unsigned *operand, bool only_locblock)
+{
+  LocList const &list = loclist_cache.get(*this, attr);
+  Dwarf_Locdesc const *locdesc = list.find(rel_addr, only_locblock);
+  bool ret = false;
+
+  if(locdesc != NULL)
   {
     CHECK_DWERR2(locdesc->ld_cents != 1, NULL,
                  "only 1 location in a location description is supported");
 
-    Dwarf_Loc *loc = &locdesc->ld_s[0];
+    Dwarf_Loc const *loc = &locdesc->ld_s[0];
 
     if(loc->lr_atom == atom)
     {
@@ -300,34 +433,18 @@ bool DieHolder::get_operand(int const attr, ea_t const rel_addr, Dwarf_Small con
 
 void DieHolder::get_frame_base_offsets(OffsetAreas &offset_areas)
 {
-  Dwarf_Attribute attrib = get_attr(DW_AT_frame_base);
-  Dwarf_Locdesc **llbuf = NULL;
-  Dwarf_Locdesc *locdesc = NULL;
-  Dwarf_Signed count = 0;
-  Dwarf_Error err = NULL;
-  DwarfDealloc dealloc(m_dbg);
-
-  CHECK_DWERR2(attrib == NULL, NULL,
-               "retrieving an operand implies finding the attribute...");
-
-  CHECK_DWERR(dwarf_loclist_n(attrib, &llbuf, &count, &err), err,
-              "cannot get location descriptions");
+  LocList const &list = loclist_cache.get(*this, DW_AT_frame_base);
 
-  dealloc.add(llbuf, DW_DLA_LIST);
-  for(Dwarf_Signed idx = 0; idx < count; ++idx)
+  for(size_t idx = 0; idx < list.descs.size(); ++idx)
   {
+    Dwarf_Locdesc const *locdesc = &list.descs[idx];
     ea_t low_pc = 0;
     ea_t high_pc = 0;
 
-    locdesc = llbuf[idx];
-    // handle deallocation too
-    dealloc.add(llbuf[idx], DW_DLA_LOCDESC);
-    dealloc.add(llbuf[idx]->ld_s, DW_DLA_LOC_BLOCK);
-
     // only 1 location in a location description is supported
     if(locdesc->ld_cents == 1)
     {
-      Dwarf_Loc *loc = &locdesc->ld_s[0];
+      Dwarf_Loc const *loc = &locdesc->ld_s[0];
       Dwarf_Small const atom = loc->lr_atom;
 
       // from a location block?
@@ -346,10 +463,10 @@ void DieHolder::get_frame_base_offsets(OffsetAreas &offset_areas)
       // is it the right atom to get the offset from?
       if(atom == DW_OP_breg4 || atom == DW_OP_breg5)
       {
-        offset_areas.push_back(OffsetArea(low_pc, high_pc,
-                                          // operand is unsigned, but should be signed...
-                                          static_cast<sval_t>(loc->lr_number),
-                                          (atom == DW_OP_breg5)));
+        offset_areas.add(OffsetArea(low_pc, high_pc,
+                                    // operand is unsigned, but should be signed...
+                                    static_cast<sval_t>(loc->lr_number),
+                                    (atom == DW_OP_breg5)));
       }
     }
   }
@@ -363,25 +480,16 @@ void DieHolder::retrieve_var(func_t *funptr, ea_t const cu_low_pc,
 
   if(attrib != NULL)
   {
-    Dwarf_Locdesc **llbuf = NULL;
-    Dwarf_Locdesc *locdesc = NULL;
-    Dwarf_Signed count = 0;
-    Dwarf_Error err = NULL;
-    DwarfDealloc dealloc(m_dbg);
+    LocList const &list = loclist_cache.get(*this, DW_AT_location);
     size_t const nb_args = (info == NULL) ? 0 : info->size();
+    qvector<OffsetArea const *> areas;
 
-    CHECK_DWERR(dwarf_loclist_n(attrib, &llbuf, &count, &err), err,
-                "cannot get location descriptions");
+    // the frame base areas of all the descriptions at once
+    offset_areas.find_all(list.descs, areas);
 
-    dealloc.add(llbuf, DW_DLA_LIST);
-    for(Dwarf_Signed idx = 0; idx < count; ++idx)
+    for(size_t idx = 0; idx < list.descs.size(); ++idx)
     {
-      locdesc = llbuf[idx];
-      // handle deallocation too
-      dealloc.add(llbuf[idx], DW_DLA_LOCDESC);
-      dealloc.add(llbuf[idx]->ld_s, DW_DLA_LOC_BLOCK);
-
-      visit(*this, locdesc, funptr, cu_low_pc, offset_areas, info);
+      visit(*this, &list.descs[idx], funptr, cu_low_pc, offset_areas, areas[idx], info);
 
       if(info != NULL && info->size() != nb_args)
       {
@@ -394,14 +502,12 @@ void DieHolder::retrieve_var(func_t *funptr, ea_t const cu_low_pc,
 
 Dwarf_Signed DieHolder::get_attr_small_val(int attr)
 {
-  Dwarf_Attribute attrib = NULL;
   Dwarf_Signed val = 0;
   Dwarf_Error err = NULL;
+  int const ret = read_small_val_attr(attr, &val, &err);
 
-  attrib = get_attr(attr);
-  CHECK_DWERR2(attrib == NULL, NULL, "cannot find DIE attribute %d\n", attr);
-  CHECK_DWERR(get_small_encoding_value(attrib, &val, &err), err,
-              "cannot get value of a DIE attribute %d", attr);
+  CHECK_DWERR2(ret == DW_DLV_NO_ENTRY, NULL, "cannot find DIE attribute %d\n", attr);
+  CHECK_DWERR(ret, err, "cannot get value of a DIE attribute %d", attr);
 
   return val;
 }
@@ -439,7 +545,7 @@ Dwarf_Off DieHolder::get_offset(void)
   {
     Dwarf_Error err = NULL;
 
-    CHECK_DWERR(dwarf_dieoffset(m_die, &m_offset, &err), err,
+    CHECK_DWERR(get_die_offset(m_die, &m_offset, &err), err,
                 "cannot get DIE offset");
     m_offset_used = true;
   }
@@ -452,7 +558,7 @@ Dwarf_Off DieHolder::get_CU_offset_range(Dwarf_Off *cu_length)
   Dwarf_Off cu_offset = 0;
   Dwarf_Error err = NULL;
 
-  CHECK_DWERR(dwarf_die_CU_offset_range(m_die, &cu_offset, cu_length, &err), err,
+  CHECK_DWERR(read_die_CU_offset_range(m_die, get_offset(), &cu_offset, cu_length, &err), err,
               "cannot get DIE CU offset range");
 
   return cu_offset;
@@ -460,15 +566,44 @@ Dwarf_Off DieHolder::get_CU_offset_range(Dwarf_Off *cu_length)
 
 Dwarf_Off DieHolder::get_CU_offset(void)
 {
+  CUInfo const *info = CUsHolder::find_info(get_offset());
   Dwarf_Off cu_offset = 0;
-  Dwarf_Error err = NULL;
 
-  CHECK_DWERR(dwarf_CU_dieoffset_given_die(m_die, &cu_offset, &err), err,
-              "cannot get CU DIE offset");
+  if(info != NULL)
+  {
+    cu_offset = info->die_offset;
+  }
+  else
+  {
+    Dwarf_Error err = NULL;
+
+    CHECK_DWERR(dwarf_CU_dieoffset_given_die(m_die, &cu_offset, &err), err,
+                "cannot get CU DIE offset");
+  }
 
   return cu_offset;
 }
 
+Dwarf_Addr DieHolder::get_CU_low_pc(void)
+{
+  CUInfo const *info = CUsHolder::find_info(get_offset());
+  Dwarf_Addr low_pc = 0;
+
+  if(info != NULL)
+  {
+    CHECK_DWERR2(!info->has_low_pc, NULL, "cannot find the CU low_pc");
+    low_pc = info->low_pc;
+  }
+  else
+  {
+    DieHolder cu_holder(m_dbg, get_CU_offset());
+
+    low_pc = cu_holder.get_addr_from_attr(DW_AT_low_pc);
+  }
+
+  return low_pc;
+}
+
 Dwarf_Half DieHolder::get_tag(void)
 {
   Dwarf_Half tag = 0;
@@ -600,7 +735,7 @@ char *DieHolder::get_type_comment(void)
       char buf[MAXSTR];
       int const ret = print_type_to_one_line(buf, sizeof(buf), idati, type, get_name(),
                                              NULL, fields, NULL);
-      if(ret >= 0);
+      if(ret >= 0)
       {
         size_t len = strlen(buf);
         comment = static_cast<char *>(qalloc(len + 1));
@@ -621,84 +756,295 @@ void DieHolder::init(Dwarf_Debug dbg, Dwarf_Die die, bool const dealloc_die)
   m_dbg = dbg;
   m_die = die;
   m_offset = 0;
-  m_name = NULL;
+  m_name_id = StringPool::NO_STRING;
+  m_attrs = NULL;
+  m_nb_attrs = 0;
   m_offset_used = false;
   m_dealloc_die = dealloc_die;
+  m_attrs_fetched = false;
+  m_name_fetched = false;
 }
 
-void CUsHolder::clean(void) throw()
+void DieHolder::prefetch_attrs(void)
 {
-  Dwarf_Error err = NULL;
-  int ret = 0;
-
-  for(size_t idx = 0; idx < size(); ++idx)
+  if(!m_attrs_fetched)
   {
-    dwarf_dealloc(m_dbg, (*this)[idx], DW_DLA_DIE);
-    (*this)[idx] = NULL;
-  }
+    Dwarf_Error err = NULL;
+    Dwarf_Signed nb_codes = 0;
 
-  ret = dwarf_finish(m_dbg, &err);
-  if(ret != DW_DLV_OK)
-  {
-    MSG("libdwarf cleanup failed: %s\n", dwarf_errmsg(err));
+    // the DIE may have no attribute
+    CHECK_DWERR2(dwarf_attrlist(m_die, &m_attrs, &m_nb_attrs, &err) == DW_DLV_ERROR, err,
+                 "error when getting the list of attributes");
+
+    // the list is only decoded once, even if a code cannot be read
+    m_attrs_fetched = true;
+    memset(m_attr_codes, 0, sizeof(m_attr_codes));
+    nb_codes = qmin(m_nb_attrs, static_cast<Dwarf_Signed>(MAX_PREFETCHED_ATTRS));
+    for(Dwarf_Signed idx = 0; idx < nb_codes; ++idx)
+    {
+      CHECK_DWERR(dwarf_whatattr(m_attrs[idx], &m_attr_codes[idx], &err), err,
+                  "cannot get the code of attribute %d", static_cast<int>(idx));
+    }
   }
+}
 
-  clear();
+Dwarf_Half DieHolder::get_attr_code(Dwarf_Signed const idx)
+{
+  Dwarf_Half code = 0;
 
-  m_dbg = NULL;
-  if(m_fd != -1)
+  if(idx < MAX_PREFETCHED_ATTRS)
   {
-    close(m_fd), m_fd = -1;
+    code = m_attr_codes[idx];
   }
+  else
+  {
+    Dwarf_Error err = NULL;
+
+    CHECK_DWERR(dwarf_whatattr(m_attrs[idx], &code, &err), err,
+                "cannot get the code of attribute %d", static_cast<int>(idx));
+  }
+
+  return code;
+}
+
+int get_die_from_offset(Dwarf_Debug dbg, Dwarf_Off const offset, Dwarf_Die *die,
+                        Dwarf_Error *err) throw()
+{
+#ifdef HAVE_TYPE_UNITS
+  Dwarf_Off const types_base = CUsHolder::get_types_base();
+  Dwarf_Bool const is_info = (offset < types_base);
+
+  return dwarf_offdie_b(dbg, is_info ? offset : offset - types_base, is_info, die, err);
+#else
+  return dwarf_offdie(dbg, offset, die, err);
+#endif
 }
 
-void do_dies_traversal(CUsHolder const &cus_holder,
-                       die_visitor_fun visit)
+int get_die_offset(Dwarf_Die die, Dwarf_Off *offset, Dwarf_Error *err) throw()
 {
-  Dwarf_Debug dbg = cus_holder.get_dbg();
-  qstack<Dwarf_Die> stack;
+  int const ret = dwarf_dieoffset(die, offset, err);
 
-  for(size_t idx = 0; idx < cus_holder.size(); ++idx)
+#ifdef HAVE_TYPE_UNITS
+  if(ret == DW_DLV_OK && !dwarf_get_die_infotypes_flag(die))
   {
-    Dwarf_Die cu_die = cus_holder[idx];
+    *offset += CUsHolder::get_types_base();
+  }
+#endif
+
+  return ret;
+}
 
-    stack.push_back(cu_die);
+int read_die_CU_offset_range(Dwarf_Die die, Dwarf_Off const die_offset,
+                             Dwarf_Off *cu_offset, Dwarf_Off *cu_length,
+                             Dwarf_Error *err) throw()
+{
+  CUInfo const *info = CUsHolder::find_info(die_offset);
+  int ret = DW_DLV_OK;
 
-    while(!stack.empty())
+  if(info != NULL)
+  {
+    *cu_offset = info->offset;
+    *cu_length = info->length;
+  }
+  else
+  {
+    ret = dwarf_die_CU_offset_range(die, cu_offset, cu_length, err);
+#ifdef HAVE_TYPE_UNITS
+    // relative to .debug_types, like the DIE offset
+    if(ret == DW_DLV_OK && !dwarf_get_die_infotypes_flag(die))
     {
-      Dwarf_Die other_die = NULL;
-      Dwarf_Die current_die = stack.back();
-      DieHolder holder(dbg, current_die, current_die != cu_die);
+      *cu_offset += CUsHolder::get_types_base();
+    }
+#endif
+  }
 
-      stack.pop_back();
+  return ret;
+}
 
-      (*visit)(holder);
+int read_die_ref(Dwarf_Die die, Dwarf_Off const die_offset, Dwarf_Attribute attrib,
+                 Dwarf_Off *offset, uint64 *signature, Dwarf_Error *err) throw()
+{
+  Dwarf_Half form = 0;
+  int ret = (attrib == NULL) ? DW_DLV_NO_ENTRY : dwarf_whatform(attrib, &form, err);
+
+  *signature = 0;
+  if(ret == DW_DLV_OK)
+  {
+    switch(form)
+    {
+    case DW_FORM_ref_addr:
+      ret = dwarf_global_formref(attrib, offset, err);
+      break;
+    case DW_FORM_ref1:
+    case DW_FORM_ref2:
+    case DW_FORM_ref4:
+    case DW_FORM_ref8:
+    case DW_FORM_ref_udata:
+      ret = dwarf_formref(attrib, offset, err);
+      if(ret == DW_DLV_OK)
+      {
+        Dwarf_Off cu_offset = 0;
+        Dwarf_Off cu_length = 0;
 
-      try
+        ret = read_die_CU_offset_range(die, die_offset, &cu_offset, &cu_length, err);
+        *offset += cu_offset;
+      }
+      break;
+#ifdef HAVE_TYPE_UNITS
+    case DW_FORM_ref_sig8:
       {
-        other_die = holder.get_sibling();
-        if(other_die != NULL)
+        Dwarf_Sig8 sig8;
+
+        ret = dwarf_formsig8(attrib, &sig8, err);
+        if(ret == DW_DLV_OK && !CUsHolder::find_signature(get_signature_key(sig8), offset))
         {
-          stack.push_back(other_die);
+          *signature = get_signature_key(sig8);
+          ret = DW_DLV_NO_ENTRY;
         }
       }
-      catch(DieException const &exc)
-      {
-        MSG("cannot retrieve current DIE sibling (skipping): %s\n", exc.what());
-      }
+      break;
+#endif
+    default:
+      ret = DW_DLV_ERROR;
+      break;
+    }
+  }
+
+  return ret;
+}
+
+int read_die_member_offset(Dwarf_Debug dbg, Dwarf_Off const die_offset,
+                           Dwarf_Attribute attrib, Dwarf_Unsigned *offset,
+                           Dwarf_Error *err) throw()
+{
+  Dwarf_Half form = 0;
+  int ret = (attrib == NULL) ? DW_DLV_NO_ENTRY : dwarf_whatform(attrib, &form, err);
+
+  if(ret == DW_DLV_OK)
+  {
+    CUInfo const *info = CUsHolder::find_info(die_offset);
+    bool const is_constant = (form == DW_FORM_data1 || form == DW_FORM_data2 ||
+                              form == DW_FORM_udata || form == DW_FORM_sdata ||
+                              ((form == DW_FORM_data4 || form == DW_FORM_data8) &&
+                               info != NULL && info->version >= 4));
+
+    if(is_constant)
+    {
+      Dwarf_Signed val = 0;
 
-      try
+      ret = get_small_encoding_value(attrib, &val, err);
+      *offset = static_cast<Dwarf_Unsigned>(val);
+    }
+    else if(form == DW_FORM_block1 || form == DW_FORM_block2 ||
+            form == DW_FORM_block4 || form == DW_FORM_block)
+    {
+      Dwarf_Locdesc **llbuf = NULL;
+      Dwarf_Signed count = 0;
+
+      // a single location block, not worth the location lists cache
+      ret = dwarf_loclist_n(attrib, &llbuf, &count, err);
+      if(ret == DW_DLV_OK)
       {
-        other_die = holder.get_child();
-        if(other_die != NULL)
+        if(count == 1 && !llbuf[0]->ld_from_loclist && llbuf[0]->ld_cents == 1 &&
+           llbuf[0]->ld_s[0].lr_atom == DW_OP_plus_uconst)
         {
-          stack.push_back(other_die);
+          *offset = llbuf[0]->ld_s[0].lr_number;
         }
-      }
-      catch(DieException const &exc)
-      {
-        MSG("cannot retrieve current DIE child (skipping): %s\n", exc.what());
+        else
+        {
+          ret = DW_DLV_ERROR;
+        }
+
+        for(Dwarf_Signed idx = 0; idx < count; ++idx)
+        {
+          dwarf_dealloc(dbg, llbuf[idx]->ld_s, DW_DLA_LOC_BLOCK);
+          dwarf_dealloc(dbg, llbuf[idx], DW_DLA_LOCDESC);
+        }
+
+        dwarf_dealloc(dbg, llbuf, DW_DLA_LIST);
       }
     }
+    else
+    {
+      ret = DW_DLV_ERROR;
+    }
   }
+
+  return ret;
+}
+
+Dwarf_Off const CUsHolder::NO_TYPES_BASE;
+
+// holder of the CU table used by the DIE holders
+static CUsHolder const *current_cus_holder = NULL;
+
+CUsHolder::CUsHolder(DwarfFile *file)
+  : m_file(file), m_types_base(NO_TYPES_BASE)
+{
+  current_cus_holder = this;
+}
+
+CUsHolder::~CUsHolder(void) throw()
+{
+  clean();
+
+  if(current_cus_holder == this)
+  {
+    current_cus_holder = NULL;
+  }
+}
+
+CUInfo const *CUsHolder::find_info(Dwarf_Off const offset) throw()
+{
+  CUInfo const *found = NULL;
+
+  if(current_cus_holder != NULL)
+  {
+    qvector<CUInfo> const &infos = current_cus_holder->m_infos;
+    CUInfo const *info = upper_bound(infos.begin(), infos.end(), offset, is_before);
+
+    if(info != infos.begin() && offset < (info - 1)->offset + (info - 1)->length)
+    {
+      found = info - 1;
+    }
+  }
+
+  return found;
+}
+
+Dwarf_Off CUsHolder::get_types_base(void) throw()
+{
+  return (current_cus_holder == NULL) ? NO_TYPES_BASE : current_cus_holder->m_types_base;
+}
+
+bool CUsHolder::find_signature(uint64 const key, Dwarf_Off *type_offset) throw()
+{
+  Dwarf_Off const *found = (current_cus_holder == NULL) ? NULL :
+    current_cus_holder->m_signatures.find(key);
+
+  if(found != NULL)
+  {
+    *type_offset = *found;
+  }
+
+  return (found != NULL);
+}
+
+void CUsHolder::clean(void) throw()
+{
+  Dwarf_Debug dbg = get_dbg();
+
+  for(size_t idx = 0; idx < size(); ++idx)
+  {
+    dwarf_dealloc(dbg, (*this)[idx], DW_DLA_DIE);
+    (*this)[idx] = NULL;
+  }
+
+  clear();
+  m_infos.clear();
+  m_types_base = NO_TYPES_BASE;
+  m_signatures.clear();
+
+  // also does the libdwarf cleanup
+  delete m_file, m_file = NULL;
 }
@@ -9,6 +9,7 @@
 // IDA headers
 #include <ida.hpp>
 #include <area.hpp>
+#include <struct.hpp>
 #include <typeinf.hpp>
 
 // additional libs headers
@@ -17,11 +18,15 @@
 
 // local headers
 #include "die_cache.hpp"
+#include "dwarf_file.hpp"
+#include "offset_table.hpp"
+#include "profiling.hpp"
+#include "string_pool.hpp"
 
 using namespace std;
 
 #define CHECK_DWERR2(cond, err, fmt, ...) if(cond) { throw DieException(__FILE__, __LINE__, err, fmt, ## __VA_ARGS__); }
-#define CHECK_DWERR(cond, err, fmt, ...) CHECK_DWERR2((cond) != DW_DLV_OK, err, fmt, ## __VA_ARGS__)
+#define CHECK_DWERR(cond, err, fmt, ...) CHECK_DWERR2((profiler.count(COUNTER_DWARF_CALLS), (cond) != DW_DLV_OK), err, fmt, ## __VA_ARGS__)
 #define THROW_DWERR(fmt, ...) throw DieException(__FILE__, __LINE__, NULL, fmt, ## __VA_ARGS__);
 
 struct OffsetArea : public area_t
@@ -36,11 +41,14 @@ struct OffsetArea : public area_t
   bool use_fp;
 };
 
-class OffsetAreas : public qvector<OffsetArea>
+// frame base offsets of a subprogram, sorted by address
+// the areas do not overlap: they must be added by increasing address
+// (the overlapping parts are dropped)
+class OffsetAreas
 {
 public:
   OffsetAreas(void) throw()
-    : m_base(0), m_rel_addr(BADADDR)
+    : m_base(0), m_rel_addr(BADADDR), m_first_fp(0), m_frame(NULL)
   {
 
   }
@@ -61,37 +69,108 @@ public:
     return m_rel_addr;
   }
 
+  size_t size(void) const throw()
+  {
+    return m_areas.size();
+  }
+
+  // IDA frame of the subprogram, got once for all its variables
+  void set_frame(struc_t *fptr) throw()
+  {
+    m_frame = fptr;
+  }
+
+  struc_t *get_frame(void) const throw()
+  {
+    return m_frame;
+  }
+
+  void add(OffsetArea const &area);
+
+  // areas to get the frame base offsets of all the location descriptions
+  // of a variable from (NULL if none), found in a single sweep
+  // (the descriptions are sorted by low PC, see LocList).
+  // a location block is valid in the entire subprogram
+  // (the first area usable with the stack base is taken),
+  // else the area must contain the location range.
+  void find_all(qvector<Dwarf_Locdesc> const &descs,
+                qvector<OffsetArea const *> &found) const;
+
 private:
+  qvector<OffsetArea> m_areas;
   sval_t m_base;
   ea_t m_rel_addr; // CU relative address where the base is applicable
+  size_t m_first_fp; // index of the first ebp based area
+  struc_t *m_frame;
+
+  // can the offset of an esp based area be used at this address?
+  bool after_base(ea_t const addr) const throw()
+  {
+    return (m_rel_addr != BADADDR && addr >= m_rel_addr);
+  }
+
+  // index of the last area beginning before the address
+  // (size() if none)
+  size_t find_idx(ea_t const addr) const throw();
+
+  // the area at this index, if it can be used for the location range
+  OffsetArea const *get_usable(size_t const idx, area_t const &range) const throw();
+
+  OffsetArea const *find_whole_func(void) const throw();
 };
 
 // forward class declaration
 class DieHolder;
 
+// the frame base area of the location description is given
+// (NULL if none, see OffsetAreas::find_all)
 typedef void (*var_visitor_fun)(DieHolder &, Dwarf_Locdesc const *,
                                 func_t *, ea_t const, OffsetAreas const &,
-                                func_type_info_t *);
+                                OffsetArea const *, func_type_info_t *);
 
 int get_small_encoding_value(Dwarf_Attribute attrib, Dwarf_Signed *val, Dwarf_Error *err);
 
+// kinds of the counted DWARF errors
+enum dwarf_error_kind { DWERR_LIBDWARF, // libdwarf error
+                        DWERR_BAD_FORM, // unexpected attribute form
+                        DWERR_SKIPPED_DIE, // DIE not processed after an exception
+                        DWERR_UNKNOWN_SIGNATURE, // ref_sig8 without its type unit
+                        NB_DWERR_KINDS };
+
+// count an error of this kind
+// returns true if its message should be logged (only the first ones are)
+bool count_dwarf_error(dwarf_error_kind const kind) throw();
+
+// show the error counters (if any), then reset them
+void report_dwarf_errors(void) throw();
+
+// the message is only formatted when asked (by what()),
+// the exceptions caught and counted without being logged cost no formatting.
+// fmt must live as long as the exception (a literal),
+// with at most one argument (int or Dwarf_Unsigned)
 class DieException : public exception
 {
 public:
-  DieException(char const *file, int const line, Dwarf_Error err, char const *fmt, ...) throw()
-    : m_err(err)
+  DieException(char const *file, int const line, Dwarf_Error err, char const *fmt) throw()
+    : m_file(file), m_line(line), m_err(err), m_fmt(fmt), m_arg_kind(ARG_NONE), m_arg(0)
   {
-    ostringstream oss;
-    va_list ap;
-    char buffer[MAXSTR];
+    profiler.count(COUNTER_EXCEPTIONS);
+  }
 
-    va_start(ap, fmt);
-    qvsnprintf(buffer, sizeof(buffer), fmt, ap);
-    va_end(ap);
+  DieException(char const *file, int const line, Dwarf_Error err, char const *fmt,
+               int const arg) throw()
+    : m_file(file), m_line(line), m_err(err), m_fmt(fmt), m_arg_kind(ARG_INT),
+      m_arg(static_cast<Dwarf_Unsigned>(arg))
+  {
+    profiler.count(COUNTER_EXCEPTIONS);
+  }
 
-    oss << '(' << file << ':' << line << ") " <<
-      buffer << " (" << dwarf_errno(err) << ": " << dwarf_errmsg(err) << ')';
-    m_msg = oss.str();
+  DieException(char const *file, int const line, Dwarf_Error err, char const *fmt,
+               Dwarf_Unsigned const arg) throw()
+    : m_file(file), m_line(line), m_err(err), m_fmt(fmt), m_arg_kind(ARG_UNSIGNED),
+      m_arg(arg)
+  {
+    profiler.count(COUNTER_EXCEPTIONS);
   }
 
   virtual ~DieException(void) throw()
@@ -99,8 +178,32 @@ public:
 
   }
 
+  // the full message is only built when asked
   virtual char const *what(void) const throw()
   {
+    if(m_msg.empty())
+    {
+      char desc[MAXSTR];
+      ostringstream oss;
+
+      switch(m_arg_kind)
+      {
+      case ARG_INT:
+        format(desc, sizeof(desc), m_fmt, static_cast<int>(m_arg));
+        break;
+      case ARG_UNSIGNED:
+        format(desc, sizeof(desc), m_fmt, m_arg);
+        break;
+      default:
+        format(desc, sizeof(desc), m_fmt);
+        break;
+      }
+
+      oss << '(' << m_file << ':' << m_line << ") " <<
+        desc << " (" << dwarf_errno(m_err) << ": " << dwarf_errmsg(m_err) << ')';
+      m_msg = oss.str();
+    }
+
     return m_msg.c_str();
   }
 
@@ -110,10 +213,30 @@ public:
   }
 
 private:
+  enum arg_kind { ARG_NONE, ARG_INT, ARG_UNSIGNED };
+
+  char const *m_file;
+  int m_line;
   Dwarf_Error m_err;
-  string m_msg;
+  char const *m_fmt;
+  arg_kind m_arg_kind;
+  Dwarf_Unsigned m_arg;
+  mutable string m_msg;
+
+  static void format(char *buf, size_t const size, char const *fmt, ...) throw()
+  {
+    va_list ap;
+
+    va_start(ap, fmt);
+    qvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+  }
 };
 
+// the codes of that many attributes are kept by a DIE holder
+// (the codes of the next ones are asked to libdwarf)
+#define MAX_PREFETCHED_ATTRS 16
+
 // RAII-powered DIE holder to avoid dwarf_dealloc nightmare
 class DieHolder
 {
@@ -124,6 +247,10 @@ public:
 
   ~DieHolder(void) throw();
 
+  // release the held DIE and hold another one
+  // (to reuse the holder, see DieHolderPool)
+  void reset(Dwarf_Debug dbg, Dwarf_Die die, bool const dealloc_die=true) throw();
+
   // operators
 
   bool operator==(DieHolder const &other)
@@ -145,8 +272,12 @@ public:
 
   // warning: this is the real DIE name, not the one in idati!
   // these 2 names might be different if there was a conflict
+  // (interned in the DIE names pool, valid until the end of the run)
   char const *get_name(void);
 
+  // id of the name in the DIE names pool (StringPool::NO_STRING if none)
+  uint32 get_name_id(void);
+
   Dwarf_Attribute get_attr(int attr);
 
   Dwarf_Signed get_nb_attrs(void);
@@ -155,16 +286,28 @@ public:
 
   Dwarf_Off get_ref_from_attr(int attr);
 
+  // exception-free accessors, for the expected misses:
+  // returns false if there is no such attribute or if it cannot be decoded
+  // (the decoding errors are counted)
+
+  bool get_addr_from_attr(int attr, Dwarf_Addr *addr);
+
+  bool get_ref_from_attr(int attr, Dwarf_Off *offset);
+
+  bool get_attr_small_val(int attr, Dwarf_Signed *val);
+
+  bool get_member_offset(Dwarf_Unsigned *offset);
+
   bool get_operand(int const attr, ea_t const rel_addr, Dwarf_Small const atom,
                    Dwarf_Unsigned *operand, bool only_locblock=false);
 
   Dwarf_Unsigned get_member_offset(void)
   {
     Dwarf_Unsigned offset = 0;
-    bool ret = get_operand(DW_AT_data_member_location, 0, DW_OP_plus_uconst,
-                           &offset, true);
+    Dwarf_Error err = NULL;
+    int const ret = read_member_offset(&offset, &err);
 
-    CHECK_DWERR2(!ret, NULL, "cannot get a member offset");
+    CHECK_DWERR2(ret != DW_DLV_OK, err, "cannot get a member offset");
 
     return offset;
   }
@@ -197,6 +340,8 @@ public:
 
   Dwarf_Off get_CU_offset(void);
 
+  Dwarf_Addr get_CU_low_pc(void);
+
   Dwarf_Half get_tag(void);
 
   Dwarf_Die get_child(void);
@@ -233,12 +378,16 @@ private:
   Dwarf_Debug m_dbg;
   Dwarf_Die m_die;
   Dwarf_Off m_offset;
-  char *m_name;
-  typedef map<int, Dwarf_Attribute> MapAttrs;
-  MapAttrs m_attrs;
+  uint32 m_name_id;
+  // all the attributes are fetched at the first access
+  Dwarf_Attribute *m_attrs;
+  Dwarf_Signed m_nb_attrs;
+  Dwarf_Half m_attr_codes[MAX_PREFETCHED_ATTRS];
   Ptr m_origin_holder;
   bool m_offset_used;
   bool m_dealloc_die;
+  bool m_attrs_fetched;
+  bool m_name_fetched;
 
   // no copying or assignment
   DieHolder(DieHolder const &);
@@ -246,39 +395,167 @@ private:
 
   // common member vars init for the constructors
   void init(Dwarf_Debug dbg, Dwarf_Die die, bool const dealloc_die);
+
+  void clean(void) throw();
+
+  // decode the attribute list only once
+  void prefetch_attrs(void);
+
+  Dwarf_Half get_attr_code(Dwarf_Signed const idx);
+
+  // attribute readers shared by the accessors
+  // return DW_DLV_NO_ENTRY if there is no such attribute,
+  // DW_DLV_ERROR with a NULL error for an unexpected form
+
+  int read_addr_attr(int attr, Dwarf_Addr *addr, Dwarf_Error *err);
+
+  int read_ref_attr(int attr, Dwarf_Off *offset, Dwarf_Error *err);
+
+  int read_small_val_attr(int attr, Dwarf_Signed *val, Dwarf_Error *err);
+
+  int read_member_offset(Dwarf_Unsigned *offset, Dwarf_Error *err);
+
+  // count the error of a status-returning accessor
+  bool check_status(int const ret, Dwarf_Error err) throw();
 };
 
+// DWARF 4 type units (.debug_types) need a libdwarf reading them
+// (build with TYPE_UNITS=1, not supported by the 20091012 one).
+// their DIEs get offsets after the end of .debug_info:
+// the DIE cache and the references see a single offset space.
+// the type units are walked like the CUs (each type is imported once),
+// the DW_FORM_ref_sig8 references are resolved with a signature index.
+
+// libdwarf DIE at an offset of the offset space
+int get_die_from_offset(Dwarf_Debug dbg, Dwarf_Off const offset, Dwarf_Die *die,
+                        Dwarf_Error *err) throw();
+
+// offset of a libdwarf DIE in the offset space
+int get_die_offset(Dwarf_Die die, Dwarf_Off *offset, Dwarf_Error *err) throw();
+
+#ifdef HAVE_TYPE_UNITS
+// key of a type unit signature in the index
+inline uint64 get_signature_key(Dwarf_Sig8 const &signature) throw()
+{
+  uint64 key = 0;
+
+  memcpy(&key, signature.signature, sizeof(key));
+
+  return key;
+}
+#endif
+
+// attribute readers shared by the DIE holders and the type decoding workers
+// (see type_decoder.hpp): they only call libdwarf and read the CUs table,
+// so they neither count nor log anything (the callers do).
+
+// offset and length of the CU (or type unit) of a DIE
+int read_die_CU_offset_range(Dwarf_Die die, Dwarf_Off const die_offset,
+                             Dwarf_Off *cu_offset, Dwarf_Off *cu_length,
+                             Dwarf_Error *err) throw();
+
+// offset of the DIE referenced by an attribute (DW_DLV_NO_ENTRY if attrib is NULL)
+// a type signature without its type unit is also DW_DLV_NO_ENTRY,
+// with its key in signature (0 otherwise)
+int read_die_ref(Dwarf_Die die, Dwarf_Off const die_offset, Dwarf_Attribute attrib,
+                 Dwarf_Off *offset, uint64 *signature, Dwarf_Error *err) throw();
+
+// DW_AT_data_member_location: a location block (DW_OP_plus_uconst),
+// or a constant since DWARF 4 (DWARF 3 data4/data8 forms are location list pointers)
+int read_die_member_offset(Dwarf_Debug dbg, Dwarf_Off const die_offset,
+                           Dwarf_Attribute attrib, Dwarf_Unsigned *offset,
+                           Dwarf_Error *err) throw();
+
 // compilation unit DIEs are kept in this object
 // to only have to retrieve them one time
+// facts about a CU (or a type unit) read once by retrieve_cus
+struct CUInfo
+{
+  Dwarf_Off offset; // CU header offset (in the offset space)
+  Dwarf_Off length; // header included
+  Dwarf_Off die_offset;
+  Dwarf_Addr low_pc;
+  bool has_low_pc;
+  Dwarf_Half version;
+  Dwarf_Half address_size;
+  Dwarf_Signed language; // 0 if none
+};
+
+// the CU DIEs to visit (the type units after the CUs)
+// and the table of all the units (partial units included)
+// the DIE holders look up the table of the last created CUs holder
 class CUsHolder : public qvector<Dwarf_Die>
 {
 public:
-  CUsHolder(Dwarf_Debug dbg, int const fd)
-    : m_dbg(dbg), m_fd(fd)
+  // the file is owned by the CUs holder
+  CUsHolder(DwarfFile *file);
+
+  virtual ~CUsHolder(void) throw();
+
+  void reset(DwarfFile *file)
   {
+    clean();
+    m_file = file;
+  }
 
+  Dwarf_Debug get_dbg(void) const throw()
+  {
+    return (m_file == NULL) ? NULL : m_file->get_dbg();
   }
 
-  virtual ~CUsHolder(void) throw()
+  // path of the file with the DWARF infos
+  // (to open other libdwarf handles on it)
+  char const *get_path(void) const throw()
   {
-    clean();
+    return (m_file == NULL) ? "" : m_file->get_path();
   }
 
-  void reset(Dwarf_Debug dbg, int const fd)
+  DwarfFile *get_file(void) const throw()
   {
-    clean();
-    m_dbg = dbg;
-    m_fd = fd;
+    return m_file;
   }
 
-  Dwarf_Debug get_dbg(void) const throw()
+  // the CUs must be added by increasing offset
+  void add_info(CUInfo const &info)
   {
-    return m_dbg;
+    m_infos.push_back(info);
+  }
+
+  // the type unit DIEs get offsets after this one
+  // (set to the end of .debug_info before retrieving the type units)
+  void set_types_base(Dwarf_Off const types_base) throw()
+  {
+    m_types_base = types_base;
   }
 
+  // the type DIE of a type unit (in the offset space)
+  void add_signature(uint64 const key, Dwarf_Off const type_offset) throw()
+  {
+    m_signatures.get(key) = type_offset;
+  }
+
+  // CU containing the DIE at this offset in the current CUs holder
+  // returns NULL if not known (then ask libdwarf)
+  static CUInfo const *find_info(Dwarf_Off const offset) throw();
+
+  // NO_TYPES_BASE if the current CUs holder has no type units
+  static Dwarf_Off get_types_base(void) throw();
+
+  // type DIE offset of a type unit signature of the current CUs holder
+  static bool find_signature(uint64 const key, Dwarf_Off *type_offset) throw();
+
+  static Dwarf_Off const NO_TYPES_BASE = ~static_cast<Dwarf_Off>(0);
+
 private:
-  Dwarf_Debug m_dbg;
-  int m_fd;
+  DwarfFile *m_file;
+  qvector<CUInfo> m_infos;
+  Dwarf_Off m_types_base;
+  OffsetTable<Dwarf_Off> m_signatures;
+
+  static bool is_before(Dwarf_Off const offset, CUInfo const &info) throw()
+  {
+    return offset < info.offset;
+  }
 
   void clean(void) throw();
 
@@ -301,12 +578,12 @@ typedef void(*die_visitor_fun)(DieHolder &die);
     }                                                           \
     catch(DieException const &exc)                              \
     {                                                           \
-      MSG("cannot process DIE (skipping): %s\n",                \
-          exc.what());                                          \
+      if(count_dwarf_error(DWERR_SKIPPED_DIE))                  \
+      {                                                         \
+        MSG("cannot process DIE (skipping): %s\n",              \
+            exc.what());                                        \
+      }                                                         \
     }                                                           \
   }
 
-void do_dies_traversal(CUsHolder const &cus_holder,
-                       die_visitor_fun visit);
-
 #endif // IDADWARF_DIE_UTILS_HPP
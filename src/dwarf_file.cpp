@@ -0,0 +1,521 @@
+#include "dwarf_file.hpp"
+
+#ifdef __NT__
+# include <windows.h>
+# include <io.h>
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+// local headers
+#include "ida_utils.hpp"
+
+// ELF definitions
+// (the libelf headers are not needed to read the section headers)
+#define ELF_CLASS32 1
+#define ELF_CLASS64 2
+#define ELF_DATA2MSB 2
+#define ELF_TYPE_REL 1
+#define ELF_SHT_NOBITS 8
+#define ELF_SHN_XINDEX 0xFFFF
+// the biggest ELF header (ELF64)
+#define ELF_MAX_EHDR_SIZE 0x40
+
+// positions of the used fields in the ELF headers
+struct ElfLayout
+{
+  size_t addr_size;
+  size_t ehdr_size;
+  size_t e_type;
+  size_t e_shoff;
+  size_t e_shentsize;
+  size_t e_shnum;
+  size_t e_shstrndx;
+  size_t shdr_size;
+  size_t sh_name;
+  size_t sh_type;
+  size_t sh_addr;
+  size_t sh_offset;
+  size_t sh_size;
+  size_t sh_link;
+};
+
+static ElfLayout const elf32_layout =
+{
+  4, 0x34, 0x10, 0x20, 0x2E, 0x30, 0x32,
+  0x28, 0x00, 0x04, 0x0C, 0x10, 0x14, 0x18
+};
+
+static ElfLayout const elf64_layout =
+{
+  8, 0x40, 0x10, 0x28, 0x3A, 0x3C, 0x3E,
+  0x40, 0x00, 0x04, 0x10, 0x18, 0x20, 0x28
+};
+
+// views must begin at a multiple of that
+static uint64 get_map_granularity(void) throw()
+{
+  uint64 granularity = 0;
+
+#ifdef __NT__
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  granularity = static_cast<uint64>(info.dwAllocationGranularity);
+#else
+  long const page_size = sysconf(_SC_PAGESIZE);
+
+  granularity = (page_size > 0) ? static_cast<uint64>(page_size) : 4096;
+#endif
+
+  return granularity;
+}
+
+// libdwarf object access methods
+struct ElfAccess
+{
+  static int get_section_info(void *obj, Dwarf_Half section_index,
+                              Dwarf_Obj_Access_Section *return_section,
+                              int * /* error */)
+  {
+    DwarfFile const *file = static_cast<DwarfFile const *>(obj);
+    int ret = DW_DLV_NO_ENTRY;
+
+    if(section_index < file->m_sections.size())
+    {
+      DwarfFile::ElfSection const &section = file->m_sections[section_index];
+
+      memset(return_section, 0, sizeof(*return_section));
+      return_section->addr = section.addr;
+      // no data in the file (stripped sections in a debug file)
+      return_section->size = (section.type == ELF_SHT_NOBITS) ? 0 : section.size;
+      return_section->name = section.name;
+      ret = DW_DLV_OK;
+    }
+
+    return ret;
+  }
+
+  static Dwarf_Endianness get_byte_order(void *obj)
+  {
+    return static_cast<DwarfFile const *>(obj)->m_msb ? DW_OBJECT_MSB : DW_OBJECT_LSB;
+  }
+
+  // same sizes as the libdwarf ELF access
+  static Dwarf_Small get_length_size(void *obj)
+  {
+    return static_cast<DwarfFile const *>(obj)->m_elf64 ? 8 : 4;
+  }
+
+  static Dwarf_Small get_pointer_size(void *obj)
+  {
+    return static_cast<DwarfFile const *>(obj)->m_elf64 ? 8 : 4;
+  }
+
+  static Dwarf_Unsigned get_section_count(void *obj)
+  {
+    return static_cast<DwarfFile const *>(obj)->m_sections.size();
+  }
+
+  static int load_section(void *obj, Dwarf_Half section_index,
+                          Dwarf_Small **return_data, int *error)
+  {
+    DwarfFile *file = static_cast<DwarfFile *>(obj);
+    int ret = DW_DLV_ERROR;
+
+    if(section_index < file->m_sections.size())
+    {
+      DwarfFile::ElfSection &section = file->m_sections[section_index];
+
+      // libdwarf only reads the section data
+      if(section.data == NULL && section.type != ELF_SHT_NOBITS)
+      {
+        section.data = const_cast<Dwarf_Small *>(file->map(section.offset, section.size));
+      }
+
+      if(section.data != NULL)
+      {
+        *return_data = section.data;
+        ret = DW_DLV_OK;
+      }
+    }
+
+    if(ret != DW_DLV_OK)
+    {
+      *error = DW_DLE_MAF;
+    }
+
+    return ret;
+  }
+
+  // relocatable objects are not mapped
+  static int relocate_a_section(void * /* obj */, Dwarf_Half /* section_index */,
+                                Dwarf_Debug /* dbg */, int * /* error */)
+  {
+    return DW_DLV_NO_ENTRY;
+  }
+};
+
+static Dwarf_Obj_Access_Methods elf_access_methods =
+{
+  ElfAccess::get_section_info,
+  ElfAccess::get_byte_order,
+  ElfAccess::get_length_size,
+  ElfAccess::get_pointer_size,
+  ElfAccess::get_section_count,
+  ElfAccess::load_section,
+  ElfAccess::relocate_a_section
+};
+
+DwarfFile::DwarfFile(void) throw()
+  : m_fd(-1), m_dbg(NULL), m_mapped(false), m_file_size(0), m_mapping(NULL),
+    m_msb(false), m_elf64(false)
+{
+  memset(&m_access, 0, sizeof(m_access));
+}
+
+int DwarfFile::open(char const *path, Dwarf_Error *err) throw()
+{
+  int ret = DW_DLV_ERROR;
+
+  close();
+  m_path = path;
+  m_fd = ::open(path, O_RDONLY | O_BINARY, 0);
+
+  if(m_fd >= 0)
+  {
+    if(open_mapping() && read_sections())
+    {
+      m_access.object = this;
+      m_access.methods = &elf_access_methods;
+      m_mapped = true;
+
+      ret = dwarf_object_init(&m_access, NULL, NULL, &m_dbg, err);
+      if(ret != DW_DLV_OK)
+      {
+        m_dbg = NULL;
+        m_mapped = false;
+      }
+    }
+
+    // the file cannot be read from the mapping, let libdwarf read it
+    if(!m_mapped && ret == DW_DLV_ERROR)
+    {
+      close_mapping();
+      ret = dwarf_init(m_fd, DW_DLC_READ, NULL, NULL, &m_dbg, err);
+    }
+
+    if(ret != DW_DLV_OK)
+    {
+      m_dbg = NULL;
+      close();
+    }
+  }
+
+  return ret;
+}
+
+bool DwarfFile::open_sections(char const *path) throw()
+{
+  bool ok = false;
+
+  close();
+  m_path = path;
+  m_fd = ::open(path, O_RDONLY | O_BINARY, 0);
+
+  if(m_fd >= 0)
+  {
+    ok = (open_mapping() && read_sections());
+  }
+
+  if(!ok)
+  {
+    close();
+  }
+
+  return ok;
+}
+
+void DwarfFile::close(void) throw()
+{
+  string error;
+
+  if(!close(&error))
+  {
+    MSG("libdwarf cleanup failed: %s\n", error.c_str());
+  }
+}
+
+bool DwarfFile::close(string *error) throw()
+{
+  bool ok = true;
+
+  if(m_dbg != NULL)
+  {
+    Dwarf_Error err = NULL;
+    int const ret = m_mapped ? dwarf_object_finish(m_dbg, &err) :
+      dwarf_finish(m_dbg, &err);
+
+    if(ret != DW_DLV_OK)
+    {
+      *error = dwarf_errmsg(err);
+      ok = false;
+    }
+
+    m_dbg = NULL;
+  }
+
+  // the views are unmapped after the libdwarf cleanup
+  close_mapping();
+  m_mapped = false;
+
+  if(m_fd != -1)
+  {
+    ::close(m_fd), m_fd = -1;
+  }
+
+  return ok;
+}
+
+bool DwarfFile::has_section(char const *name) const throw()
+{
+  bool found = false;
+
+  for(size_t idx = 0; !found && idx < m_sections.size(); ++idx)
+  {
+    found = (m_sections[idx].type != ELF_SHT_NOBITS &&
+             m_sections[idx].size != 0 &&
+             strcmp(m_sections[idx].name, name) == 0);
+  }
+
+  return found;
+}
+
+uchar const *DwarfFile::get_section_data(char const *name, uint64 *size) throw()
+{
+  uchar const *data = NULL;
+
+  for(size_t idx = 0; idx < m_sections.size(); ++idx)
+  {
+    ElfSection &section = m_sections[idx];
+
+    if(section.type != ELF_SHT_NOBITS && strcmp(section.name, name) == 0)
+    {
+      if(section.data == NULL)
+      {
+        section.data = const_cast<Dwarf_Small *>(map(section.offset, section.size));
+      }
+
+      if(section.data != NULL)
+      {
+        data = section.data;
+        *size = section.size;
+      }
+
+      break;
+    }
+  }
+
+  return data;
+}
+
+bool DwarfFile::open_mapping(void) throw()
+{
+  bool ok = false;
+
+#ifdef __NT__
+  HANDLE const file = reinterpret_cast<HANDLE>(_get_osfhandle(m_fd));
+
+  if(file != INVALID_HANDLE_VALUE)
+  {
+    DWORD high = 0;
+    DWORD const low = GetFileSize(file, &high);
+
+    if(low != INVALID_FILE_SIZE || GetLastError() == NO_ERROR)
+    {
+      m_file_size = (static_cast<uint64>(high) << 32) | low;
+      // (fails for an empty file)
+      m_mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      ok = (m_mapping != NULL);
+    }
+  }
+#else
+  struct stat file_stat;
+
+  if(fstat(m_fd, &file_stat) == 0 && file_stat.st_size > 0)
+  {
+    m_file_size = static_cast<uint64>(file_stat.st_size);
+    ok = true;
+  }
+#endif
+
+  return ok;
+}
+
+void DwarfFile::close_mapping(void) throw()
+{
+  for(size_t idx = 0; idx < m_views.size(); ++idx)
+  {
+#ifdef __NT__
+    UnmapViewOfFile(m_views[idx].base);
+#else
+    munmap(m_views[idx].base, m_views[idx].size);
+#endif
+  }
+
+  m_views.clear();
+  m_sections.clear();
+
+#ifdef __NT__
+  if(m_mapping != NULL)
+  {
+    CloseHandle(static_cast<HANDLE>(m_mapping));
+  }
+#endif
+
+  m_mapping = NULL;
+  m_file_size = 0;
+}
+
+uchar const *DwarfFile::map(uint64 const offset, uint64 const size) throw()
+{
+  uchar const *ptr = NULL;
+
+  if(size != 0 && offset <= m_file_size && size <= m_file_size - offset)
+  {
+    uint64 const start = offset - offset % get_map_granularity();
+    uint64 const view_size = size + (offset - start);
+
+    // the whole view must fit in the address space
+    if(view_size <= static_cast<uint64>(static_cast<size_t>(-1)))
+    {
+      MappedView view = { NULL, static_cast<size_t>(view_size) };
+
+#ifdef __NT__
+      view.base = MapViewOfFile(static_cast<HANDLE>(m_mapping), FILE_MAP_READ,
+                                static_cast<DWORD>(start >> 32),
+                                static_cast<DWORD>(start & 0xFFFFFFFF),
+                                view.size);
+#else
+      view.base = mmap(NULL, view.size, PROT_READ, MAP_PRIVATE, m_fd,
+                       static_cast<off_t>(start));
+      if(view.base == MAP_FAILED)
+      {
+        view.base = NULL;
+      }
+#endif
+
+      if(view.base != NULL)
+      {
+        m_views.push_back(view);
+        ptr = static_cast<uchar const *>(view.base) + (offset - start);
+      }
+    }
+  }
+
+  return ptr;
+}
+
+bool DwarfFile::read_sections(void) throw()
+{
+  uint64 const ehdr_size = qmin(m_file_size, static_cast<uint64>(ELF_MAX_EHDR_SIZE));
+  uchar const *ehdr = map(0, ehdr_size);
+  ElfLayout const *layout = NULL;
+  uchar const *shdrs = NULL;
+  uint64 shentsize = 0;
+  uint64 nb_sections = 0;
+  uint64 names_idx = 0;
+  bool ok = false;
+
+  if(ehdr != NULL && ehdr_size >= elf32_layout.ehdr_size &&
+     memcmp(ehdr, "\177ELF", 4) == 0)
+  {
+    m_elf64 = (ehdr[4] == ELF_CLASS64);
+    m_msb = (ehdr[5] == ELF_DATA2MSB);
+    layout = m_elf64 ? &elf64_layout :
+      ((ehdr[4] == ELF_CLASS32) ? &elf32_layout : NULL);
+  }
+
+  // relocations are only applied by the libdwarf ELF access
+  if(layout != NULL && ehdr_size >= layout->ehdr_size &&
+     read_value(ehdr + layout->e_type, 2) != ELF_TYPE_REL)
+  {
+    uint64 const shoff = read_value(ehdr + layout->e_shoff, layout->addr_size);
+
+    shentsize = read_value(ehdr + layout->e_shentsize, 2);
+    nb_sections = read_value(ehdr + layout->e_shnum, 2);
+    names_idx = read_value(ehdr + layout->e_shstrndx, 2);
+
+    if(shoff != 0 && shentsize >= layout->shdr_size)
+    {
+      // extended numbering: the real values are in the first section header
+      if(nb_sections == 0 || names_idx == ELF_SHN_XINDEX)
+      {
+        uchar const *first_shdr = map(shoff, layout->shdr_size);
+
+        if(first_shdr != NULL && nb_sections == 0)
+        {
+          nb_sections = read_value(first_shdr + layout->sh_size, layout->addr_size);
+        }
+
+        if(first_shdr != NULL && names_idx == ELF_SHN_XINDEX)
+        {
+          names_idx = read_value(first_shdr + layout->sh_link, 4);
+        }
+      }
+
+      // libdwarf section indexes are 16-bit
+      if(nb_sections != 0 && nb_sections <= 0xFFFF && names_idx < nb_sections)
+      {
+        shdrs = map(shoff, shentsize * nb_sections);
+      }
+    }
+  }
+
+  if(shdrs != NULL)
+  {
+    uchar const *names_shdr = shdrs + names_idx * shentsize;
+    uint64 const names_size = read_value(names_shdr + layout->sh_size, layout->addr_size);
+    char const *names = reinterpret_cast<char const *>(
+      map(read_value(names_shdr + layout->sh_offset, layout->addr_size), names_size));
+
+    // the section names table ends with a NUL character
+    if(names != NULL && names[names_size - 1] == '\0')
+    {
+      for(uint64 idx = 0; idx < nb_sections; ++idx)
+      {
+        uchar const *shdr = shdrs + idx * shentsize;
+        uint64 const name_pos = read_value(shdr + layout->sh_name, 4);
+        ElfSection section;
+
+        section.addr = read_value(shdr + layout->sh_addr, layout->addr_size);
+        section.offset = read_value(shdr + layout->sh_offset, layout->addr_size);
+        section.size = read_value(shdr + layout->sh_size, layout->addr_size);
+        section.name = (name_pos < names_size) ? names + name_pos : "";
+        section.type = static_cast<uint32>(read_value(shdr + layout->sh_type, 4));
+        section.data = NULL;
+
+        m_sections.push_back(section);
+      }
+
+      ok = true;
+    }
+  }
+
+  return ok;
+}
+
+uint64 DwarfFile::read_value(uchar const *ptr, size_t const size) const throw()
+{
+  uint64 value = 0;
+
+  for(size_t idx = 0; idx < size; ++idx)
+  {
+    value = m_msb ? ((value << 8) | ptr[idx]) :
+      (value | (static_cast<uint64>(ptr[idx]) << (8 * idx)));
+  }
+
+  return value;
+}
@@ -0,0 +1,125 @@
+#ifndef IDADWARF_DWARF_FILE_HPP
+#define IDADWARF_DWARF_FILE_HPP
+
+// standard headers
+#include <string>
+#include <vector>
+
+// IDA headers
+#include <pro.h>
+
+// additional libs headers
+#include <libdwarf.h>
+
+using namespace std;
+
+// libdwarf handle on an ELF file
+// the debug sections are read from read-only views of a file mapping
+// (libdwarf gets pointers in the views instead of its own copies),
+// so the pages are only read when libdwarf touches them
+// and the handles opened on the same file share them.
+// relocatable objects (and files that cannot be mapped)
+// are read by libdwarf itself (with libelf).
+// only the C++ runtime is used (but for the libdwarf cleanup error message
+// of close(void)), so a handle can be opened, used and closed
+// by a worker thread.
+class DwarfFile
+{
+public:
+  DwarfFile(void) throw();
+
+  virtual ~DwarfFile(void) throw()
+  {
+    close();
+  }
+
+  // returns DW_DLV_OK, DW_DLV_NO_ENTRY (no DWARF infos) or DW_DLV_ERROR
+  // (err stays NULL if the file cannot be opened)
+  int open(char const *path, Dwarf_Error *err) throw();
+
+  // only map the ELF sections (no libdwarf handle), to read their data
+  // returns false if the file cannot be mapped
+  bool open_sections(char const *path) throw();
+
+  // logs the libdwarf cleanup error (main thread only)
+  void close(void) throw();
+
+  // returns false (with the error message) if the libdwarf cleanup failed
+  // nothing is logged, for the worker threads
+  bool close(string *error) throw();
+
+  // is there such a section with data in the file?
+  // (only when the sections are mapped)
+  bool has_section(char const *name) const throw();
+
+  Dwarf_Debug get_dbg(void) const throw()
+  {
+    return m_dbg;
+  }
+
+  char const *get_path(void) const throw()
+  {
+    return m_path.c_str();
+  }
+
+  // are the debug sections read from the file mapping?
+  bool is_mapped(void) const throw()
+  {
+    return m_mapped;
+  }
+
+  // raw data of a section (mapped if libdwarf has not loaded it yet)
+  // returns NULL if there is no such section or the sections are not mapped
+  uchar const *get_section_data(char const *name, uint64 *size) throw();
+
+  // value of a field in the byte order of the file
+  uint64 read_value(uchar const *ptr, size_t const size) const throw();
+
+private:
+  friend struct ElfAccess;
+
+  struct MappedView
+  {
+    void *base;
+    size_t size;
+  };
+
+  // from the ELF section headers
+  struct ElfSection
+  {
+    uint64 addr;
+    uint64 offset;
+    uint64 size;
+    char const *name; // in the mapped section names
+    uint32 type;
+    Dwarf_Small *data; // mapped when libdwarf loads the section
+  };
+
+  string m_path;
+  int m_fd;
+  Dwarf_Debug m_dbg;
+  bool m_mapped;
+  uint64 m_file_size;
+  void *m_mapping; // file mapping HANDLE (windows only)
+  vector<MappedView> m_views;
+  vector<ElfSection> m_sections;
+  bool m_msb;
+  bool m_elf64;
+  Dwarf_Obj_Access_Interface m_access;
+
+  // no copying or assignment
+  DwarfFile(DwarfFile const &);
+  DwarfFile &operator=(DwarfFile const &);
+
+  bool open_mapping(void) throw();
+
+  void close_mapping(void) throw();
+
+  // returns NULL if the range is not in the file or cannot be mapped
+  uchar const *map(uint64 const offset, uint64 const size) throw();
+
+  // false if libdwarf must read the file itself
+  bool read_sections(void) throw();
+};
+
+#endif // IDADWARF_DWARF_FILE_HPP
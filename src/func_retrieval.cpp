@@ -1,5 +1,8 @@
 #include "func_retrieval.hpp"
 
+// standard headers
+#include <algorithm>
+
 // IDA headers
 #include <frame.hpp>
 #include <struct.hpp>
@@ -10,6 +13,8 @@
 #include <lines.hpp>
 #include <ua.hpp>
 #include <segment.hpp>
+#include <bytes.hpp>
+#include <funcs.hpp>
 
 // local headers
 #include "iterators.hpp"
@@ -187,13 +192,136 @@ static void set_register_var_enum(ea_t const current_addr, char const *reg_name,
 #undef NN_cmp
 }
 
+// struct paths and enums of the register variables of a subprogram
+// the operands are typed in a single sweep over the instructions
+// of all the variable ranges (sorted by start address)
+class RegVarOperands
+{
+public:
+  void add(ea_t const startEA, ea_t const endEA, char const *reg_name,
+           tid_t const struc_id, enum_t const enum_id)
+  {
+    if(startEA < endEA)
+    {
+      RegVarRange const range = { startEA, endEA, reg_name, struc_id, enum_id };
+
+      m_ranges.push_back(range);
+    }
+  }
+
+  // apply the operand types, then forget the ranges
+  void apply(void);
+
+  void clear(void) throw()
+  {
+    m_ranges.clear();
+  }
+
+private:
+  struct RegVarRange
+  {
+    ea_t startEA;
+    ea_t endEA;
+    char const *reg_name;
+    tid_t struc_id; // BADNODE if none
+    enum_t enum_id; // BADNODE if none
+  };
+
+  qvector<RegVarRange> m_ranges;
+
+  static bool is_before(RegVarRange const &range1, RegVarRange const &range2) throw()
+  {
+    return range1.startEA < range2.startEA;
+  }
+};
+
+void RegVarOperands::apply(void)
+{
+  // ranges containing the current address
+  qvector<RegVarRange const *> active;
+  ea_t current_addr = 0;
+  size_t next = 0;
+
+  sort(m_ranges.begin(), m_ranges.end(), is_before);
+
+  while(next < m_ranges.size() || !active.empty())
+  {
+    // nothing to type until the next range?
+    if(active.empty() && m_ranges[next].startEA > current_addr)
+    {
+      current_addr = m_ranges[next].startEA;
+    }
+
+    while(next < m_ranges.size() && m_ranges[next].startEA <= current_addr)
+    {
+      if(m_ranges[next].endEA > current_addr)
+      {
+        active.push_back(&m_ranges[next]);
+      }
+
+      next++;
+    }
+
+    if(!active.empty())
+    {
+      ua_ana0(current_addr);
+      if(cmd.size == 0)
+      {
+        // cannot go further in these ranges
+        active.clear();
+      }
+      else
+      {
+        size_t nb_active = 0;
+
+        for(size_t idx = 0; idx < active.size(); ++idx)
+        {
+          RegVarRange const *range = active[idx];
+
+          if(range->struc_id != BADNODE)
+          {
+            struc_t *sptr = get_struc(range->struc_id);
+
+            if(sptr != NULL)
+            {
+              set_register_var_strpath(current_addr, range->reg_name, sptr);
+            }
+          }
+          else if(range->enum_id != BADNODE)
+          {
+            set_register_var_enum(current_addr, range->reg_name, range->enum_id);
+          }
+        }
+
+        current_addr += cmd.size;
+
+        // drop the ranges ending before the next instruction
+        for(size_t idx = 0; idx < active.size(); ++idx)
+        {
+          if(active[idx]->endEA > current_addr)
+          {
+            active[nb_active++] = active[idx];
+          }
+        }
+
+        active.resize(nb_active);
+      }
+    }
+  }
+
+  clear();
+}
+
+static RegVarOperands regvar_operands;
+
 static void set_register_var_operand_type(DieHolder &var_holder, char const *reg_name,
                                           ea_t const startEA, ea_t const endEA)
 {
-  Dwarf_Off const offset = var_holder.get_ref_from_attr(DW_AT_type);
+  Dwarf_Off offset = 0;
   uint32 ordinal = 0;
-  bool ok = diecache.get_cache_type_ordinal(offset, &ordinal);
-  struc_t *sptr = NULL;
+  bool ok = (var_holder.get_ref_from_attr(DW_AT_type, &offset) &&
+             diecache.get_cache_type_ordinal(offset, &ordinal));
+  tid_t struc_id = BADNODE;
   enum_t enum_id = BADNODE;
 
   if(ok)
@@ -221,41 +349,17 @@ static void set_register_var_operand_type(DieHolder &var_holder, char const *reg
 
           if(name != NULL)
           {
-            tid_t const struc_id = get_struc_id(name);
-
-            if(struc_id != BADNODE)
-            {
-              sptr = get_struc(struc_id);
-            }
+            struc_id = get_struc_id(name);
           }
         }
       }
     }
   }
 
-  if(sptr != NULL || enum_id != BADNODE)
+  // the operands are typed once all the subprogram variables are known
+  if(struc_id != BADNODE || enum_id != BADNODE)
   {
-    ea_t current_addr = startEA;
-
-    while(current_addr < endEA)
-    {
-      ua_ana0(current_addr);
-      if(cmd.size == 0)
-      {
-        break;
-      }
-
-      if(sptr != NULL)
-      {
-        set_register_var_strpath(current_addr, reg_name, sptr);
-      }
-      else if(enum_id != BADNODE)
-      {
-        set_register_var_enum(current_addr, reg_name, enum_id);
-      }
-
-      current_addr += cmd.size;
-    }
+    regvar_operands.add(startEA, endEA, reg_name, struc_id, enum_id);
   }
 }
 
@@ -356,10 +460,10 @@ static void set_stack_var_type_cmt(struc_t *fptr, char const *var_name)
   }
 }
 
-static bool set_stack_var(DieHolder &var_holder, func_t *funptr, sval_t const offset)
+static bool set_stack_var(DieHolder &var_holder, func_t *funptr, struc_t *fptr,
+                          sval_t const offset)
 {
   char const *var_name = var_holder.get_name();
-  struc_t *fptr = get_frame(funptr);
   bool type_found = false;
   uint32 ordinal = 0;
   bool ok = false;
@@ -430,11 +534,11 @@ static bool set_stack_var(DieHolder &var_holder, func_t *funptr, sval_t const of
 
 static bool process_stack_var(DieHolder &var_holder, Dwarf_Locdesc const *locdesc,
                               func_t *funptr, OffsetAreas const &offset_areas,
-                              func_type_info_t *info)
+                              OffsetArea const *offset_area, func_type_info_t *info)
 {
   char const *var_name = var_holder.get_name();
   Dwarf_Loc const *loc = &locdesc->ld_s[0];
-  struc_t *fptr = get_frame(funptr);
+  struc_t *fptr = offset_areas.get_frame();
   bool ok = false;
 
   if(fptr != NULL)
@@ -460,56 +564,21 @@ static bool process_stack_var(DieHolder &var_holder, Dwarf_Locdesc const *locdes
         found = true;
       }
       // frame-base based location?
-      else if(loc->lr_atom == DW_OP_fbreg && offset_areas.size() != 0)
+      // (the area is found with the location list of the variable,
+      // or from the entire subprogram)
+      else if(loc->lr_atom == DW_OP_fbreg && offset_area != NULL)
       {
-        area_t area(BADADDR, BADADDR);
-
-        // frame-base offset can be retrieved with the location list of the variable?
-        if(locdesc->ld_from_loclist)
-        {
-          area.startEA = locdesc->ld_lopc;
-          area.endEA = locdesc->ld_hipc;
-        }
-
-        for(size_t idx = 0; idx < offset_areas.size(); ++idx)
-        {
-          OffsetArea const &offset_area = offset_areas[idx];
-
-          if(!locdesc->ld_from_loclist)
-          {
-            // frame-base offset can be retrieved from the entire subprogram
-            if(offset_area.use_fp ||
-               (rel_addr != BADADDR && offset_area.startEA >= rel_addr))
-            {
-              area.startEA = offset_area.startEA;
-              area.endEA = offset_area.endEA;
-            }
-          }
-
-          // esp based, but area location is before the "base stack address"
-          // we cannot do anything
-          if(!offset_area.use_fp &&
-             (rel_addr == BADADDR || area.startEA < rel_addr))
-          {
-            continue;
-          }
-
-          if(offset_area.contains(area))
-          {
-            offset = (offset_area.offset + loc->lr_number +
-                      (offset_area.use_fp ? -funptr->fpd : offset_areas.get_base()));
-            DEBUG("found a stack frame var in a location list name='%s' offset=%ld\n", var_name, offset);
-            found = true;
-            break;
-          }
-        }
+        offset = (offset_area->offset + loc->lr_number +
+                  (offset_area->use_fp ? -funptr->fpd : offset_areas.get_base()));
+        DEBUG("found a stack frame var in a location list name='%s' offset=%ld\n", var_name, offset);
+        found = true;
       }
 
       if(found)
       {
         // we got the variable offset in the stack
         // get its type and add it to the stack frame
-        ok = set_stack_var(var_holder, funptr, offset);
+        ok = set_stack_var(var_holder, funptr, fptr, offset);
 
         if(info != NULL)
         {
@@ -545,7 +614,8 @@ static bool process_func_static_var(DieHolder &var_holder, Dwarf_Locdesc const *
 
 static void visit_func_var(DieHolder &var_holder, Dwarf_Locdesc const *locdesc,
                            func_t *funptr, ea_t const cu_low_pc,
-                           OffsetAreas const &offset_areas, func_type_info_t *info)
+                           OffsetAreas const &offset_areas, OffsetArea const *offset_area,
+                           func_type_info_t *info)
 {
   char const *var_name = var_holder.get_name();
   var_type type = VAR_USELESS;
@@ -565,7 +635,7 @@ static void visit_func_var(DieHolder &var_holder, Dwarf_Locdesc const *locdesc,
       break;
     case VAR_STACK:
       // stored in the stack frame?
-      ok = process_stack_var(var_holder, locdesc, funptr, offset_areas, info);
+      ok = process_stack_var(var_holder, locdesc, funptr, offset_areas, offset_area, info);
       break;
     case VAR_FUNC_STATIC:
       // static variable local to a function?
@@ -768,9 +838,7 @@ static void process_subprogram(DieHolder &subprogram_holder)
 
     if(funptr != NULL && funptr->startEA == low_pc)
     {
-      DieHolder cu_holder(subprogram_holder.get_dbg(),
-                          subprogram_holder.get_CU_offset());
-      ea_t const cu_low_pc = static_cast<ea_t>(cu_holder.get_addr_from_attr(DW_AT_low_pc));
+      ea_t const cu_low_pc = static_cast<ea_t>(subprogram_holder.get_CU_low_pc());
       OffsetAreas offset_areas;
       func_type_info_t info;
       Dwarf_Bool const is_external = subprogram_holder.get_attr_flag(DW_AT_external);
@@ -799,14 +867,17 @@ static void process_subprogram(DieHolder &subprogram_holder)
       }
 
       subprogram_holder.get_frame_base_offsets(offset_areas);
+      offset_areas.set_frame(get_frame(funptr));
 
+      regvar_operands.clear();
       process_func_vars(subprogram_holder, funptr, cu_low_pc, offset_areas, &info);
+      regvar_operands.apply();
 
       // add return type and apply register parameters
       ok = finish_subprogram(subprogram_holder, funptr, info);
       if(ok)
       {
-        DEBUG("added function name='%s' offset=%u\n",
+        DEBUG("added function name='%s' address=0x%lx\n",
               subprogram_holder.get_name(), funptr->startEA);
         subprogram_holder.cache_func(funptr->startEA);
       }
@@ -857,104 +928,226 @@ void visit_func_die(DieHolder &die_holder)
   }
 }
 
-static void my_apply_callee_type(func_t *funptr, ea_t const call_addr)
+// cdecl argument of a callee passed in the stack
+struct StackArg
 {
-  qtype func_type;
-  qtype func_fields;
-  qvector<uval_t> stack_offsets;
-  func_type_info_t finfo;
-  int const ret = guess_func_tinfo(funptr, &func_type, &func_fields);
+  uval_t offset; // from esp at the call
+  qstring name;
+};
+
+typedef qvector<StackArg> StackArgs;
+
+struct CallSite
+{
+  ea_t caller_startEA;
+  ea_t addr;
+  size_t callee_idx; // in the callees stack arguments
+
+  bool operator<(CallSite const &other) const throw()
+  {
+    return (caller_startEA < other.caller_startEA ||
+            (caller_startEA == other.caller_startEA && addr < other.addr));
+  }
+};
+
+// last "mov [esp+offset], ..." before a call
+struct StackMov
+{
+  uval_t offset;
+  ea_t addr;
+};
 
-  // get the stack offsets of the arguments
-  if(ret != GUESS_FUNC_FAILED)
+// comment to write on a "mov" setting a stack argument
+struct StackArgCmt
+{
+  ea_t addr;
+  char const *name; // in the callees stack arguments
+
+  bool operator<(StackArgCmt const &other) const throw()
   {
-    int const nb_args = build_funcarg_info(idati, func_type.c_str(),
-                                           func_fields.c_str(), &finfo, 0);
+    return (addr < other.addr);
+  }
+};
 
-    if(nb_args >= 1 &&
-       get_cc(finfo.cc) == CM_CC_CDECL)
+// get the stack offsets of the arguments (only once per function)
+static void get_stack_args(qtype const &func_type, qtype const &func_fields,
+                           StackArgs &stack_args)
+{
+  func_type_info_t finfo;
+  int const nb_args = build_funcarg_info(idati, func_type.c_str(),
+                                         func_fields.c_str(), &finfo, 0);
+
+  if(nb_args >= 1 &&
+     get_cc(finfo.cc) == CM_CC_CDECL)
+  {
+    for(int idx = 0; idx < nb_args; ++idx)
     {
-      for(int idx = 0; idx < nb_args; ++idx)
+      // first argloc starts at 0, that's exactly what we need
+      if(is_stack_argloc(finfo[idx].argloc))
       {
-        // first argloc starts at 0, that's exactly what we need
-        if(is_stack_argloc(finfo[idx].argloc))
-        {
-          stack_offsets.push_back(finfo[idx].argloc);
-        }
+        StackArg stack_arg;
+
+        stack_arg.offset = finfo[idx].argloc;
+        stack_arg.name = finfo[idx].name;
+        stack_args.push_back(stack_arg);
       }
     }
   }
+}
 
 // only define the necessary instructions
 // allins.hpp is too big...
 #define NN_call 16
 #define NN_mov 122
 
-  // at least one arg to comment?
-  if(stack_offsets.size() != 0)
+// find the "mov"s setting the stack arguments of the calls of a caller
+// the code heads of all the caller chunks (tails included) are decoded
+// only once, in a forward sweep of each chunk:
+// the "mov"s are only looked for since the last call or block start.
+// nothing is written in the database, the comments are queued
+static void find_stack_args(func_t *caller, CallSite const *call_sites,
+                            size_t const nb_call_sites,
+                            qvector<StackArgs> const &callees_args,
+                            qvector<StackArgCmt> &cmts)
+{
+  qvector<StackMov> stack_movs;
+  size_t nb_found = 0;
+  ea_t next_addr = BADADDR;
+  func_item_iterator_t fii;
+
+  for(bool ok = fii.set(caller); ok && nb_found < nb_call_sites; ok = fii.next_code())
   {
-    ea_t addr = call_addr;
-    size_t args_found = 0;
+    ea_t const addr = fii.current();
+    flags_t const flags = getFlags(addr);
+
+    // beginning of a block (or of a chunk)?
+    if(addr != next_addr || !isFlow(flags) || hasRef(flags))
+    {
+      stack_movs.clear();
+    }
 
-    DEBUG("finding args for call address=0x%lx\n", call_addr);
+    ua_ana0(addr);
+    next_addr = addr + cmd.size;
 
-    do
+    if(cmd.size == 0)
+    {
+      stack_movs.clear();
+    }
+    else if(cmd.itype == NN_call)
     {
-      ea_t const prev_addr = decode_prev_insn(addr);
+      // the call sites are sorted by address, not the chunks
+      CallSite call_site;
+      CallSite const *site = NULL;
 
-      if(prev_addr == BADADDR || cmd.itype == NN_call)
-      {
-        break;
-      }
+      call_site.caller_startEA = caller->startEA;
+      call_site.addr = addr;
+      call_site.callee_idx = 0;
+      site = lower_bound(call_sites, call_sites + nb_call_sites, call_site);
 
-      if(cmd.itype == NN_mov)
+      // calls not found in the call sites are skipped
+      if(site != call_sites + nb_call_sites && site->addr == addr)
       {
-        op_t const &first_op = cmd.Operands[0];
-        uval_t stack_offset = BADADDR;
+        StackArgs const &stack_args = callees_args[site->callee_idx];
 
-        switch(first_op.type)
+        DEBUG("finding args for call address=0x%lx\n", addr);
+        for(size_t arg_idx = 0; arg_idx < stack_args.size(); ++arg_idx)
         {
-        case o_displ:
-          stack_offset = first_op.addr;
-          break;
-        case o_phrase:
-          stack_offset = 0;
-          break;
-        default:
-          break;
-        }
-
-        if(stack_offset != BADADDR && first_op.reg == R_esp)
-        {
-          for(size_t idx = 0; idx < stack_offsets.size(); ++idx)
+          for(size_t idx = 0; idx < stack_movs.size(); ++idx)
           {
-            if(stack_offsets[idx] == stack_offset)
+            if(stack_movs[idx].offset == stack_args[arg_idx].offset)
             {
+              StackArgCmt cmt;
+
               DEBUG("found arg count=%ld at address=0x%lx\n",
-                    static_cast<unsigned long>(idx), prev_addr);
-              set_cmt(prev_addr, finfo[idx].name.c_str(), false);
-              args_found++;
+                    static_cast<unsigned long>(arg_idx), stack_movs[idx].addr);
+              cmt.addr = stack_movs[idx].addr;
+              cmt.name = stack_args[arg_idx].name.c_str();
+              cmts.push_back(cmt);
               break;
             }
           }
         }
+
+        nb_found++;
       }
 
-      addr = prev_addr;
+      stack_movs.clear();
     }
-    while(args_found != stack_offsets.size() || addr < funptr->startEA);
+    else if(cmd.itype == NN_mov)
+    {
+      op_t const &first_op = cmd.Operands[0];
+      uval_t stack_offset = BADADDR;
 
-    DEBUG("found %ld args (total %ld)\n",
-          static_cast<unsigned long>(args_found),
-          static_cast<unsigned long>(stack_offsets.size()));
+      switch(first_op.type)
+      {
+      case o_displ:
+        stack_offset = first_op.addr;
+        break;
+      case o_phrase:
+        stack_offset = 0;
+        break;
+      default:
+        break;
+      }
+
+      if(stack_offset != BADADDR && first_op.reg == R_esp)
+      {
+        size_t idx = 0;
+
+        // only keep the last "mov" for an offset
+        while(idx < stack_movs.size() && stack_movs[idx].offset != stack_offset)
+        {
+          idx++;
+        }
+
+        if(idx == stack_movs.size())
+        {
+          StackMov stack_mov;
+
+          stack_mov.offset = stack_offset;
+          stack_mov.addr = addr;
+          stack_movs.push_back(stack_mov);
+        }
+        else
+        {
+          stack_movs[idx].addr = addr;
+        }
+      }
+    }
   }
+}
 
 #undef NN_mov
 #undef NN_call
+
+// write the queued comments by address
+// (a "mov" found for several calls gets the name of the last one)
+static void apply_stack_arg_cmts(qvector<StackArgCmt> &cmts)
+{
+  stable_sort(cmts.begin(), cmts.end());
+
+  for(size_t idx = 0; idx < cmts.size(); ++idx)
+  {
+    if(idx + 1 == cmts.size() || cmts[idx + 1].addr != cmts[idx].addr)
+    {
+      set_cmt(cmts[idx].addr, cmts[idx].name, false);
+    }
+  }
 }
 
-static void add_callee_types(void)
+// comment the stack arguments at the call sites of the callees
+// the call sites are swept caller by caller, the comments are only
+// written once every caller has been swept.
+// the sweep is not done in parallel: decoding the instructions
+// (ua_ana0 fills the global cmd) and reading the flags and the chunks
+// all go through the database, and the remaining matching is too cheap
+static void add_callee_types(GCC_UNUSED Dwarf_Debug dbg)
 {
+  ProfileScope const scope(TIMER_CALLEE_TYPES);
+  qvector<StackArgs> callees_args;
+  qvector<CallSite> call_sites;
+  qvector<StackArgCmt> cmts;
+
   for(CacheIterator iter(DIE_FUNC); *iter != NULL; ++iter)
   {
     die_cache const *cache = *iter;
@@ -968,27 +1161,70 @@ static void add_callee_types(void)
 
       if(ret != GUESS_FUNC_FAILED)
       {
+        size_t const callee_idx = callees_args.size();
         xrefblk_t xref;
 
+        callees_args.push_back(StackArgs());
+        get_stack_args(func_type, func_fields, callees_args[callee_idx]);
+
         for(bool ok = xref.first_to(cache->startEA, XREF_ALL);
             ok; ok = xref.next_to())
         {
           if(xref.type == fl_CN || xref.type == fl_CF)
           {
+            func_t *caller = get_func(xref.from);
+
             // for old versions of IDA: only work when "push"ing arguments to the stack
             apply_callee_type(xref.from, func_type.c_str(), func_fields.c_str());
-            // do the same thing when "mov"ing them at [esp+offset]
-            my_apply_callee_type(funptr, xref.from);
             DEBUG("applied callee type at 0x%lx\n", xref.from);
+
+            // do the same thing when "mov"ing them at [esp+offset]
+            // (at least one arg to comment?)
+            if(caller != NULL && callees_args[callee_idx].size() != 0)
+            {
+              CallSite call_site;
+
+              call_site.caller_startEA = caller->startEA;
+              call_site.addr = xref.from;
+              call_site.callee_idx = callee_idx;
+              call_sites.push_back(call_site);
+            }
           }
         }
       }
     }
   }
+
+  // batch the call sites by caller
+  sort(call_sites.begin(), call_sites.end());
+
+  for(size_t first_idx = 0; first_idx < call_sites.size();)
+  {
+    ea_t const caller_startEA = call_sites[first_idx].caller_startEA;
+    func_t *caller = get_func(caller_startEA);
+    size_t last_idx = first_idx + 1;
+
+    while(last_idx < call_sites.size() &&
+          call_sites[last_idx].caller_startEA == caller_startEA)
+    {
+      last_idx++;
+    }
+
+    if(caller != NULL)
+    {
+      find_stack_args(caller, &call_sites[first_idx], last_idx - first_idx,
+                      callees_args, cmts);
+    }
+
+    first_idx = last_idx;
+  }
+
+  apply_stack_arg_cmts(cmts);
 }
 
-void retrieve_funcs(CUsHolder const &cus_holder)
+void add_func_visitors(DieTraversal &traversal)
 {
-  do_dies_traversal(cus_holder, try_visit_func_die);
-  add_callee_types();
+  traversal.add_visitor(PHASE_FUNCS, DW_TAG_subprogram, try_visit_func_die);
+  traversal.add_visitor(PHASE_FUNCS, DW_TAG_label, try_visit_func_die);
+  traversal.add_finisher(PHASE_FUNCS, add_callee_types);
 }
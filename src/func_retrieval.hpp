@@ -2,11 +2,12 @@
 #define IDADWARF_FUNC_RETRIEVAL_HPP
 
 #include "die_utils.hpp"
+#include "traversal.hpp"
 
 void visit_func_die(DieHolder &die_holder);
 
 TRY_VISIT_DIE(visit_func_die);
 
-void retrieve_funcs(CUsHolder const &cus_holder);
+void add_func_visitors(DieTraversal &traversal);
 
 #endif // IDADWARF_FUNC_RETRIEVAL_HPP
@@ -55,7 +55,7 @@ void visit_global_die(DieHolder &die_holder)
   }
 }
 
-void retrieve_globals(CUsHolder const &cus_holder)
+void add_global_visitors(DieTraversal &traversal)
 {
-  do_dies_traversal(cus_holder, try_visit_global_die);
+  traversal.add_visitor(PHASE_GLOBALS, DW_TAG_variable, try_visit_global_die);
 }
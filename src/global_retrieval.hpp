@@ -2,11 +2,12 @@
 #define IDADWARF_GLOBAL_RETRIEVAL_HPP
 
 #include "die_utils.hpp"
+#include "traversal.hpp"
 
 void visit_global_die(DieHolder &die_holder);
 
 TRY_VISIT_DIE(visit_global_die);
 
-void retrieve_globals(CUsHolder const &cus_holder);
+void add_global_visitors(DieTraversal &traversal);
 
 #endif // IDADWARF_GLOBAL_RETRIEVAL_HPP
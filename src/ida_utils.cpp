@@ -4,6 +4,9 @@
 #include <struct.hpp>
 #include <enum.hpp>
 
+// local headers
+#include "profiling.hpp"
+
 // misc IDA utility funs
 
 type_t const *get_ptrs_base_type(type_t const *type)
@@ -135,8 +138,11 @@ bool set_simple_die_type(char const *name, qtype const &ida_type, uint32 *ordina
       // if the name already exists in the db,
       // the old type name will get deleted (if we replace the type)
       // avoid that!
+      // the taken names are only read (find_simple_type), a free name
+      // is written at once (not staged: the next DIEs need it in idati)
       if(!found)
       {
+        profiler.count(COUNTER_TYPE_WRITES);
         saved = set_numbered_type(idati, alloced_ordinal,
                                   replace ? NTF_REPLACE : 0,
                                   new_name.c_str(), ida_type.c_str());
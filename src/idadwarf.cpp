@@ -22,6 +22,9 @@
 // local definitions
 #include "defs.hpp"
 
+// standard headers
+#include <memory>
+
 // IDA headers
 #include <ida.hpp>
 #include <loader.hpp> // plugin stuff
@@ -35,7 +38,16 @@
 #include "gcc_defs.hpp"
 #include "ida_utils.hpp"
 #include "die_cache.hpp"
+#include "die_index.hpp"
 #include "die_utils.hpp"
+#include "dwarf_file.hpp"
+#include "lazy_import.hpp"
+#include "loclist_cache.hpp"
+#include "profiling.hpp"
+#include "separate_debug.hpp"
+#include "string_pool.hpp"
+#include "traversal.hpp"
+#include "type_decoder.hpp"
 #include "type_retrieval.hpp"
 #include "func_retrieval.hpp"
 #include "global_retrieval.hpp"
@@ -46,17 +58,112 @@ using namespace std;
 // global DIE cache
 DieCache diecache;
 
+// decoded location lists of the current CU
+LocListCache loclist_cache;
+
+// names of the DIEs
+StringPool die_names;
+
+// separate debug file of the input file, searched while loading the plugin
+static SeparateDebugFinder debug_finder;
+
+#ifdef HAVE_TYPE_UNITS
+// retrieve the type units of .debug_types (after the compilation units)
+// and index their type DIEs by signature
+static void retrieve_type_units(CUsHolder &cus_holder)
+{
+  Dwarf_Debug dbg = cus_holder.get_dbg();
+  Dwarf_Off const types_base = CUsHolder::get_types_base();
+  Dwarf_Unsigned tu_header_length = 0;
+  Dwarf_Unsigned abbrev_offset = 0;
+  Dwarf_Unsigned next_tu_offset = 0;
+  Dwarf_Unsigned type_offset = 0;
+  Dwarf_Half version_stamp = 0;
+  Dwarf_Half address_size = 0;
+  Dwarf_Half offset_size = 0;
+  Dwarf_Half extension_size = 0;
+  Dwarf_Unsigned tu_offset = 0;
+  Dwarf_Sig8 signature;
+  Dwarf_Error err = NULL;
+  uint32 nb_tus = 0;
+  int ret = DW_DLV_ERROR;
+
+  while((ret = dwarf_next_cu_header_c(dbg, false, &tu_header_length, &version_stamp,
+                                      &abbrev_offset, &address_size, &offset_size,
+                                      &extension_size, &signature, &type_offset,
+                                      &next_tu_offset, &err)) == DW_DLV_OK)
+  {
+    Dwarf_Die tu_die = NULL;
+
+    ret = dwarf_siblingof_b(dbg, NULL, false, &tu_die, &err);
+    if(ret == DW_DLV_OK)
+    {
+      try
+      {
+        DieHolder tu_holder(dbg, tu_die, false);
+        Dwarf_Half const tag = tu_holder.get_tag();
+        CUInfo info;
+
+        if(tag == DW_TAG_type_unit)
+        {
+          cus_holder.push_back(tu_die);
+          // the type DIE offset is relative to the unit header
+          cus_holder.add_signature(get_signature_key(signature),
+                                   types_base + tu_offset + type_offset);
+          nb_tus++;
+        }
+        else
+        {
+          MSG("got %d tag instead of type unit (skipping)\n", tag);
+        }
+
+        info.offset = types_base + tu_offset;
+        info.length = next_tu_offset - tu_offset;
+        info.die_offset = tu_holder.get_offset();
+        info.has_low_pc = false;
+        info.low_pc = 0;
+        info.version = version_stamp;
+        info.address_size = address_size;
+        info.language = (tu_holder.get_attr(DW_AT_language) == NULL) ? 0 :
+          tu_holder.get_attr_small_val(DW_AT_language);
+        cus_holder.add_info(info);
+      }
+      catch(DieException const &exc)
+      {
+        MSG("cannot retrieve type unit: %s (skipping)\n", exc.what());
+      }
+    }
+
+    if(ret == DW_DLV_ERROR)
+    {
+      MSG("error getting type unit: %s (skipping)\n", dwarf_errmsg(err));
+    }
+
+    tu_offset = next_tu_offset;
+  }
+
+  if(nb_tus != 0)
+  {
+    MSG("%u type units found\n", nb_tus);
+  }
+}
+#endif
+
 // retrieve compilation units
 static void retrieve_cus(CUsHolder &cus_holder)
 {
+  ProfileScope const scope(TIMER_CUS);
   Dwarf_Debug dbg = cus_holder.get_dbg();
   Dwarf_Unsigned cu_header_length = 0;
   Dwarf_Unsigned abbrev_offset = 0;
   Dwarf_Unsigned next_cu_offset = 0;
   Dwarf_Half version_stamp = 0;
   Dwarf_Half address_size = 0;
+  Dwarf_Unsigned cu_offset = 0;
   Dwarf_Error err = NULL;
   int ret = DW_DLV_ERROR;
+  DwarfFile *file = cus_holder.get_file();
+  uint64 info_size = 0;
 
   while((ret = dwarf_next_cu_header(dbg, &cu_header_length, &version_stamp,
                                     &abbrev_offset, &address_size,
@@ -71,6 +178,7 @@ static void retrieve_cus(CUsHolder &cus_holder)
       {
         DieHolder cu_holder(dbg, cu_die, false);
         Dwarf_Half const tag = cu_holder.get_tag();
+        CUInfo info;
 
         if(tag == DW_TAG_compile_unit)
         {
@@ -80,6 +188,18 @@ static void retrieve_cus(CUsHolder &cus_holder)
         {
           MSG("got %d tag instead of compile unit (skipping)\n", tag);
         }
+
+        // the DIE holders do not ask libdwarf for these anymore
+        info.offset = cu_offset;
+        info.length = next_cu_offset - cu_offset;
+        info.die_offset = cu_holder.get_offset();
+        info.has_low_pc = (cu_holder.get_attr(DW_AT_low_pc) != NULL);
+        info.low_pc = info.has_low_pc ? cu_holder.get_addr_from_attr(DW_AT_low_pc) : 0;
+        info.version = version_stamp;
+        info.address_size = address_size;
+        info.language = (cu_holder.get_attr(DW_AT_language) == NULL) ? 0 :
+          cu_holder.get_attr_small_val(DW_AT_language);
+        cus_holder.add_info(info);
       }
       catch(DieException const &exc)
       {
@@ -91,62 +211,90 @@ static void retrieve_cus(CUsHolder &cus_holder)
     {
       MSG("error getting compilation unit: %s (skipping)\n", dwarf_errmsg(err));
     }
+
+    cu_offset = next_cu_offset;
   }
+
+  // the type unit offsets start after .debug_info,
+  // even if the units could not all be read
+  // (the end of the last read unit if the sections are not mapped)
+  if(file != NULL && file->get_section_data(".debug_info", &info_size) != NULL)
+  {
+    cu_offset = static_cast<Dwarf_Unsigned>(info_size);
+  }
+
+  cus_holder.set_types_base(cu_offset);
+#ifdef HAVE_TYPE_UNITS
+  retrieve_type_units(cus_holder);
+#endif
 }
 
-static int open_dwarf_file(char const *elf_path, Dwarf_Debug *dbg)
+static DwarfFile *open_dwarf_file(char const *elf_path, bool const batch)
 {
-  int fd = -1;
+  DwarfFile *file = NULL;
 
-  if(elf_path != NULL && dbg != NULL)
+  if(elf_path != NULL)
   {
-    fd = open(elf_path, O_RDONLY | O_BINARY, 0);
+    Dwarf_Error err = NULL;
+    int ret = DW_DLV_ERROR;
 
-    if(fd < 0)
+    file = new DwarfFile();
+    // init libdwarf
+    ret = file->open(elf_path, &err);
+
+    if(ret == DW_DLV_ERROR && err == NULL)
     {
-      WARNING("cannot open elf file '%s'\n", elf_path);
+      // no message box in batch mode
+      if(batch)
+      {
+        MSG("cannot open elf file '%s'\n", elf_path);
+      }
+      else
+      {
+        WARNING("cannot open elf file '%s'\n", elf_path);
+      }
     }
-    else
+    else if(ret != DW_DLV_OK)
     {
-      Dwarf_Error err = NULL;
-      // init libdwarf
-      int ret = dwarf_init(fd, DW_DLC_READ, NULL, NULL, dbg, &err);
+      MSG("Cannot init libdwarf for ELF file '%s'\n", elf_path);
 
-      if(ret != DW_DLV_OK)
+      if(ret == DW_DLV_NO_ENTRY)
       {
-        MSG("Cannot init libdwarf for ELF file '%s'\n", elf_path);
-
-        if(ret == DW_DLV_NO_ENTRY)
-        {
-          MSG("no DWARF infos\n");
-        }
-        else if(ret != DW_DLV_OK)
-        {
-          MSG("error during libdwarf init: %s\n", dwarf_errmsg(err));
-        }
-
-        close(fd), fd = -1;
+        MSG("no DWARF infos\n");
       }
+      else
+      {
+        MSG("error during libdwarf init: %s\n", dwarf_errmsg(err));
+      }
+    }
+
+    if(ret != DW_DLV_OK)
+    {
+      delete file, file = NULL;
     }
   }
 
-  return fd;
+  return file;
 }
 
-static void load_separate_dwarf_file(CUsHolder &cus_holder)
+// look for the debug file automatically, then ask for it
+// (only when not in batch mode)
+static void load_separate_dwarf_file(CUsHolder &cus_holder, char const *elf_path,
+                                     bool const batch)
 {
-  char const *res = askfile_c(0, "*", "Select ELF file with DWARF debug infos\n");
+  DwarfFile *file = debug_finder.take_file(elf_path);
 
-  if(res != NULL)
+  if(file == NULL && !batch)
   {
-    Dwarf_Debug dbg = NULL;
-    int fd = open_dwarf_file(res, &dbg);
+    char const *res = askfile_c(0, "*", "Select ELF file with DWARF debug infos\n");
 
-    if(fd >= 0)
-    {
-      cus_holder.reset(dbg, fd);
-      retrieve_cus(cus_holder);
-    }
+    file = open_dwarf_file(res, batch);
+  }
+
+  if(file != NULL)
+  {
+    cus_holder.reset(file);
+    retrieve_cus(cus_holder);
   }
 }
 
@@ -164,6 +312,12 @@ static int idaapi init(void)
     }
     else
     {
+      char elf_path[QMAXPATH];
+
+      get_input_file_path(elf_path, sizeof(elf_path));
+      // the input sections are only read by the search thread
+      // (nothing is searched if the input has DWARF infos)
+      debug_finder.start(elf_path);
       ret = PLUGIN_OK;
     }
   }
@@ -171,57 +325,143 @@ static int idaapi init(void)
   return ret;
 }
 
-static void idaapi run(GCC_UNUSED int arg)
+static void idaapi term(void)
+{
+  debug_finder.clear();
+  stop_lazy_import();
+  remove_macros();
+}
+
+static void idaapi run(int arg)
 {
-  Dwarf_Debug dbg = NULL;
+  bool const batch = ((arg & PLUGIN_ARG_BATCH) != 0);
+  bool const lazy = ((arg & PLUGIN_ARG_LAZY) != 0);
   char elf_path[QMAXPATH];
-  int fd = -1;
+  DwarfFile *file = NULL;
 
+  // the DIE cache of the previous lazy run cannot be used anymore
+  stop_lazy_import();
+  profiler.reset();
   get_input_file_path(elf_path, sizeof(elf_path));
-  fd = open_dwarf_file(elf_path, &dbg);
+  // the search opens libdwarf handles too
+  debug_finder.wait();
+  file = open_dwarf_file(elf_path, batch);
 
-  if(fd >= 0)
+  // the file will be freed by the CUs holder
+  // (kept by the lazy import in lazy mode)
+  auto_ptr<CUsHolder> cus_holder(new CUsHolder(file));
+
+  if(file != NULL)
   {
-    // constructor arguments will be freed by the CUs holder
-    CUsHolder cus_holder(dbg, fd);
+    retrieve_cus(*cus_holder);
+  }
 
-    retrieve_cus(cus_holder);
+  // if there are no compilation units,
+  // we cannot do much with this file...
+  if(cus_holder->size() == 0)
+  {
+    MSG("no compilation unit DIEs found in ELF file '%s'\n", elf_path);
+    // look for the real debug symbols file.
+    load_separate_dwarf_file(*cus_holder, elf_path, batch);
+  }
 
-    // if there are no compilation units,
-    // we cannot do much with this file...
-    if(cus_holder.size() == 0)
+  if(cus_holder->size() != 0)
+  {
+    if(!lazy)
     {
-      MSG("no compilation unit DIEs found in ELF file '%s'\n", elf_path);
-      // ask for the real debug symbols file.
-      load_separate_dwarf_file(cus_holder);
-    }
+      // all the DIEs are walked only one time
+      DieTraversal traversal(*cus_holder);
+      DieIndex die_index;
+      TypeDecoder type_decoder(*cus_holder);
+      bool const use_index = ((arg & PLUGIN_ARG_PERSIST_INDEX) != 0 &&
+                              die_index.open(*cus_holder));
+
+      if(use_index)
+      {
+        traversal.set_index(&die_index);
+      }
 
-    retrieve_types(cus_holder);
+      // the type DIEs are decoded by worker threads while the CUs are walked
+      if(type_decoder.start(use_index ? &die_index : NULL))
+      {
+        traversal.set_decoder(&type_decoder);
+      }
+
+      add_type_visitors(traversal, (arg & PLUGIN_ARG_DEDUPE_TYPES) != 0);
+
+      // functions and variables retrievals use the x86 DWARF ABI
+      // for register related stuff
+      if((arg & PLUGIN_ARG_SKIP_FUNCS) == 0 && strcmp(inf.procName, "metapc") == 0)
+      {
+        add_func_visitors(traversal);
+      }
+
+      if((arg & PLUGIN_ARG_SKIP_GLOBALS) == 0)
+      {
+        add_global_visitors(traversal);
+      }
+
+      traversal.run();
+      type_decoder.stop();
+
+      // before the DIE cache is cleaned
+      if(use_index)
+      {
+        die_index.save();
+      }
+
+      report_dwarf_errors();
+    }
 
-    // functions and variables retrievals use the x86 DWARF ABI
-    // for register related stuff
-    if(strcmp(inf.procName, "metapc") == 0)
+    // the macros are only shown in a chooser
+    if(!batch && (arg & PLUGIN_ARG_SKIP_MACROS) == 0)
     {
-      retrieve_funcs(cus_holder);
+      ProfileScope const scope(TIMER_MACROS);
+
+      retrieve_macros(*cus_holder);
     }
 
-    retrieve_globals(cus_holder);
-    retrieve_macros(dbg);
+    if(lazy)
+    {
+      // the CUs are imported one by one, they are not indexed
+      if((arg & PLUGIN_ARG_PERSIST_INDEX) != 0)
+      {
+        MSG("the DIE index is not used in lazy mode\n");
+      }
 
-    MSG("DWARF analysis is finished!\n");
+      start_lazy_import(cus_holder.release(), arg);
+    }
+    else
+    {
+      MSG("DWARF analysis is finished!\n");
+
+      if((arg & PLUGIN_ARG_PROFILE) != 0)
+      {
+        profiler.report();
+      }
+    }
   }
 
   // plugin has finished its job, DIE cache is useless now
-  diecache.clean();
+  // (unless it is kept by the lazy import)
+  if(cus_holder.get() != NULL)
+  {
+    cus_holder.reset();
+    diecache.clean();
+    clear_type_state();
+    loclist_cache.clear();
+    die_names.clear();
+  }
 }
 
 plugin_t PLUGIN =
 {
   IDP_INTERFACE_VERSION,
   // the plugin stays loaded because of some choose2() calls
+  // (and the macro menu entries, and the lazy import hook)
   PLUGIN_MOD,             // plugin flags
   init,                   // initialize
-  NULL,                   // terminate. this pointer may be NULL.
+  term,                   // terminate. this pointer may be NULL.
   run,                    // invoke plugin
   NULL,                   // long comment about the plugin
   // it could appear in the status line
@@ -2,6 +2,66 @@
 
 extern DieCache diecache;
 
+DieHolderPool die_holder_pool;
+
+DieHolder *DieHolderPool::take(Dwarf_Debug dbg, Dwarf_Die die)
+{
+  DieHolder *die_holder = NULL;
+
+  if(m_free_holders.empty())
+  {
+    die_holder = new DieHolder(dbg, die);
+  }
+  else
+  {
+    die_holder = m_free_holders.back();
+    m_free_holders.pop_back();
+    die_holder->reset(dbg, die);
+  }
+
+  return die_holder;
+}
+
+void DieHolderPool::give_back(DieHolder *die_holder) throw()
+{
+  die_holder->reset(NULL, static_cast<Dwarf_Die>(NULL), false);
+  m_free_holders.push_back(die_holder);
+}
+
+void DieHolderPool::clear(void) throw()
+{
+  for(size_t idx = 0; idx < m_free_holders.size(); ++idx)
+  {
+    delete m_free_holders[idx], m_free_holders[idx] = NULL;
+  }
+
+  m_free_holders.clear();
+}
+
+void PooledDieHolder::reset(Dwarf_Debug dbg, Dwarf_Die die)
+{
+  if(m_die_holder == NULL)
+  {
+    m_die_holder = die_holder_pool.take(dbg, die);
+  }
+  else
+  {
+    m_die_holder->reset(dbg, die);
+  }
+}
+
+void PooledDieHolder::reset(Dwarf_Debug dbg, Dwarf_Off const offset)
+{
+  Dwarf_Die die = NULL;
+  Dwarf_Error err = NULL;
+
+  profiler.count(COUNTER_OFFDIE);
+  CHECK_DWERR(get_die_from_offset(dbg, offset, &die, &err), err,
+              "cannot retrieve DIE from offset 0x%" DW_PR_DUx, offset);
+
+  reset(dbg, die);
+}
+
 DieChildIterator::DieChildIterator(DieHolder &die_holder, Dwarf_Half const tag)
   : m_tag(tag)
 {
@@ -52,119 +112,56 @@ DieChildIterator &DieChildIterator::operator++(void)
 
 void DieChildIterator::set_current_child(Dwarf_Debug dbg, Dwarf_Die child_die)
 {
-  while(child_die != NULL)
+  bool found = false;
+
+  // the same holder is used for the skipped children
+  while(!found && child_die != NULL)
   {
-    DieHolder::Ptr child_holder(new DieHolder(dbg, child_die));
+    m_current_child.reset(dbg, child_die);
 
-    if(m_tag == 0 || child_holder->get_tag() == m_tag)
+    found = (m_tag == 0 || m_current_child->get_tag() == m_tag);
+    if(!found)
     {
-      m_current_child = child_holder;
-      break;
+      child_die = m_current_child->get_sibling();
     }
-
-    child_die = child_holder->get_sibling();
   }
 
-  if(child_die == NULL)
+  if(!found)
   {
     m_current_child.reset();
   }
 }
 
-CachedDieIterator::CachedDieIterator(Dwarf_Debug dbg, Dwarf_Half tag)
-  : m_dbg(dbg), m_tag(tag), m_current_idx(diecache.get_first_offset())
-{
-  set_current_die();
-}
-
-bool CachedDieIterator::operator==(CachedDieIterator const &other) const throw()
-{
-  value_type current_die = m_current_die.get();
-  value_type other_die = other.m_current_die.get();
-  bool ret = false;
-
-  // same current offset?
-  if(m_current_idx != other.m_current_idx)
-  {
-    ret = false;
-  }
-  // got DieHolder and same one?
-  else if(current_die != NULL && other_die != NULL)
-  {
-    ret = (current_die->get_dbg() == other_die->get_dbg() &&
-           current_die->get_die() == other_die->get_die());
-  }
-  // does one have a NULL DieHolder?
-  else
-  {
-    ret = (current_die == NULL && other_die == NULL);
-  }
-
-  return ret;
-}
-
-CachedDieIterator &CachedDieIterator::operator++(void)
-{
-  if(m_current_die.get() != NULL)
-  {
-    m_current_idx = diecache.get_next_offset(m_current_idx);
-
-    set_current_die();
-  }
-
-  return *this;
-}
-
-void CachedDieIterator::set_current_die(void)
-{
-  m_current_die.reset((m_current_idx == BADNODE) ?
-                      NULL : new DieHolder(m_dbg, static_cast<Dwarf_Off>(m_current_idx)));
-
-  // not the right DIE tag?
-  if(m_current_die.get() != NULL &&
-     m_tag != 0 && m_current_die->get_tag() != m_tag)
-  {
-    // TODO: recursion -> iteration
-    ++(*this);
-  }
-}
-
 CacheIterator::CacheIterator(die_type type) throw()
-  : m_die_type(type), m_current_idx(diecache.get_first_offset())
+  : m_die_type(type), m_current_offset(BADNODE), m_found(false)
 {
-  set_current_cache();
+  set_current_cache(0);
 }
 
 CacheIterator &CacheIterator::operator++(void)
 {
-  if(m_current_idx != BADNODE)
+  if(m_found)
   {
-    m_current_idx = diecache.get_next_offset(m_current_idx);
-
-    set_current_cache();
+    set_current_cache(static_cast<Dwarf_Off>(m_current_offset) + 1);
   }
 
   return *this;
 }
 
-void CacheIterator::set_current_cache(void) throw()
+void CacheIterator::set_current_cache(Dwarf_Off const offset) throw()
 {
-  if(m_current_idx != BADNODE)
-  {
-    ssize_t size = diecache.get_cache(static_cast<Dwarf_Off>(m_current_idx),
-                                      &m_current_cache);
+  m_found = false;
+  m_current_offset = diecache.find_added_offset(offset);
 
-    // not found? (should not happen)
-    if(size == -1)
-    {
-      m_current_idx = BADNODE;
-    }
-    // not the right cache type?
-    else if(m_current_cache.type != m_die_type)
+  while(!m_found && m_current_offset != BADNODE)
+  {
+    // the right cache type? (a useful DIE cache is never removed)
+    m_found = (diecache.get_cache(m_current_offset, &m_current_cache) &&
+               m_current_cache.type == m_die_type);
+    if(!m_found)
     {
       // try next die cache
-      // TODO: recursion -> iteration
-      ++(*this);
+      m_current_offset = diecache.find_added_offset(static_cast<Dwarf_Off>(m_current_offset) + 1);
     }
   }
 }
@@ -12,91 +12,134 @@
 
 using namespace std;
 
-class DieChildIterator : public iterator<input_iterator_tag, DieHolder *>
+// unused DIE holders, to not allocate one for each iterated DIE
+// (the held DIEs are released when a holder is given back)
+class DieHolderPool
 {
 public:
-  DieChildIterator(DieHolder &die_holder, Dwarf_Half const tag=0);
-
-  DieChildIterator(DieChildIterator &other) throw()
-    : m_tag(other.m_tag), m_current_child(other.m_current_child)
+  DieHolderPool(void) throw()
   {
 
   }
 
-  virtual ~DieChildIterator(void) throw()
+  virtual ~DieHolderPool(void) throw()
   {
-    m_current_child.reset();
+    clear();
   }
 
-  bool operator==(DieChildIterator const &other) const throw();
+  DieHolder *take(Dwarf_Debug dbg, Dwarf_Die die);
 
-  value_type operator*(void) const throw()
+  void give_back(DieHolder *die_holder) throw();
+
+  // free the unused holders
+  void clear(void) throw();
+
+private:
+  qvector<DieHolder *> m_free_holders;
+
+  // no copying or assignment
+  DieHolderPool(DieHolderPool const &);
+  DieHolderPool &operator=(DieHolderPool const &);
+};
+
+extern DieHolderPool die_holder_pool;
+
+// DIE holder taken from the pool, given back when destroyed
+// the copy constructor transfers the holder like an auto_ptr
+class PooledDieHolder
+{
+public:
+  PooledDieHolder(void) throw()
+    : m_die_holder(NULL)
   {
-    return m_current_child.get();
+
   }
 
-  DieChildIterator &operator++(void);
+  PooledDieHolder(PooledDieHolder &other) throw()
+    : m_die_holder(other.m_die_holder)
+  {
+    other.m_die_holder = NULL;
+  }
 
-  DieChildIterator operator++(GCC_UNUSED int dummy)
+  virtual ~PooledDieHolder(void) throw()
   {
-    DieChildIterator iter(*this);
+    reset();
+  }
 
-    ++iter;
-    return iter;
+  DieHolder *get(void) const throw()
+  {
+    return m_die_holder;
+  }
+
+  DieHolder *operator->(void) const throw()
+  {
+    return m_die_holder;
+  }
+
+  void reset(void) throw()
+  {
+    if(m_die_holder != NULL)
+    {
+      die_holder_pool.give_back(m_die_holder);
+      m_die_holder = NULL;
+    }
   }
 
+  // the current holder (if any) is reused
+  void reset(Dwarf_Debug dbg, Dwarf_Die die);
+
+  void reset(Dwarf_Debug dbg, Dwarf_Off const offset);
+
 private:
-  Dwarf_Half const m_tag;
-  DieHolder::Ptr m_current_child;
+  DieHolder *m_die_holder;
 
-  void set_current_child(Dwarf_Debug dbg, Dwarf_Die child_die);
+  // no assignment
+  PooledDieHolder &operator=(PooledDieHolder const &);
 };
 
-class CachedDieIterator : public iterator<input_iterator_tag, DieHolder *>
+class DieChildIterator : public iterator<input_iterator_tag, DieHolder *>
 {
 public:
-  // if tag is zero, get all the DIEs in cache
-  // else, get all the DIEs with the specified tag
-  CachedDieIterator(Dwarf_Debug dbg, Dwarf_Half tag=0);
+  DieChildIterator(DieHolder &die_holder, Dwarf_Half const tag=0);
 
-  CachedDieIterator(CachedDieIterator &other) throw()
-    : m_dbg(other.m_dbg), m_tag(other.m_tag),
-      m_current_idx(other.m_current_idx), m_current_die(other.m_current_die)
+  DieChildIterator(DieChildIterator &other) throw()
+    : m_tag(other.m_tag), m_current_child(other.m_current_child)
   {
 
   }
 
-  virtual ~CachedDieIterator(void) throw()
+  virtual ~DieChildIterator(void) throw()
   {
-    m_current_die.reset();
+
   }
 
-  bool operator==(CachedDieIterator const &other) const throw();
+  bool operator==(DieChildIterator const &other) const throw();
 
   value_type operator*(void) const throw()
   {
-    return m_current_die.get();
+    return m_current_child.get();
   }
 
-  CachedDieIterator &operator++(void);
+  DieChildIterator &operator++(void);
 
-  CachedDieIterator operator++(GCC_UNUSED int dummy)
+  DieChildIterator operator++(GCC_UNUSED int dummy)
   {
-    CachedDieIterator iter(*this);
+    DieChildIterator iter(*this);
 
     ++iter;
     return iter;
   }
 
 private:
-  Dwarf_Debug m_dbg;
   Dwarf_Half const m_tag;
-  nodeidx_t m_current_idx;
-  DieHolder::Ptr m_current_die;
+  PooledDieHolder m_current_child;
 
-  void set_current_die(void);
+  void set_current_child(Dwarf_Debug dbg, Dwarf_Die child_die);
 };
 
+// the cached DIEs of a type added by the current traversal, in ascending offset order
+// (the cache of the previous traversals and of the restored CUs is skipped)
+// a DIE cached while iterating is only seen if it is after the current one
 class CacheIterator : public iterator<input_iterator_tag, die_cache const *>
 {
 public:
@@ -109,7 +152,13 @@ public:
 
   value_type operator*(void) const throw()
   {
-    return (m_current_idx == BADNODE ? NULL : &m_current_cache);
+    return (m_found ? &m_current_cache : NULL);
+  }
+
+  // offset of the current DIE
+  Dwarf_Off get_offset(void) const throw()
+  {
+    return m_current_offset;
   }
 
   CacheIterator &operator++(void);
@@ -124,10 +173,13 @@ public:
 
 private:
   die_type const m_die_type;
-  nodeidx_t m_current_idx;
+  // BADNODE at the end
+  nodeidx_t m_current_offset;
   die_cache m_current_cache;
+  bool m_found;
 
-  void set_current_cache(void) throw();
+  // from the first added DIE not below the offset
+  void set_current_cache(Dwarf_Off const offset) throw();
 };
 
 #endif // IDADWARF_ITERATORS_HPP
@@ -0,0 +1,528 @@
+#include "lazy_import.hpp"
+
+// standard headers
+#include <algorithm>
+
+// IDA headers
+#include <ida.hpp>
+#include <kernwin.hpp>
+#include <loader.hpp>
+
+// local headers
+#include "gcc_defs.hpp"
+#include "ida_utils.hpp"
+#include "die_cache.hpp"
+#include "loclist_cache.hpp"
+#include "profiling.hpp"
+#include "string_pool.hpp"
+#include "traversal.hpp"
+#include "type_retrieval.hpp"
+#include "func_retrieval.hpp"
+#include "global_retrieval.hpp"
+
+using namespace std;
+
+// where to add the import entry in the IDA menus
+#define IMPORT_RANGE_MENU "Jump/Jump to address..."
+#define IMPORT_RANGE_NAME "DWARF import range..."
+
+extern DieCache diecache;
+
+extern LocListCache loclist_cache;
+
+extern StringPool die_names;
+
+// address ranges of the compilation units,
+// the CUs are imported once, when a range is reached
+// the DIE cache, the type state and the error/profile counters
+// are kept for the whole lazy session
+class LazyImport
+{
+public:
+  // the CUs holder is owned by the lazy import
+  LazyImport(CUsHolder *cus_holder, int const arg) throw()
+    : m_cus_holder(cus_holder), m_arg(arg),
+      m_nb_imported(0), m_importing(false)
+  {
+
+  }
+
+  virtual ~LazyImport(void) throw()
+  {
+    delete m_cus_holder, m_cus_holder = NULL;
+  }
+
+  int get_arg(void) const throw()
+  {
+    return m_arg;
+  }
+
+  void build_index(void);
+
+  size_t get_nb_ranges(void) const throw()
+  {
+    return m_ranges.size();
+  }
+
+  // import the CU with a range containing the address (if not done yet)
+  void import_addr(ea_t const addr);
+
+  // import the CUs with a range overlapping [startEA, endEA)
+  void import_area(ea_t const startEA, ea_t const endEA);
+
+private:
+  struct CURange
+  {
+    ea_t startEA;
+    ea_t endEA;
+    ea_t max_endEA; // of this range and the previous ones (ranges can overlap)
+    uint32 cu_idx; // in the CUs holder
+  };
+
+  CUsHolder *m_cus_holder;
+  int m_arg;
+  // sorted by start address
+  qvector<CURange> m_ranges;
+  // by CU index
+  qvector<bool> m_imported;
+  size_t m_nb_imported;
+  // the import is not reentrant
+  bool m_importing;
+
+  // no copying or assignment
+  LazyImport(LazyImport const &);
+  LazyImport &operator=(LazyImport const &);
+
+  static bool is_before(ea_t const addr, CURange const &range) throw()
+  {
+    return addr < range.startEA;
+  }
+
+  static bool is_start_before(CURange const &range, ea_t const addr) throw()
+  {
+    return range.startEA < addr;
+  }
+
+  static bool is_range_before(CURange const &range1, CURange const &range2) throw()
+  {
+    return range1.startEA < range2.startEA;
+  }
+
+  void add_range(Dwarf_Addr const low_pc, Dwarf_Addr const high_pc,
+                 size_t const cu_idx, qvector<bool> &has_ranges);
+
+  void add_aranges(OffsetTable<uint32> const &cu_idxs, qvector<bool> &has_ranges);
+
+  void add_pc_range(size_t const cu_idx, qvector<bool> &has_ranges);
+
+  void add_ranges_list(DieHolder &cu_holder, Dwarf_Addr base,
+                       size_t const cu_idx, qvector<bool> &has_ranges);
+
+  void add_cu(size_t const cu_idx, qvector<size_t> &cu_idxs) throw();
+
+  void import_cus(qvector<size_t> &cu_idxs);
+};
+
+// lazy import of the last analysis (NULL if none)
+static LazyImport *lazy_import = NULL;
+
+// only while there is a lazy import
+static bool menu_added = false;
+
+// DW_AT_high_pc is an address, or the length of the range since DWARF 4
+static bool get_high_pc(DieHolder &cu_holder, Dwarf_Addr const low_pc,
+                        Dwarf_Addr *high_pc)
+{
+  Dwarf_Attribute attrib = cu_holder.get_attr(DW_AT_high_pc);
+  Dwarf_Half form = 0;
+  Dwarf_Error err = NULL;
+  bool ok = false;
+
+  if(attrib != NULL && dwarf_whatform(attrib, &form, &err) == DW_DLV_OK)
+  {
+    if(form == DW_FORM_addr)
+    {
+      ok = cu_holder.get_addr_from_attr(DW_AT_high_pc, high_pc);
+    }
+    else
+    {
+      Dwarf_Signed length = 0;
+
+      ok = cu_holder.get_attr_small_val(DW_AT_high_pc, &length);
+      *high_pc = low_pc + static_cast<Dwarf_Addr>(length);
+    }
+  }
+
+  return ok;
+}
+
+void LazyImport::build_index(void)
+{
+  ProfileScope const scope(TIMER_ADDR_INDEX);
+  size_t const nb_cus = m_cus_holder->size();
+  OffsetTable<uint32> cu_idxs;
+  qvector<bool> has_ranges;
+
+  has_ranges.resize(nb_cus, false);
+  m_imported.resize(nb_cus, false);
+
+  // the aranges give the CU DIE offset
+  for(size_t idx = 0; idx < nb_cus; ++idx)
+  {
+    DieHolder cu_holder(m_cus_holder->get_dbg(), (*m_cus_holder)[idx], false);
+
+    cu_idxs.get(cu_holder.get_offset()) = static_cast<uint32>(idx);
+  }
+
+  add_aranges(cu_idxs, has_ranges);
+
+  // some compilers do not emit .debug_aranges (or only for some CUs)
+  for(size_t idx = 0; idx < nb_cus; ++idx)
+  {
+    if(!has_ranges[idx])
+    {
+      add_pc_range(idx, has_ranges);
+    }
+  }
+
+  sort(m_ranges.begin(), m_ranges.end(), is_range_before);
+
+  for(size_t idx = 0; idx < m_ranges.size(); ++idx)
+  {
+    m_ranges[idx].max_endEA = (idx == 0) ? m_ranges[idx].endEA :
+      qmax(m_ranges[idx - 1].max_endEA, m_ranges[idx].endEA);
+  }
+}
+
+void LazyImport::add_range(Dwarf_Addr const low_pc, Dwarf_Addr const high_pc,
+                           size_t const cu_idx, qvector<bool> &has_ranges)
+{
+  if(low_pc < high_pc)
+  {
+    CURange range;
+
+    range.startEA = static_cast<ea_t>(low_pc);
+    range.endEA = static_cast<ea_t>(high_pc);
+    range.max_endEA = range.endEA;
+    range.cu_idx = static_cast<uint32>(cu_idx);
+    m_ranges.push_back(range);
+    has_ranges[cu_idx] = true;
+  }
+}
+
+void LazyImport::add_aranges(OffsetTable<uint32> const &cu_idxs,
+                             qvector<bool> &has_ranges)
+{
+  Dwarf_Debug dbg = m_cus_holder->get_dbg();
+  Dwarf_Arange *aranges = NULL;
+  Dwarf_Signed nb_aranges = 0;
+  Dwarf_Error err = NULL;
+  int ret = dwarf_get_aranges(dbg, &aranges, &nb_aranges, &err);
+
+  if(ret == DW_DLV_ERROR)
+  {
+    MSG("cannot read .debug_aranges: %s\n", dwarf_errmsg(err));
+  }
+  else if(ret == DW_DLV_OK)
+  {
+    for(Dwarf_Signed idx = 0; idx < nb_aranges; ++idx)
+    {
+      Dwarf_Addr start = 0;
+      Dwarf_Unsigned length = 0;
+      Dwarf_Off cu_die_offset = 0;
+
+      ret = dwarf_get_arange_info(aranges[idx], &start, &length, &cu_die_offset, &err);
+      if(ret == DW_DLV_OK)
+      {
+        uint32 const *cu_idx = cu_idxs.find(cu_die_offset);
+
+        // the unknown CUs have been skipped
+        if(cu_idx != NULL)
+        {
+          add_range(start, start + length, *cu_idx, has_ranges);
+        }
+      }
+
+      dwarf_dealloc(dbg, aranges[idx], DW_DLA_ARANGE);
+    }
+
+    dwarf_dealloc(dbg, aranges, DW_DLA_LIST);
+  }
+}
+
+// the low/high_pc range of the CU, or its DW_AT_ranges list
+// (a non contiguous CU has no high_pc)
+void LazyImport::add_pc_range(size_t const cu_idx, qvector<bool> &has_ranges)
+{
+  try
+  {
+    DieHolder cu_holder(m_cus_holder->get_dbg(), (*m_cus_holder)[cu_idx], false);
+    Dwarf_Addr low_pc = 0;
+    Dwarf_Addr high_pc = 0;
+    bool const has_low_pc = (cu_holder.get_attr(DW_AT_low_pc) != NULL &&
+                             cu_holder.get_addr_from_attr(DW_AT_low_pc, &low_pc));
+
+    if(has_low_pc && get_high_pc(cu_holder, low_pc, &high_pc))
+    {
+      add_range(low_pc, high_pc, cu_idx, has_ranges);
+    }
+    // the list addresses are relative to the low_pc (0 if none)
+    else if(cu_holder.get_attr(DW_AT_ranges) != NULL)
+    {
+      add_ranges_list(cu_holder, has_low_pc ? low_pc : 0, cu_idx, has_ranges);
+    }
+  }
+  catch(DieException const &exc)
+  {
+    MSG("cannot get the range of a compilation unit: %s (skipping)\n", exc.what());
+  }
+}
+
+// the ranges list is in .debug_ranges
+void LazyImport::add_ranges_list(DieHolder &cu_holder, Dwarf_Addr base,
+                                 size_t const cu_idx, qvector<bool> &has_ranges)
+{
+  Dwarf_Debug dbg = cu_holder.get_dbg();
+  Dwarf_Off const ranges_offset =
+    static_cast<Dwarf_Off>(cu_holder.get_attr_small_val(DW_AT_ranges));
+  Dwarf_Ranges *ranges = NULL;
+  Dwarf_Signed nb_ranges = 0;
+  Dwarf_Unsigned nb_bytes = 0;
+  Dwarf_Error err = NULL;
+
+  CHECK_DWERR(dwarf_get_ranges(dbg, ranges_offset, &ranges, &nb_ranges, &nb_bytes, &err),
+              err, "cannot get the ranges list at offset 0x%" DW_PR_DUx, ranges_offset);
+
+  for(Dwarf_Signed idx = 0; idx < nb_ranges; ++idx)
+  {
+    Dwarf_Ranges const &entry = ranges[idx];
+
+    switch(entry.dwr_type)
+    {
+    case DW_RANGES_ENTRY:
+      add_range(base + entry.dwr_addr1, base + entry.dwr_addr2, cu_idx, has_ranges);
+      break;
+    case DW_RANGES_ADDRESS_SELECTION:
+      base = entry.dwr_addr2;
+      break;
+    default:
+      // end of the list
+      break;
+    }
+  }
+
+  dwarf_ranges_dealloc(dbg, ranges, nb_ranges);
+}
+
+void LazyImport::add_cu(size_t const cu_idx, qvector<size_t> &cu_idxs) throw()
+{
+  if(!m_imported[cu_idx])
+  {
+    cu_idxs.push_back(cu_idx);
+  }
+}
+
+void LazyImport::import_addr(ea_t const addr)
+{
+  CURange const *range = upper_bound(m_ranges.begin(), m_ranges.end(), addr, is_before);
+  qvector<size_t> cu_idxs;
+
+  // the ranges starting before the address can overlap:
+  // go back until none of the previous ones reaches it
+  while(range != m_ranges.begin() && (range - 1)->max_endEA > addr)
+  {
+    --range;
+
+    if(addr < range->endEA)
+    {
+      add_cu(range->cu_idx, cu_idxs);
+    }
+  }
+
+  if(!cu_idxs.empty())
+  {
+    import_cus(cu_idxs);
+  }
+}
+
+void LazyImport::import_area(ea_t const startEA, ea_t const endEA)
+{
+  CURange const *end = lower_bound(m_ranges.begin(), m_ranges.end(), endEA,
+                                   is_start_before);
+  qvector<size_t> cu_idxs;
+
+  for(CURange const *range = m_ranges.begin(); range != end; ++range)
+  {
+    if(range->endEA > startEA)
+    {
+      add_cu(range->cu_idx, cu_idxs);
+    }
+  }
+
+  if(cu_idxs.empty())
+  {
+    MSG("no compilation unit left to import in [0x%lx, 0x%lx)\n", startEA, endEA);
+  }
+  else
+  {
+    import_cus(cu_idxs);
+  }
+}
+
+void LazyImport::import_cus(qvector<size_t> &cu_idxs)
+{
+  if(!m_importing)
+  {
+    m_importing = true;
+
+    // in .debug_info order, once (a CU can have several ranges)
+    sort(cu_idxs.begin(), cu_idxs.end());
+    cu_idxs.resize(unique(cu_idxs.begin(), cu_idxs.end()) - cu_idxs.begin());
+
+    for(size_t idx = 0; idx < cu_idxs.size(); ++idx)
+    {
+      m_imported[cu_idxs[idx]] = true;
+    }
+
+    {
+      DieTraversal traversal(*m_cus_holder);
+
+      traversal.set_cus(&cu_idxs);
+      add_type_visitors(traversal, (m_arg & PLUGIN_ARG_DEDUPE_TYPES) != 0);
+
+      // functions and variables retrievals use the x86 DWARF ABI
+      // for register related stuff
+      if((m_arg & PLUGIN_ARG_SKIP_FUNCS) == 0 && strcmp(inf.procName, "metapc") == 0)
+      {
+        add_func_visitors(traversal);
+      }
+
+      if((m_arg & PLUGIN_ARG_SKIP_GLOBALS) == 0)
+      {
+        add_global_visitors(traversal);
+      }
+
+      traversal.run();
+    }
+
+    m_nb_imported += cu_idxs.size();
+    MSG("%u compilation units imported (%u/%u)\n", static_cast<uint32>(cu_idxs.size()),
+        static_cast<uint32>(m_nb_imported), static_cast<uint32>(m_imported.size()));
+
+    // the DIE cache is kept for the next imports
+    loclist_cache.clear();
+    m_importing = false;
+  }
+}
+
+// IDA 5.5 has no cursor notification,
+// so the cursor is checked after each UI command (jumps, xrefs, ...)
+static int idaapi ui_callback(void *user_data, int notification_code,
+                              GCC_UNUSED va_list va)
+{
+  if(notification_code == ui_postprocess)
+  {
+    static_cast<LazyImport *>(user_data)->import_addr(get_screen_ea());
+  }
+
+  return 0;
+}
+
+// the selection, or the asked range
+static bool idaapi import_range(GCC_UNUSED void *ud)
+{
+  if(lazy_import == NULL)
+  {
+    MSG("no lazy import, run the plugin in lazy mode first\n");
+  }
+  else
+  {
+    ea_t startEA = BADADDR;
+    ea_t endEA = BADADDR;
+
+    if(!read_selection(&startEA, &endEA))
+    {
+      startEA = get_screen_ea();
+      endEA = startEA;
+
+      if(!askaddr(&startEA, "Start of the range to import") ||
+         !askaddr(&endEA, "End of the range to import"))
+      {
+        startEA = endEA = BADADDR;
+      }
+    }
+
+    if(startEA < endEA)
+    {
+      lazy_import->import_area(startEA, endEA);
+    }
+  }
+
+  return true;
+}
+
+void start_lazy_import(CUsHolder *cus_holder, int const arg)
+{
+  stop_lazy_import();
+  lazy_import = new LazyImport(cus_holder, arg);
+  lazy_import->build_index();
+
+  if(!hook_to_notification_point(HT_UI, ui_callback, lazy_import))
+  {
+    MSG("cannot follow the navigation, only the import menu entry can be used\n");
+  }
+
+  if(!menu_added)
+  {
+    if(!add_menu_item(IMPORT_RANGE_MENU, IMPORT_RANGE_NAME, NULL, SETMENU_APP,
+                      import_range, NULL))
+    {
+      MSG("cannot add the import menu entry\n");
+    }
+
+    menu_added = true;
+  }
+
+  MSG("lazy mode: %u address ranges of %u compilation units indexed, "
+      "the units are imported when they are reached "
+      "(or with Jump/" IMPORT_RANGE_NAME ")\n",
+      static_cast<uint32>(lazy_import->get_nb_ranges()),
+      static_cast<uint32>(cus_holder->size()));
+
+  // where the user already is (no cursor in batch mode)
+  if((arg & PLUGIN_ARG_BATCH) == 0)
+  {
+    lazy_import->import_addr(get_screen_ea());
+  }
+}
+
+void stop_lazy_import(void) throw()
+{
+  if(lazy_import != NULL)
+  {
+    int const arg = lazy_import->get_arg();
+
+    unhook_from_notification_point(HT_UI, ui_callback, lazy_import);
+    delete lazy_import, lazy_import = NULL;
+
+    if(menu_added)
+    {
+      del_menu_item("Jump/" IMPORT_RANGE_NAME);
+      menu_added = false;
+    }
+
+    // the errors and the profile of the whole session
+    MSG("DWARF lazy import is finished!\n");
+    report_dwarf_errors();
+    if((arg & PLUGIN_ARG_PROFILE) != 0)
+    {
+      profiler.report();
+    }
+
+    // the imported DIEs were kept in the cache
+    diecache.clean();
+    clear_type_state();
+    loclist_cache.clear();
+    die_names.clear();
+  }
+}
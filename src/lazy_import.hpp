@@ -0,0 +1,20 @@
+#ifndef IDADWARF_LAZY_IMPORT_HPP
+#define IDADWARF_LAZY_IMPORT_HPP
+
+// local headers
+#include "die_utils.hpp"
+
+// lazy mode: the run only indexes the address ranges of the compilation units
+// (from .debug_aranges, or from the CU low/high_pc).
+// a CU (its functions, variables and their types) is imported
+// the first time the user goes into one of its ranges,
+// or with the "Jump/DWARF import range..." menu entry.
+// the CUs holder, the DIE cache and the type state are kept
+// until the lazy import is stopped, the errors and the profile
+// of the whole session are reported then
+void start_lazy_import(CUsHolder *cus_holder, int const arg);
+
+// when the plugin is run again or unloaded
+void stop_lazy_import(void) throw();
+
+#endif // IDADWARF_LAZY_IMPORT_HPP
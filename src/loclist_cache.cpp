@@ -0,0 +1,239 @@
+#include "loclist_cache.hpp"
+
+// standard headers
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// DIE offsets are shifted to keep the attribute in the low bits
+// (attribute codes fit in 14 bits, vendor ones included)
+#define ATTR_BITS 14
+
+// RAII dwarf_dealloc wrapper for multiple deallocs
+class DwarfDealloc
+{
+public:
+  DwarfDealloc(Dwarf_Debug dbg) throw()
+    : m_dbg(dbg)
+  {
+
+  }
+
+  virtual ~DwarfDealloc(void) throw()
+  {
+    for(size_t idx = m_deallocs.size(); idx > 0; --idx)
+    {
+      DeallocPair &dealloc_pair = m_deallocs[idx - 1];
+
+      dwarf_dealloc(m_dbg, dealloc_pair.first, dealloc_pair.second);
+      dealloc_pair.first = NULL;
+    }
+  }
+
+  void add(void *ptr, Dwarf_Unsigned dealloc_type) throw()
+  {
+    m_deallocs.push_back(make_pair(ptr, dealloc_type));
+  }
+
+private:
+  Dwarf_Debug m_dbg;
+  typedef pair<void *, Dwarf_Unsigned> DeallocPair;
+  qvector<DeallocPair> m_deallocs;
+
+  // no copying or assignment
+  DwarfDealloc(DwarfDealloc const &);
+  DwarfDealloc &operator=(DwarfDealloc const &);
+};
+
+static uint64 get_key(Dwarf_Off const offset, int const attr) throw()
+{
+  return (static_cast<uint64>(offset) << ATTR_BITS) |
+    (static_cast<uint64>(attr) & ((1 << ATTR_BITS) - 1));
+}
+
+// orders the description indexes by low PC
+class LowerPc
+{
+public:
+  LowerPc(Dwarf_Locdesc **llbuf) throw()
+    : m_llbuf(llbuf)
+  {
+
+  }
+
+  bool operator()(size_t const idx, size_t const other_idx) const throw()
+  {
+    return (m_llbuf[idx]->ld_lopc < m_llbuf[other_idx]->ld_lopc);
+  }
+
+private:
+  Dwarf_Locdesc **m_llbuf;
+};
+
+static void delete_list(GCC_UNUSED uint64 const key, LocList *const &list,
+                        GCC_UNUSED void *arg) throw()
+{
+  delete list;
+}
+
+// the libdwarf descriptions are copied, then deallocated
+static void decode_list(DieHolder &die_holder, int const attr, LocList &list)
+{
+  Dwarf_Debug dbg = die_holder.get_dbg();
+  Dwarf_Attribute attrib = die_holder.get_attr(attr);
+  Dwarf_Locdesc **llbuf = NULL;
+  Dwarf_Signed count = 0;
+  Dwarf_Error err = NULL;
+  DwarfDealloc dealloc(dbg);
+  vector<size_t> sorted_idxs;
+  Dwarf_Addr max_hipc = 0;
+  size_t nb_locs = 0;
+
+  CHECK_DWERR2(attrib == NULL, NULL,
+               "retrieving a location list implies finding the attribute...");
+
+  CHECK_DWERR(dwarf_loclist_n(attrib, &llbuf, &count, &err), err,
+              "cannot get location descriptions");
+
+  dealloc.add(llbuf, DW_DLA_LIST);
+  for(Dwarf_Signed idx = 0; idx < count; ++idx)
+  {
+    // handle deallocation too
+    dealloc.add(llbuf[idx], DW_DLA_LOCDESC);
+    dealloc.add(llbuf[idx]->ld_s, DW_DLA_LOC_BLOCK);
+  }
+
+  for(Dwarf_Signed idx = 0; idx < count; ++idx)
+  {
+    sorted_idxs.push_back(static_cast<size_t>(idx));
+  }
+
+  stable_sort(sorted_idxs.begin(), sorted_idxs.end(), LowerPc(llbuf));
+
+  for(size_t idx = 0; idx < sorted_idxs.size(); ++idx)
+  {
+    Dwarf_Locdesc const *locdesc = llbuf[sorted_idxs[idx]];
+
+    if(idx != 0 && locdesc->ld_lopc < max_hipc)
+    {
+      list.overlapping = true;
+    }
+
+    max_hipc = qmax(max_hipc, locdesc->ld_hipc);
+    list.descs.push_back(*locdesc);
+    list.list_idxs.push_back(sorted_idxs[idx]);
+    for(Dwarf_Half loc_idx = 0; loc_idx < locdesc->ld_cents; ++loc_idx)
+    {
+      list.locs.push_back(locdesc->ld_s[loc_idx]);
+    }
+  }
+
+  // the locations are not moved anymore
+  for(size_t idx = 0; idx < list.descs.size(); ++idx)
+  {
+    Dwarf_Locdesc &locdesc = list.descs[idx];
+
+    locdesc.ld_s = (locdesc.ld_cents == 0) ? NULL : &list.locs[nb_locs];
+    nb_locs += locdesc.ld_cents;
+  }
+}
+
+Dwarf_Locdesc const *LocList::find(ea_t const rel_addr, bool const only_locblock) const throw()
+{
+  Dwarf_Locdesc const *found = NULL;
+
+  if(!descs.empty())
+  {
+    // from a location block?
+    if(!descs[0].ld_from_loclist)
+    {
+      // no need to check the address
+      found = &descs[0];
+    }
+    // these loc descs are from a location list
+    else if(!only_locblock)
+    {
+      // binary search for the last description beginning before the address
+      size_t low = 0;
+      size_t high = descs.size();
+
+      while(low < high)
+      {
+        size_t const middle = low + (high - low) / 2;
+
+        if(descs[middle].ld_lopc <= rel_addr)
+        {
+          low = middle + 1;
+        }
+        else
+        {
+          high = middle;
+        }
+      }
+
+      if(!overlapping)
+      {
+        if(low != 0 && descs[low - 1].ld_hipc > rel_addr)
+        {
+          found = &descs[low - 1];
+        }
+      }
+      else
+      {
+        size_t found_idx = descs.size();
+
+        // all the descriptions before can cover the address
+        for(size_t idx = 0; idx < low; ++idx)
+        {
+          if(descs[idx].ld_hipc > rel_addr &&
+             (found_idx == descs.size() || list_idxs[idx] < list_idxs[found_idx]))
+          {
+            found_idx = idx;
+          }
+        }
+
+        if(found_idx != descs.size())
+        {
+          found = &descs[found_idx];
+        }
+      }
+    }
+  }
+
+  return found;
+}
+
+LocList const &LocListCache::get(DieHolder &die_holder, int const attr)
+{
+  uint64 const key = get_key(die_holder.get_offset(), attr);
+  LocList **cached_list = m_lists.find(key);
+  LocList *list = (cached_list == NULL) ? NULL : *cached_list;
+
+  if(list == NULL)
+  {
+    auto_ptr<LocList> new_list(new LocList);
+    Dwarf_Off const cu_offset = die_holder.get_CU_offset();
+
+    decode_list(die_holder, attr, *new_list);
+
+    // only keep the lists of one CU
+    if(cu_offset != m_cu_offset)
+    {
+      clear();
+      m_cu_offset = cu_offset;
+    }
+
+    list = new_list.release();
+    m_lists.set(key, list);
+  }
+
+  return *list;
+}
+
+void LocListCache::clear(void) throw()
+{
+  m_lists.for_each(delete_list, static_cast<void *>(NULL));
+  m_lists.clear();
+  m_cu_offset = 0;
+}
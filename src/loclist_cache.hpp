@@ -0,0 +1,70 @@
+#ifndef IDADWARF_LOCLIST_CACHE_HPP
+#define IDADWARF_LOCLIST_CACHE_HPP
+
+// additional libs headers
+#include <dwarf.h>
+#include <libdwarf.h>
+
+// local headers
+#include "die_utils.hpp"
+#include "gcc_defs.hpp"
+#include "offset_table.hpp"
+
+// decoded copy of a location list (or of a location block)
+// the location descriptions of a list are sorted by low PC,
+// their locations (ld_s) point in the list own locations
+struct LocList
+{
+  LocList(void) throw()
+    : overlapping(false)
+  {
+
+  }
+
+  qvector<Dwarf_Locdesc> descs;
+  qvector<Dwarf_Loc> locs;
+  // index of each description in the list order
+  qvector<size_t> list_idxs;
+  // do some address ranges overlap?
+  bool overlapping;
+
+  // description for a CU relative address, NULL if none
+  // (a location block is used for every address)
+  // like a walk of the list, the first description in the list order
+  // is found when several ones cover the address
+  Dwarf_Locdesc const *find(ea_t const rel_addr, bool const only_locblock) const throw();
+};
+
+// decoded location lists of the DIEs of the last compilation unit
+// each location list attribute is only decoded once by libdwarf,
+// the cache is emptied when a DIE of another CU is asked for
+class LocListCache
+{
+public:
+  LocListCache(void) throw()
+    : m_cu_offset(0)
+  {
+
+  }
+
+  virtual ~LocListCache(void) throw()
+  {
+    clear();
+  }
+
+  // the attribute must be there
+  LocList const &get(DieHolder &die_holder, int const attr);
+
+  void clear(void) throw();
+
+private:
+  // by DIE offset and attribute (see get_key)
+  OffsetTable<LocList *> m_lists;
+  Dwarf_Off m_cu_offset;
+
+  // no copying or assignment
+  LocListCache(LocListCache const &);
+  LocListCache &operator=(LocListCache const &);
+};
+
+#endif // IDADWARF_LOCLIST_CACHE_HPP
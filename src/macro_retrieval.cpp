@@ -1,91 +1,328 @@
 #include "macro_retrieval.hpp"
 
+// standard headers
+#include <algorithm>
+#include <utility>
+
 // IDA headers
 #include <ida.hpp>
 #include <kernwin.hpp>
 
 // local headers
+#include "dwarf_file.hpp"
+#include "gcc_defs.hpp"
 #include "ida_utils.hpp"
+#include "string_pool.hpp"
+
+using namespace std;
+
+#define NO_MACRO_CU 0xFFFFFFFF
 
-typedef struct
+// where to add the macro entries in the IDA menus
+#define SHOW_MACROS_MENU "View/Open subviews/Problems"
+#define FIND_MACROS_MENU "Search/Text..."
+#define SHOW_MACROS_NAME "DWARF macros"
+#define FIND_MACROS_NAME "DWARF macro..."
+
+// a defined macro, stored once for all the CUs defining it
+struct MacroInfo
 {
-  char *macro;
-  size_t name_len;
-} macro_details;
+  char const *macro; // interned "name value"
+  size_t name_len; // with the separator
+  uint32 nb_cus;
+  uint32 last_cu; // index of the last defining CU link (NO_MACRO_CU if none)
+};
 
-class MacroInfos: public qvector<macro_details *>
+// the defining CUs of a macro are linked (last one first)
+struct MacroCU
+{
+  Dwarf_Off cu_offset;
+  uint32 next; // NO_MACRO_CU at the end
+};
+
+// 3 name chars (the substring index)
+struct NameGram
+{
+  uint32 gram;
+  uint32 macro_idx;
+
+  bool operator<(NameGram const &other) const throw()
+  {
+    return (gram < other.gram ||
+            (gram == other.gram && macro_idx < other.macro_idx));
+  }
+};
+
+// (.debug_macinfo offset, CU offset)
+typedef pair<Dwarf_Unsigned, Dwarf_Off> MacinfoCU;
+
+// macros deduplicated by (name, value)
+// all the macro strings are in one string pool.
+// .debug_macinfo is only decoded when the macros are asked for,
+// with a libdwarf handle of its own.
+// the object is shared by the macro lists (reference counted)
+class MacroInfos
 {
 public:
-  virtual ~MacroInfos(void) throw()
+  MacroInfos(char const *path, qvector<MacinfoCU> const &macinfo_cus) throw()
+    : m_path(path), m_macinfo_cus(macinfo_cus), m_loaded(false), m_refs(1)
+  {
+
+  }
+
+  void add_ref(void) throw()
   {
-    clean();
+    m_refs++;
   }
 
-private:
-  void clean(void) throw()
+  void release(void) throw()
   {
-    for(size_t idx = 0; idx < size(); ++idx)
+    if(--m_refs == 0)
     {
-      macro_details *details = (*this)[idx];
-
-      if(details != NULL)
-      {
-        delete details->macro, details->macro = NULL;
-        delete details;
-        (*this)[idx] = NULL;
-      }
+      delete this;
     }
   }
+
+  // decode the macros (only the first time)
+  void load(void) throw();
+
+  size_t size(void) const throw()
+  {
+    return m_macros.size();
+  }
+
+  MacroInfo const &operator[](size_t const idx) const throw()
+  {
+    return m_macros[idx];
+  }
+
+  MacroCU const &get_cu(uint32 const idx) const throw()
+  {
+    return m_cus[idx];
+  }
+
+  // macro indexes, sorted by name
+  qvector<uint32> const &get_sorted(void) const throw()
+  {
+    return m_sorted;
+  }
+
+  // macros with a name containing the pattern:
+  // the ones beginning with it first, then the others (sorted by name)
+  void find(char const *pattern, qvector<uint32> &macro_idxs) const throw();
+
+private:
+  qstring m_path;
+  qvector<MacinfoCU> m_macinfo_cus;
+  bool m_loaded;
+  int m_refs;
+  // only the macros are interned, string ids are macro indexes
+  StringPool m_strings;
+  qvector<MacroInfo> m_macros;
+  qvector<MacroCU> m_cus;
+  qvector<uint32> m_sorted;
+  // position of each macro in the sorted ones
+  qvector<uint32> m_ranks;
+  // all the name grams, sorted
+  qvector<NameGram> m_grams;
+
+  virtual ~MacroInfos(void) throw()
+  {
+
+  }
+
+  // no copying or assignment
+  MacroInfos(MacroInfos const &);
+  MacroInfos &operator=(MacroInfos const &);
+
+  // cu_offset is 0 if the defining CU is unknown
+  void add(char const *macro, size_t const name_len, Dwarf_Off const cu_offset) throw();
+
+  void decode(Dwarf_Debug dbg) throw();
+
+  void build_index(void) throw();
+
+  void find_prefixed(char const *pattern, size_t const len,
+                     qvector<uint32> &macro_idxs) const throw();
+
+  struct RankLess
+  {
+    qvector<uint32> const *ranks;
+
+    bool operator()(uint32 const idx, uint32 const other_idx) const throw()
+    {
+      return ((*ranks)[idx] < (*ranks)[other_idx]);
+    }
+  };
 };
 
-int const macro_widths[2] = { 24, 32 };
-char const * const macro_headers[2] = { "Name", "Value" };
-char const macro_title[] = "Macros";
+static size_t get_name_len(MacroInfo const &info) throw()
+{
+  // without the separator
+  return (info.name_len == 0) ? 0 : info.name_len - 1;
+}
 
-uint32 idaapi get_nb_macros(void *obj)
+static int compare_name(MacroInfo const &info, char const *name, size_t const len) throw()
 {
-  MacroInfos *macros = static_cast<MacroInfos *>(obj);
+  size_t const info_len = get_name_len(info);
+  int ret = strncmp(info.macro, name, qmin(info_len, len));
 
-  return macros->size();
+  if(ret == 0)
+  {
+    ret = (info_len < len) ? -1 : (info_len > len);
+  }
+
+  return ret;
 }
 
-static void idaapi get_macro(void *obj, uint32 n, char * const *cells)
+static bool name_contains(MacroInfo const &info, char const *pattern, size_t const len) throw()
 {
-  MacroInfos *macros = static_cast<MacroInfos *>(obj);
+  size_t const info_len = get_name_len(info);
+  bool found = false;
 
-  if(n == 0)
+  for(size_t idx = 0; !found && idx + len <= info_len; ++idx)
   {
-    qstrncpy(cells[0], macro_headers[0], macro_widths[0]);
-    qstrncpy(cells[1], macro_headers[1], macro_widths[1]);
+    found = (memcmp(info.macro + idx, pattern, len) == 0);
   }
-  else
+
+  return found;
+}
+
+static bool same_name_gram(NameGram const &name_gram, NameGram const &other) throw()
+{
+  return (name_gram.gram == other.gram && name_gram.macro_idx == other.macro_idx);
+}
+
+static uint32 get_gram(char const *str) throw()
+{
+  return ((static_cast<uint32>(static_cast<uchar>(str[0])) << 16) |
+          (static_cast<uint32>(static_cast<uchar>(str[1])) << 8) |
+          static_cast<uint32>(static_cast<uchar>(str[2])));
+}
+
+struct NameLess
+{
+  qvector<MacroInfo> const *macros;
+
+  bool operator()(uint32 const idx, uint32 const other_idx) const throw()
+  {
+    MacroInfo const &other = (*macros)[other_idx];
+
+    return (compare_name((*macros)[idx], other.macro, get_name_len(other)) < 0);
+  }
+};
+
+void MacroInfos::add(char const *macro, size_t const name_len, Dwarf_Off const cu_offset) throw()
+{
+  uint32 const id = m_strings.intern(macro);
+
+  if(id != StringPool::NO_STRING)
   {
-    macro_details const *details = (*macros)[n - 1];
-    char const *macro = details->macro;
-    size_t const name_len = details->name_len;
+    if(id == m_macros.size())
+    {
+      MacroInfo info;
+
+      info.macro = m_strings.get(id);
+      info.name_len = name_len;
+      info.nb_cus = 0;
+      info.last_cu = NO_MACRO_CU;
+      m_macros.push_back(info);
+    }
 
-    if(macro != NULL)
+    MacroInfo &info = m_macros[id];
+
+    // (a header can define the same macro more than once)
+    if(cu_offset != 0 &&
+       (info.last_cu == NO_MACRO_CU || m_cus[info.last_cu].cu_offset != cu_offset))
     {
-      qstrncpy(cells[0], macro, name_len);
-      qstrncpy(cells[1], macro + name_len, MAXSTR);
+      MacroCU macro_cu;
+
+      macro_cu.cu_offset = cu_offset;
+      macro_cu.next = info.last_cu;
+      info.last_cu = static_cast<uint32>(m_cus.size());
+      info.nb_cus++;
+      m_cus.push_back(macro_cu);
     }
   }
 }
 
-static void idaapi destroy_macros(void *obj)
+// the CUs by their offset in .debug_macinfo
+static void get_macinfo_cus(CUsHolder const &cus_holder, qvector<MacinfoCU> &macinfo_cus)
 {
-  MacroInfos *macros = static_cast<MacroInfos *>(obj);
+  for(size_t idx = 0; idx < cus_holder.size(); ++idx)
+  {
+    try
+    {
+      DieHolder cu_holder(cus_holder.get_dbg(), cus_holder[idx], false);
 
-  delete macros;
+      if(cu_holder.get_attr(DW_AT_macro_info) != NULL)
+      {
+        Dwarf_Unsigned const macinfo_offset =
+          static_cast<Dwarf_Unsigned>(cu_holder.get_attr_small_val(DW_AT_macro_info));
+
+        macinfo_cus.push_back(make_pair(macinfo_offset, cu_holder.get_offset()));
+      }
+    }
+    catch(DieException const &exc)
+    {
+      MSG("cannot retrieve the macro infos of a compilation unit: %s (skipping)\n",
+          exc.what());
+    }
+  }
+
+  sort(macinfo_cus.begin(), macinfo_cus.end());
 }
 
-void retrieve_macros(Dwarf_Debug dbg)
+// the entries of a CU begin at its macinfo offset
+// returns 0 if the CU is unknown
+static Dwarf_Off find_macinfo_cu(qvector<MacinfoCU> const &macinfo_cus,
+                                 Dwarf_Off const offset)
+{
+  MacinfoCU const *begin = macinfo_cus.begin();
+  MacinfoCU const *end = macinfo_cus.end();
+  // the CU offset of the key is bigger than any other
+  MacinfoCU const key(offset, ~static_cast<Dwarf_Off>(0));
+  MacinfoCU const *next = upper_bound(begin, end, key);
+
+  return (next == begin) ? 0 : (next - 1)->second;
+}
+
+void MacroInfos::load(void) throw()
+{
+  if(!m_loaded)
+  {
+    DwarfFile file;
+    Dwarf_Error err = NULL;
+    int const ret = file.open(m_path.c_str(), &err);
+
+    // only tried once
+    m_loaded = true;
+
+    if(ret == DW_DLV_OK)
+    {
+      decode(file.get_dbg());
+      file.close();
+    }
+    else if(ret == DW_DLV_ERROR && err == NULL)
+    {
+      MSG("cannot open '%s' to read the macros\n", m_path.c_str());
+    }
+    else if(ret == DW_DLV_ERROR)
+    {
+      MSG("cannot read the macros in '%s': %s\n", m_path.c_str(), dwarf_errmsg(err));
+    }
+
+    build_index();
+  }
+}
+
+// the macros are interned batch by batch
+void MacroInfos::decode(Dwarf_Debug dbg) throw()
 {
   Dwarf_Off offset = 0;
   Dwarf_Unsigned max = 0;
   Dwarf_Signed count = 0;
   Dwarf_Macro_Details *maclist = NULL;
-  MacroInfos *macros = new MacroInfos;
   Dwarf_Error err = NULL;
   int ret = DW_DLV_ERROR;
 
@@ -93,7 +330,7 @@ void retrieve_macros(Dwarf_Debug dbg)
                                        &maclist, &err)) == DW_DLV_OK)
   {
     for(Dwarf_Signed idx = 0; idx < count; ++idx)
-    {      
+    {
       struct Dwarf_Macro_Details_s const *dmd = &maclist[idx];
 
       if(dmd->dmd_type == DW_MACINFO_define)
@@ -106,12 +343,10 @@ void retrieve_macros(Dwarf_Debug dbg)
 
           if(value_start != NULL)
           {
-            macro_details *details = new macro_details;
             size_t const name_len = static_cast<size_t>(value_start - macro);
 
-            details->macro = qstrdup(macro);
-            details->name_len = (name_len < MAXSTR) ? name_len : MAXSTR;
-            macros->push_back(details);
+            add(macro, (name_len < MAXSTR) ? name_len : MAXSTR,
+                find_macinfo_cu(m_macinfo_cus, dmd->dmd_offset));
           }
         }
       }
@@ -126,8 +361,297 @@ void retrieve_macros(Dwarf_Debug dbg)
   {
     MSG("error getting macro details: %s\n", dwarf_errmsg(err));
   }
+}
+
+void MacroInfos::build_index(void) throw()
+{
+  NameLess name_less = { &m_macros };
+
+  m_sorted.resize(m_macros.size());
+  m_ranks.resize(m_macros.size());
+
+  for(size_t idx = 0; idx < m_macros.size(); ++idx)
+  {
+    MacroInfo const &info = m_macros[idx];
+    size_t const len = get_name_len(info);
+
+    m_sorted[idx] = static_cast<uint32>(idx);
+
+    for(size_t pos = 0; pos + 3 <= len; ++pos)
+    {
+      NameGram name_gram;
+
+      name_gram.gram = get_gram(info.macro + pos);
+      name_gram.macro_idx = static_cast<uint32>(idx);
+      m_grams.push_back(name_gram);
+    }
+  }
+
+  sort(m_sorted.begin(), m_sorted.end(), name_less);
+  for(size_t idx = 0; idx < m_sorted.size(); ++idx)
+  {
+    m_ranks[m_sorted[idx]] = static_cast<uint32>(idx);
+  }
 
-  choose2(false, -1, -1, -1, -1, macros,
-          2, macro_widths, get_nb_macros, get_macro, "Macros", -1, 1,
-          NULL, NULL, NULL, NULL, NULL, destroy_macros);
+  // a gram is kept once by name
+  sort(m_grams.begin(), m_grams.end());
+  m_grams.resize(static_cast<size_t>(unique(m_grams.begin(), m_grams.end(),
+                                            same_name_gram) - m_grams.begin()));
+}
+
+void MacroInfos::find(char const *pattern, qvector<uint32> &macro_idxs) const throw()
+{
+  size_t const len = strlen(pattern);
+  qvector<uint32> others;
+
+  find_prefixed(pattern, len, macro_idxs);
+
+  if(len < 3)
+  {
+    // too short for the grams
+    for(size_t idx = 0; idx < m_sorted.size(); ++idx)
+    {
+      MacroInfo const &info = m_macros[m_sorted[idx]];
+
+      if(name_contains(info, pattern, len) && strncmp(info.macro, pattern, len) != 0)
+      {
+        others.push_back(m_sorted[idx]);
+      }
+    }
+  }
+  else
+  {
+    // only check the names with the rarest gram of the pattern
+    NameGram const *first = NULL;
+    NameGram const *last = NULL;
+
+    for(size_t pos = 0; pos + 3 <= len; ++pos)
+    {
+      NameGram const key = { get_gram(pattern + pos), 0 };
+      NameGram const *gram_first = lower_bound(m_grams.begin(), m_grams.end(), key);
+      NameGram const *gram_last = gram_first;
+
+      while(gram_last != m_grams.end() && gram_last->gram == key.gram)
+      {
+        gram_last++;
+      }
+
+      if(first == NULL || gram_last - gram_first < last - first)
+      {
+        first = gram_first;
+        last = gram_last;
+      }
+    }
+
+    for(NameGram const *name_gram = first; name_gram != last; ++name_gram)
+    {
+      MacroInfo const &info = m_macros[name_gram->macro_idx];
+
+      if(name_contains(info, pattern, len) && strncmp(info.macro, pattern, len) != 0)
+      {
+        others.push_back(name_gram->macro_idx);
+      }
+    }
+
+    RankLess rank_less = { &m_ranks };
+
+    sort(others.begin(), others.end(), rank_less);
+  }
+
+  for(size_t idx = 0; idx < others.size(); ++idx)
+  {
+    macro_idxs.push_back(others[idx]);
+  }
+}
+
+// the names beginning with the pattern are contiguous in the sorted ones
+void MacroInfos::find_prefixed(char const *pattern, size_t const len,
+                               qvector<uint32> &macro_idxs) const throw()
+{
+  size_t low = 0;
+  size_t high = m_sorted.size();
+
+  // binary search for the first name not before the pattern
+  while(low < high)
+  {
+    size_t const middle = low + (high - low) / 2;
+
+    if(compare_name(m_macros[m_sorted[middle]], pattern, len) < 0)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  for(size_t idx = low; idx < m_sorted.size(); ++idx)
+  {
+    MacroInfo const &info = m_macros[m_sorted[idx]];
+
+    if(get_name_len(info) < len || strncmp(info.macro, pattern, len) != 0)
+    {
+      break;
+    }
+
+    macro_idxs.push_back(m_sorted[idx]);
+  }
+}
+
+// macros shown in a list
+struct MacroView
+{
+  MacroInfos *macros;
+  qvector<uint32> macro_idxs;
+};
+
+// macros of the last analysis (NULL if none)
+static MacroInfos *macro_infos = NULL;
+
+int const macro_widths[3] = { 24, 32, 6 };
+char const * const macro_headers[3] = { "Name", "Value", "CUs" };
+char const macro_title[] = "Macros";
+
+uint32 idaapi get_nb_macros(void *obj)
+{
+  MacroView *view = static_cast<MacroView *>(obj);
+
+  return view->macro_idxs.size();
+}
+
+static void idaapi get_macro(void *obj, uint32 n, char * const *cells)
+{
+  MacroView *view = static_cast<MacroView *>(obj);
+
+  if(n == 0)
+  {
+    qstrncpy(cells[0], macro_headers[0], macro_widths[0]);
+    qstrncpy(cells[1], macro_headers[1], macro_widths[1]);
+    qstrncpy(cells[2], macro_headers[2], macro_widths[2]);
+  }
+  else
+  {
+    MacroInfo const &info = (*view->macros)[view->macro_idxs[n - 1]];
+
+    qstrncpy(cells[0], info.macro, info.name_len);
+    qstrncpy(cells[1], info.macro + info.name_len, MAXSTR);
+    qsnprintf(cells[2], MAXSTR, "%u", info.nb_cus);
+  }
+}
+
+static void idaapi destroy_macros(void *obj)
+{
+  MacroView *view = static_cast<MacroView *>(obj);
+
+  view->macros->release();
+  delete view;
+}
+
+// show all the macros, or the ones with a name containing the pattern
+static void show_macro_view(char const *pattern)
+{
+  if(macro_infos == NULL)
+  {
+    MSG("no macros, run the plugin first\n");
+  }
+  else
+  {
+    MacroView *view = new MacroView;
+    char title[MAXSTR];
+
+    macro_infos->load();
+    view->macros = macro_infos;
+    macro_infos->add_ref();
+
+    if(pattern == NULL)
+    {
+      view->macro_idxs = macro_infos->get_sorted();
+      qstrncpy(title, macro_title, sizeof(title));
+    }
+    else
+    {
+      macro_infos->find(pattern, view->macro_idxs);
+      qsnprintf(title, sizeof(title), "%s matching '%s'", macro_title, pattern);
+    }
+
+    if(view->macro_idxs.empty())
+    {
+      MSG("no macro found\n");
+      destroy_macros(view);
+    }
+    else
+    {
+      choose2(false, -1, -1, -1, -1, view,
+              3, macro_widths, get_nb_macros, get_macro, title, -1, 1,
+              NULL, NULL, NULL, NULL, NULL, destroy_macros);
+    }
+  }
+}
+
+static bool idaapi show_macros(GCC_UNUSED void *ud)
+{
+  show_macro_view(NULL);
+
+  return true;
+}
+
+static bool idaapi find_macros(GCC_UNUSED void *ud)
+{
+  static char last_pattern[MAXSTR] = "";
+  char const *pattern = askstr(HIST_IDENT, last_pattern, "Find macro (name prefix or substring)");
+
+  if(pattern != NULL && pattern[0] != '\0')
+  {
+    qstrncpy(last_pattern, pattern, sizeof(last_pattern));
+    show_macro_view(last_pattern);
+  }
+
+  return true;
+}
+
+void retrieve_macros(CUsHolder const &cus_holder)
+{
+  static bool menus_added = false;
+  qvector<MacinfoCU> macinfo_cus;
+
+  // only the CUs entries are read now,
+  // the macros are decoded when they are shown
+  get_macinfo_cus(cus_holder, macinfo_cus);
+
+  if(macro_infos != NULL)
+  {
+    macro_infos->release();
+  }
+
+  macro_infos = new MacroInfos(cus_holder.get_path(), macinfo_cus);
+
+  if(!menus_added)
+  {
+    if(!add_menu_item(SHOW_MACROS_MENU, SHOW_MACROS_NAME, NULL, SETMENU_APP,
+                      show_macros, NULL) ||
+       !add_menu_item(FIND_MACROS_MENU, FIND_MACROS_NAME, NULL, SETMENU_APP,
+                      find_macros, NULL))
+    {
+      MSG("cannot add the macro menu entries\n");
+    }
+
+    menus_added = true;
+  }
+
+  MSG("the macros of %u compilation units can be shown "
+      "with View/Open subviews/" SHOW_MACROS_NAME "\n",
+      static_cast<uint32>(macinfo_cus.size()));
+}
+
+void remove_macros(void) throw()
+{
+  del_menu_item("View/Open subviews/" SHOW_MACROS_NAME);
+  del_menu_item("Search/" FIND_MACROS_NAME);
+
+  if(macro_infos != NULL)
+  {
+    macro_infos->release();
+    macro_infos = NULL;
+  }
 }
@@ -5,6 +5,14 @@
 #include <dwarf.h>
 #include <libdwarf.h>
 
-void retrieve_macros(Dwarf_Debug dbg);
+// local headers
+#include "die_utils.hpp"
+
+// the macros are only decoded when they are shown
+// (View/Open subviews and Search menu entries)
+void retrieve_macros(CUsHolder const &cus_holder);
+
+// when the plugin is unloaded
+void remove_macros(void) throw();
 
 #endif // IDADWARF_MACRO_RETRIEVAL_HPP
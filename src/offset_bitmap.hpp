@@ -0,0 +1,116 @@
+#ifndef IDADWARF_OFFSET_BITMAP_HPP
+#define IDADWARF_OFFSET_BITMAP_HPP
+
+// IDA headers
+#include <pro.h>
+
+// dense set of .debug_info offsets, one bit per offset
+// grows up to the biggest set offset
+class OffsetBitmap
+{
+public:
+  static uint64 const NO_OFFSET = ~static_cast<uint64>(0);
+
+  OffsetBitmap(void) throw()
+    : m_size(0)
+  {
+
+  }
+
+  virtual ~OffsetBitmap(void) throw()
+  {
+
+  }
+
+  size_t size(void) const throw()
+  {
+    return m_size;
+  }
+
+  void clear(void) throw()
+  {
+    m_words.clear();
+    m_size = 0;
+  }
+
+  bool test(uint64 const offset) const throw()
+  {
+    size_t const word_idx = static_cast<size_t>(offset / WORD_BITS);
+
+    return (word_idx < m_words.size() &&
+            (m_words[word_idx] & get_mask(offset)) != 0);
+  }
+
+  void set(uint64 const offset) throw()
+  {
+    size_t const word_idx = static_cast<size_t>(offset / WORD_BITS);
+
+    if(word_idx >= m_words.size())
+    {
+      // double the capacity, not to resize for each new CU
+      m_words.reserve(qmax(word_idx + 1, m_words.size() * 2));
+      m_words.resize(word_idx + 1, 0);
+    }
+
+    if((m_words[word_idx] & get_mask(offset)) == 0)
+    {
+      m_words[word_idx] |= get_mask(offset);
+      m_size++;
+    }
+  }
+
+  void reset(uint64 const offset) throw()
+  {
+    if(test(offset))
+    {
+      m_words[static_cast<size_t>(offset / WORD_BITS)] &= ~get_mask(offset);
+      m_size--;
+    }
+  }
+
+  // first set offset not below the given one (NO_OFFSET if none)
+  uint64 find_next(uint64 const offset) const throw()
+  {
+    size_t word_idx = static_cast<size_t>(offset / WORD_BITS);
+    uint64 found = NO_OFFSET;
+
+    if(word_idx < m_words.size())
+    {
+      // ignore the bits before the offset in the first word
+      uint32 word = m_words[word_idx] & ~(get_mask(offset) - 1);
+
+      while(word == 0 && ++word_idx < m_words.size())
+      {
+        word = m_words[word_idx];
+      }
+
+      if(word != 0)
+      {
+        uint64 bit = 0;
+
+        while((word & 1) == 0)
+        {
+          word >>= 1;
+          bit++;
+        }
+
+        found = static_cast<uint64>(word_idx) * WORD_BITS + bit;
+      }
+    }
+
+    return found;
+  }
+
+private:
+  static uint64 const WORD_BITS = 32;
+
+  qvector<uint32> m_words;
+  size_t m_size;
+
+  static uint32 get_mask(uint64 const offset) throw()
+  {
+    return static_cast<uint32>(1) << (offset % WORD_BITS);
+  }
+};
+
+#endif // IDADWARF_OFFSET_BITMAP_HPP
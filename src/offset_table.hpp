@@ -0,0 +1,178 @@
+#ifndef IDADWARF_OFFSET_TABLE_HPP
+#define IDADWARF_OFFSET_TABLE_HPP
+
+// IDA headers
+#include <pro.h>
+
+// open-addressed hash table keyed by 64-bit values
+// (.debug_info offsets, or any other key that fits in 64 bits)
+// linear probing, power of two capacity, no deletion
+// the all ones key is reserved to mark the empty slots
+template<typename T>
+class OffsetTable
+{
+public:
+  static uint64 const EMPTY_KEY = ~static_cast<uint64>(0);
+
+  OffsetTable(void) throw()
+    : m_size(0)
+  {
+
+  }
+
+  virtual ~OffsetTable(void) throw()
+  {
+
+  }
+
+  size_t size(void) const throw()
+  {
+    return m_size;
+  }
+
+  bool empty(void) const throw()
+  {
+    return (m_size == 0);
+  }
+
+  void clear(void) throw()
+  {
+    m_slots.clear();
+    m_size = 0;
+  }
+
+  // returns NULL if the key is not in the table
+  T *find(uint64 const key) throw()
+  {
+    T *value = NULL;
+
+    if(!m_slots.empty())
+    {
+      Slot &slot = m_slots[lookup(key)];
+
+      if(slot.key == key)
+      {
+        value = &slot.value;
+      }
+    }
+
+    return value;
+  }
+
+  T const *find(uint64 const key) const throw()
+  {
+    return const_cast<OffsetTable *>(this)->find(key);
+  }
+
+  // returns the value for the key,
+  // default constructed if the key was not in the table
+  T &get(uint64 const key, bool *added=NULL) throw()
+  {
+    // keep the load factor under 1/2
+    if((m_size + 1) * 2 > m_slots.size())
+    {
+      grow();
+    }
+
+    Slot &slot = m_slots[lookup(key)];
+    bool const is_new = (slot.key != key);
+
+    if(is_new)
+    {
+      slot.key = key;
+      slot.value = T();
+      m_size++;
+    }
+
+    if(added != NULL)
+    {
+      *added = is_new;
+    }
+
+    return slot.value;
+  }
+
+  void set(uint64 const key, T const &value) throw()
+  {
+    get(key) = value;
+  }
+
+  // call fun(key, value, arg) for each table entry (unordered)
+  template<typename F, typename A>
+  void for_each(F fun, A arg) const
+  {
+    for(size_t idx = 0; idx < m_slots.size(); ++idx)
+    {
+      Slot const &slot = m_slots[idx];
+
+      if(slot.key != EMPTY_KEY)
+      {
+        fun(slot.key, slot.value, arg);
+      }
+    }
+  }
+
+private:
+  struct Slot
+  {
+    Slot(void) throw()
+      : key(EMPTY_KEY), value()
+    {
+
+    }
+
+    uint64 key;
+    T value;
+  };
+
+  qvector<Slot> m_slots;
+  size_t m_size;
+
+  // 64-bit finalizer (from MurmurHash3)
+  static size_t hash(uint64 key) throw()
+  {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return static_cast<size_t>(key);
+  }
+
+  // index of the slot with the given key, or of the empty slot
+  // where the key would be inserted
+  size_t lookup(uint64 const key) const throw()
+  {
+    size_t const mask = m_slots.size() - 1;
+    size_t idx = hash(key) & mask;
+
+    while(m_slots[idx].key != key && m_slots[idx].key != EMPTY_KEY)
+    {
+      idx = (idx + 1) & mask;
+    }
+
+    return idx;
+  }
+
+  void grow(void) throw()
+  {
+    qvector<Slot> old_slots;
+    size_t const capacity = m_slots.empty() ? 64 : m_slots.size() * 2;
+
+    old_slots.swap(m_slots);
+    m_slots.resize(capacity);
+
+    for(size_t idx = 0; idx < old_slots.size(); ++idx)
+    {
+      Slot const &old_slot = old_slots[idx];
+
+      if(old_slot.key != EMPTY_KEY)
+      {
+        m_slots[lookup(old_slot.key)] = old_slot;
+      }
+    }
+  }
+};
+
+#endif // IDADWARF_OFFSET_TABLE_HPP
@@ -0,0 +1,141 @@
+#include "profiling.hpp"
+
+// standard headers
+#include <cstdlib>
+
+#ifdef __NT__
+# include <windows.h>
+#else
+# include <sys/time.h>
+#endif
+
+// local headers
+#include "ida_utils.hpp"
+
+Profiler profiler;
+
+static char const *timer_names[NB_TIMERS] =
+{
+  "cus", "addr_index", "types", "second_pass", "ptr_types", "functions",
+  "callee_types", "globals", "macros"
+};
+
+static char const *counter_names[NB_COUNTERS] =
+{
+  "dies_visited", "cache_hits", "cache_misses", "dwarf_calls", "offdie",
+  "type_writes", "staged_writes", "exceptions", "decoded_types"
+};
+
+// monotonic (if possible) wall-clock time, in microseconds
+static uint64 get_time(void) throw()
+{
+  uint64 now = 0;
+
+#ifdef __NT__
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+
+  if(QueryPerformanceCounter(&counter) && QueryPerformanceFrequency(&frequency) &&
+     frequency.QuadPart != 0)
+  {
+    uint64 const ticks = static_cast<uint64>(counter.QuadPart);
+    uint64 const ticks_per_sec = static_cast<uint64>(frequency.QuadPart);
+
+    // the whole seconds apart, ticks * 1000000 would overflow after some uptime
+    now = (ticks / ticks_per_sec) * 1000000 + (ticks % ticks_per_sec) * 1000000 / ticks_per_sec;
+  }
+  else
+  {
+    now = static_cast<uint64>(GetTickCount()) * 1000;
+  }
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  now = static_cast<uint64>(tv.tv_sec) * 1000000 + static_cast<uint64>(tv.tv_usec);
+#endif
+
+  // 0 means the timer is not running
+  return (now != 0) ? now : 1;
+}
+
+void Profiler::reset(void) throw()
+{
+  memset(m_timers, 0, sizeof(m_timers));
+  memset(m_counts, 0, sizeof(m_counts));
+}
+
+void Profiler::start(profile_timer const timer) throw()
+{
+  m_timers[timer].start = get_time();
+}
+
+void Profiler::stop(profile_timer const timer) throw()
+{
+  Timer &stopped = m_timers[timer];
+
+  if(stopped.start != 0)
+  {
+    stopped.elapsed += get_time() - stopped.start;
+    stopped.start = 0;
+  }
+}
+
+void Profiler::report(void) const throw()
+{
+  char const *json_path = getenv("IDADWARF_PROFILE_JSON");
+  uint64 total = 0;
+
+  for(size_t idx = 0; idx < NB_TIMERS; ++idx)
+  {
+    uint64 const elapsed = m_timers[idx].elapsed;
+
+    total += elapsed;
+    MSG("time of %s: %u.%03u ms\n", timer_names[idx],
+        static_cast<uint32>(elapsed / 1000), static_cast<uint32>(elapsed % 1000));
+  }
+
+  MSG("total time: %u.%03u ms\n", static_cast<uint32>(total / 1000),
+      static_cast<uint32>(total % 1000));
+
+  for(size_t idx = 0; idx < NB_COUNTERS; ++idx)
+  {
+    MSG("%s: %" FMT_64 "u\n", counter_names[idx], m_counts[idx]);
+  }
+
+  if(json_path != NULL && json_path[0] != '\0' && !write_json(json_path))
+  {
+    MSG("cannot write the profile to '%s'\n", json_path);
+  }
+}
+
+// one object, the timers (in microseconds) then the counters
+bool Profiler::write_json(char const *path) const throw()
+{
+  FILE *file = qfopen(path, "w");
+  bool const ok = (file != NULL);
+
+  if(ok)
+  {
+    qfprintf(file, "{\n  \"timers_us\": {");
+
+    for(size_t idx = 0; idx < NB_TIMERS; ++idx)
+    {
+      qfprintf(file, "%s\n    \"%s\": %" FMT_64 "u", (idx == 0) ? "" : ",",
+               timer_names[idx], m_timers[idx].elapsed);
+    }
+
+    qfprintf(file, "\n  },\n  \"counters\": {");
+
+    for(size_t idx = 0; idx < NB_COUNTERS; ++idx)
+    {
+      qfprintf(file, "%s\n    \"%s\": %" FMT_64 "u", (idx == 0) ? "" : ",",
+               counter_names[idx], m_counts[idx]);
+    }
+
+    qfprintf(file, "\n  }\n}\n");
+    qfclose(file);
+  }
+
+  return ok;
+}
@@ -0,0 +1,114 @@
+#ifndef IDADWARF_PROFILING_HPP
+#define IDADWARF_PROFILING_HPP
+
+// IDA headers
+#include <pro.h>
+
+// wall-clock timers of the plugin run steps
+// (they do not overlap: a phase timer does not include its finishers)
+enum profile_timer
+{
+  TIMER_CUS, // compilation units enumeration
+  TIMER_ADDR_INDEX, // address ranges of the CUs (lazy mode)
+  TIMER_TYPES, // first pass of the types (during the DIEs walk)
+  TIMER_SECOND_PASS,
+  TIMER_PTR_TYPES,
+  TIMER_FUNCS,
+  TIMER_CALLEE_TYPES,
+  TIMER_GLOBALS,
+  TIMER_MACROS,
+  NB_TIMERS
+};
+
+// work counters of the plugin run
+enum profile_counter
+{
+  COUNTER_DIES_VISITED,
+  COUNTER_CACHE_HITS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_DWARF_CALLS, // checked libdwarf calls
+  COUNTER_OFFDIE, // DIEs got again from their offset
+  COUNTER_TYPE_WRITES, // numbered types set, deleted or aliased in the IDA database
+  COUNTER_STAGED_WRITES, // the ones of the type stage flush (see TypeStage)
+  COUNTER_EXCEPTIONS, // DIE exceptions thrown
+  COUNTER_DECODED_TYPES, // type nodes imported from the decoding threads
+  NB_COUNTERS
+};
+
+// time spent and work done by a plugin run
+// the summary is shown in the output window (with the profile plugin flag),
+// and written to the JSON file given by IDADWARF_PROFILE_JSON (if set)
+class Profiler
+{
+public:
+  Profiler(void) throw()
+  {
+    reset();
+  }
+
+  virtual ~Profiler(void) throw()
+  {
+
+  }
+
+  void reset(void) throw();
+
+  void start(profile_timer const timer) throw();
+
+  void stop(profile_timer const timer) throw();
+
+  void count(profile_counter const counter, uint64 const nb=1) throw()
+  {
+    m_counts[counter] += nb;
+  }
+
+  uint64 get_count(profile_counter const counter) const throw()
+  {
+    return m_counts[counter];
+  }
+
+  void report(void) const throw();
+
+private:
+  struct Timer
+  {
+    uint64 start; // 0 if not running
+    uint64 elapsed; // in microseconds
+  };
+
+  Timer m_timers[NB_TIMERS];
+  uint64 m_counts[NB_COUNTERS];
+
+  // no copying or assignment
+  Profiler(Profiler const &);
+  Profiler &operator=(Profiler const &);
+
+  bool write_json(char const *path) const throw();
+};
+
+extern Profiler profiler;
+
+// times its scope
+class ProfileScope
+{
+public:
+  ProfileScope(profile_timer const timer) throw()
+    : m_timer(timer)
+  {
+    profiler.start(m_timer);
+  }
+
+  virtual ~ProfileScope(void) throw()
+  {
+    profiler.stop(m_timer);
+  }
+
+private:
+  profile_timer m_timer;
+
+  // no copying or assignment
+  ProfileScope(ProfileScope const &);
+  ProfileScope &operator=(ProfileScope const &);
+};
+
+#endif // IDADWARF_PROFILING_HPP
@@ -0,0 +1,412 @@
+#include "separate_debug.hpp"
+
+// standard headers
+#include <cstdlib>
+
+// local headers
+#include "ida_utils.hpp"
+
+#ifdef __NT__
+# define PATH_LIST_SEP ';'
+#else
+# define PATH_LIST_SEP ':'
+# define DEFAULT_DEBUG_DIR "/usr/lib/debug"
+#endif
+
+#define NT_GNU_BUILD_ID 3
+// the debug sections are read by steps of that size
+// to bring their pages in memory
+#define PREFETCH_STEP 4096
+#define CRC_BUF_SIZE 65536
+
+static bool is_path_sep(char const c) throw()
+{
+  return (c == '/' || c == '\\');
+}
+
+static string strip_path_sep(string path) throw()
+{
+  while(path.size() > 1 && is_path_sep(path[path.size() - 1]))
+  {
+    path.erase(path.size() - 1);
+  }
+
+  return path;
+}
+
+static string get_dir(string const &path) throw()
+{
+  size_t pos = path.size();
+
+  while(pos != 0 && !is_path_sep(path[pos - 1]))
+  {
+    pos--;
+  }
+
+  return (pos == 0) ? string(".") : strip_path_sep(path.substr(0, pos));
+}
+
+static string to_hex(string const &bytes) throw()
+{
+  static char const digits[] = "0123456789abcdef";
+  string hex;
+
+  for(size_t idx = 0; idx < bytes.size(); ++idx)
+  {
+    uchar const byte = static_cast<uchar>(bytes[idx]);
+
+    hex += digits[byte >> 4];
+    hex += digits[byte & 0xF];
+  }
+
+  return hex;
+}
+
+// raw bytes of the GNU build id note (empty if none)
+static string get_build_id(DwarfFile &file) throw()
+{
+  string build_id;
+  uint64 size = 0;
+  uchar const *note = file.get_section_data(".note.gnu.build-id", &size);
+
+  if(note != NULL && size >= 16)
+  {
+    uint64 const name_size = file.read_value(note, 4);
+    uint64 const desc_size = file.read_value(note + 4, 4);
+    uint64 const type = file.read_value(note + 8, 4);
+    uint64 const desc_pos = 12 + ((name_size + 3) & ~static_cast<uint64>(3));
+
+    if(type == NT_GNU_BUILD_ID && name_size == 4 && memcmp(note + 12, "GNU", 4) == 0 &&
+       desc_pos <= size && desc_size <= size - desc_pos)
+    {
+      build_id.assign(reinterpret_cast<char const *>(note + desc_pos),
+                      static_cast<size_t>(desc_size));
+    }
+  }
+
+  return build_id;
+}
+
+// file name and CRC from the debug link section (empty if none)
+static string get_debug_link(DwarfFile &file, uint32 *crc) throw()
+{
+  string link;
+  uint64 size = 0;
+  uchar const *data = file.get_section_data(".gnu_debuglink", &size);
+  uchar const *end = (data == NULL) ? NULL :
+    static_cast<uchar const *>(memchr(data, '\0', static_cast<size_t>(size)));
+
+  if(end != NULL && end != data)
+  {
+    // the CRC is 4-byte aligned after the name
+    uint64 const crc_pos = (static_cast<uint64>(end - data) + 4) & ~static_cast<uint64>(3);
+
+    if(crc_pos + 4 <= size)
+    {
+      link.assign(reinterpret_cast<char const *>(data), end - data);
+      *crc = static_cast<uint32>(file.read_value(data + crc_pos, 4));
+    }
+  }
+
+  return link;
+}
+
+// CRC-32 (IEEE) of the whole file, as computed by objcopy
+static bool get_file_crc(char const *path, uint32 *crc) throw()
+{
+  int const fd = open(path, O_RDONLY | O_BINARY, 0);
+  bool ok = (fd >= 0);
+
+  if(ok)
+  {
+    vector<uchar> buf(CRC_BUF_SIZE);
+    uint32 table[256];
+    uint32 value = 0xFFFFFFFF;
+    int nb_read = 0;
+
+    for(uint32 idx = 0; idx < 256; ++idx)
+    {
+      uint32 entry = idx;
+
+      for(int bit = 0; bit < 8; ++bit)
+      {
+        entry = (entry & 1) ? (0xEDB88320 ^ (entry >> 1)) : (entry >> 1);
+      }
+
+      table[idx] = entry;
+    }
+
+    while((nb_read = read(fd, &buf[0], CRC_BUF_SIZE)) > 0)
+    {
+      for(int idx = 0; idx < nb_read; ++idx)
+      {
+        value = table[(value ^ buf[idx]) & 0xFF] ^ (value >> 8);
+      }
+    }
+
+    ok = (nb_read == 0);
+    *crc = ~value;
+    close(fd);
+  }
+
+  return ok;
+}
+
+// read the debug sections once, the first libdwarf calls
+// will not wait for the disk
+static void prefetch_sections(DwarfFile &file) throw()
+{
+  static char const *names[] = { ".debug_info", ".debug_abbrev", ".debug_str",
+                                 ".debug_loc" };
+  volatile uchar sink = 0;
+
+  for(size_t idx = 0; idx < qnumber(names); ++idx)
+  {
+    uint64 size = 0;
+    uchar const *data = file.get_section_data(names[idx], &size);
+
+    for(uint64 pos = 0; data != NULL && pos < size; pos += PREFETCH_STEP)
+    {
+      sink ^= data[pos];
+    }
+  }
+}
+
+void SeparateDebugFinder::start(char const *elf_path) throw()
+{
+  clear();
+  read_config(elf_path);
+  m_searched = false;
+
+  // if the thread cannot be started, take_file will search
+  m_thread.start(1, run_search, this);
+}
+
+void SeparateDebugFinder::wait(void) throw()
+{
+  m_thread.join();
+  log_errors();
+}
+
+DwarfFile *SeparateDebugFinder::take_file(char const *elf_path) throw()
+{
+  DwarfFile *file = NULL;
+
+  wait();
+
+  if(!m_searched)
+  {
+    read_config(elf_path);
+    search(false);
+    log_errors();
+  }
+
+  file = m_file, m_file = NULL;
+  m_searched = false;
+
+  if(file != NULL)
+  {
+    MSG("using the separate debug file '%s'\n", file->get_path());
+  }
+  else
+  {
+    MSG("no separate debug file found (%u paths tried)\n",
+        static_cast<uint32>(m_nb_tried));
+  }
+
+  return file;
+}
+
+void SeparateDebugFinder::clear(void) throw()
+{
+  m_thread.join();
+  delete m_file, m_file = NULL;
+  m_nb_tried = 0;
+  m_searched = false;
+  m_errors.clear();
+}
+
+void SeparateDebugFinder::read_config(char const *elf_path) throw()
+{
+  char const *dirs = getenv("IDADWARF_DEBUG_DIRS");
+  char const *cache = getenv("DEBUGINFOD_CACHE_PATH");
+
+  m_elf_path = elf_path;
+  m_debug_dirs.clear();
+  m_debuginfod_cache.clear();
+
+  if(dirs != NULL)
+  {
+    string const dir_list(dirs);
+    size_t pos = 0;
+
+    while(pos <= dir_list.size())
+    {
+      size_t end = dir_list.find(PATH_LIST_SEP, pos);
+
+      if(end == string::npos)
+      {
+        end = dir_list.size();
+      }
+
+      if(end != pos)
+      {
+        m_debug_dirs.push_back(strip_path_sep(dir_list.substr(pos, end - pos)));
+      }
+
+      pos = end + 1;
+    }
+  }
+#ifdef DEFAULT_DEBUG_DIR
+  else
+  {
+    m_debug_dirs.push_back(DEFAULT_DEBUG_DIR);
+  }
+#endif
+
+  if(cache != NULL)
+  {
+    m_debuginfod_cache = strip_path_sep(cache);
+  }
+  else
+  {
+    // default debuginfod client cache
+    char const *xdg_cache = getenv("XDG_CACHE_HOME");
+    char const *home = getenv("HOME");
+
+    if(xdg_cache != NULL)
+    {
+      m_debuginfod_cache = strip_path_sep(xdg_cache) + "/debuginfod_client";
+    }
+    else if(home != NULL)
+    {
+      m_debuginfod_cache = strip_path_sep(home) + "/.cache/debuginfod_client";
+    }
+  }
+}
+
+void SeparateDebugFinder::run_search(void *arg) throw()
+{
+  static_cast<SeparateDebugFinder *>(arg)->search(true);
+}
+
+void SeparateDebugFinder::log_errors(void) throw()
+{
+  for(size_t idx = 0; idx < m_errors.size(); ++idx)
+  {
+    MSG("libdwarf cleanup failed: %s\n", m_errors[idx].c_str());
+  }
+
+  m_errors.clear();
+}
+
+// warning: runs in the worker thread, the error is only kept
+void SeparateDebugFinder::close_file(DwarfFile &file) throw()
+{
+  string error;
+
+  if(!file.close(&error))
+  {
+    m_errors.push_back(error);
+  }
+}
+
+// warning: runs in the worker thread, no IDA kernel call!
+void SeparateDebugFinder::search(bool const ahead) throw()
+{
+  DwarfFile elf_file;
+  bool skipped = false;
+
+  delete m_file, m_file = NULL;
+  m_nb_tried = 0;
+
+  if(elf_file.open_sections(m_elf_path.c_str()))
+  {
+    string const build_id = get_build_id(elf_file);
+    uint32 crc = 0;
+    string const link = get_debug_link(elf_file, &crc);
+    string const elf_dir = get_dir(m_elf_path);
+
+    // the input file has DWARF infos, the debug file will not be needed
+    // (unless the run cannot read them: take_file searches then)
+    skipped = (ahead && elf_file.has_section(".debug_info"));
+    close_file(elf_file);
+
+    if(!skipped && build_id.size() >= 2)
+    {
+      string const hex = to_hex(build_id);
+      string const build_id_path = "/.build-id/" + hex.substr(0, 2) + "/" +
+        hex.substr(2) + ".debug";
+
+      for(size_t idx = 0; m_file == NULL && idx < m_debug_dirs.size(); ++idx)
+      {
+        try_candidate(m_debug_dirs[idx] + build_id_path, build_id, false, 0);
+      }
+
+      if(m_file == NULL && !m_debuginfod_cache.empty())
+      {
+        try_candidate(m_debuginfod_cache + "/" + hex + "/debuginfo", build_id, false, 0);
+      }
+    }
+
+    if(!skipped && m_file == NULL && !link.empty())
+    {
+      vector<string> paths;
+
+      paths.push_back(elf_dir + "/" + link);
+      paths.push_back(elf_dir + "/.debug/" + link);
+
+      // only for an absolute (unix) file directory
+      for(size_t idx = 0; is_path_sep(elf_dir[0]) && idx < m_debug_dirs.size(); ++idx)
+      {
+        paths.push_back(m_debug_dirs[idx] + elf_dir + "/" + link);
+      }
+
+      for(size_t idx = 0; m_file == NULL && idx < paths.size(); ++idx)
+      {
+        // the link can be the name of the file itself
+        if(paths[idx] != m_elf_path)
+        {
+          try_candidate(paths[idx], build_id, true, crc);
+        }
+      }
+    }
+  }
+
+  m_searched = !skipped;
+}
+
+bool SeparateDebugFinder::try_candidate(string const &path, string const &build_id,
+                                        bool const check_crc, uint32 const crc) throw()
+{
+  uint32 file_crc = 0;
+  bool found = false;
+
+  m_nb_tried++;
+
+  if(!check_crc || (get_file_crc(path.c_str(), &file_crc) && file_crc == crc))
+  {
+    DwarfFile *file = new DwarfFile();
+    Dwarf_Error err = NULL;
+
+    if(file->open(path.c_str(), &err) == DW_DLV_OK)
+    {
+      string const file_build_id = get_build_id(*file);
+
+      found = (build_id.empty() || file_build_id.empty() || file_build_id == build_id);
+    }
+
+    if(found)
+    {
+      prefetch_sections(*file);
+      m_file = file;
+    }
+    else
+    {
+      close_file(*file);
+      delete file, file = NULL;
+    }
+  }
+
+  return found;
+}
@@ -0,0 +1,91 @@
+#ifndef IDADWARF_SEPARATE_DEBUG_HPP
+#define IDADWARF_SEPARATE_DEBUG_HPP
+
+// standard headers
+#include <string>
+#include <vector>
+
+// IDA headers
+#include <pro.h>
+
+// local headers
+#include "dwarf_file.hpp"
+#include "threads.hpp"
+
+using namespace std;
+
+// looks for the separate debug file of an ELF file, like gdb does:
+// - by build id (.note.gnu.build-id):
+//   <debug dir>/.build-id/xx/yyyy.debug for each debug directory,
+//   then <debuginfod cache>/xxyyyy/debuginfo
+// - by debug link (.gnu_debuglink, the file CRC must match):
+//   <file dir>/<link>, <file dir>/.debug/<link>, <debug dir>/<file dir>/<link>
+// the debug directories are in IDADWARF_DEBUG_DIRS (separated by ';' on
+// windows, ':' elsewhere), the debuginfod client cache in DEBUGINFOD_CACHE_PATH.
+// the search (and the first read of the debug sections) is done
+// by a worker thread, started when the plugin is loaded
+// (it stops at once if the input file has a .debug_info section):
+// the autoanalysis is still running, the plugin run gets the file opened.
+// the worker does not log anything, its errors are logged by wait.
+class SeparateDebugFinder
+{
+public:
+  SeparateDebugFinder(void) throw()
+    : m_file(NULL), m_nb_tried(0), m_searched(false)
+  {
+
+  }
+
+  virtual ~SeparateDebugFinder(void) throw()
+  {
+    clear();
+  }
+
+  // start looking for the debug file in a worker thread
+  void start(char const *elf_path) throw();
+
+  // wait for the worker thread
+  // (libdwarf/libelf initialization must not be done concurrently)
+  void wait(void) throw();
+
+  // wait for the search (or search now if it has not been done)
+  // returns NULL if no debug file was found, the caller owns the file
+  DwarfFile *take_file(char const *elf_path) throw();
+
+  void clear(void) throw();
+
+private:
+  // set by the main thread before the search
+  string m_elf_path;
+  vector<string> m_debug_dirs;
+  string m_debuginfod_cache;
+  WorkerThreads m_thread;
+  // search results
+  DwarfFile *m_file;
+  size_t m_nb_tried;
+  bool m_searched;
+  // libdwarf cleanup errors of the search, logged by the main thread
+  vector<string> m_errors;
+
+  // no copying or assignment
+  SeparateDebugFinder(SeparateDebugFinder const &);
+  SeparateDebugFinder &operator=(SeparateDebugFinder const &);
+
+  void read_config(char const *elf_path) throw();
+
+  static void run_search(void *arg) throw();
+
+  void log_errors(void) throw();
+
+  void close_file(DwarfFile &file) throw();
+
+  // ahead: search skipped if the input file has a .debug_info section
+  void search(bool const ahead) throw();
+
+  // a build id candidate must have the same build id (if it has one),
+  // a debug link one the same CRC
+  bool try_candidate(string const &path, string const &build_id,
+                     bool const check_crc, uint32 const crc) throw();
+};
+
+#endif // IDADWARF_SEPARATE_DEBUG_HPP
@@ -0,0 +1,121 @@
+#include "string_pool.hpp"
+
+// strings are copied in chunks of that size
+// (bigger strings get their own chunk)
+#define CHUNK_SIZE 65536
+
+void StringPool::clear(void) throw()
+{
+  for(size_t idx = 0; idx < m_chunks.size(); ++idx)
+  {
+    qfree(m_chunks[idx]), m_chunks[idx] = NULL;
+  }
+
+  m_chunks.clear();
+  m_strings.clear();
+  m_next_ids.clear();
+  m_ids.clear();
+  m_chunk_pos = NULL;
+  m_chunk_left = 0;
+}
+
+uint32 StringPool::intern(char const *str, size_t const len) throw()
+{
+  uint32 id = NO_STRING;
+
+  if(str != NULL)
+  {
+    bool added = false;
+    uint64 const key = hash(str, len);
+    // the all ones key is reserved by the offset table
+    uint32 &first_id = m_ids.get((key == OffsetTable<uint32>::EMPTY_KEY) ? 0 : key,
+                                 &added);
+
+    if(!added)
+    {
+      // look for the same string in the ones with the same hash
+      for(id = first_id; id != NO_STRING; id = m_next_ids[id])
+      {
+        char const *other_str = m_strings[id];
+
+        if(strncmp(other_str, str, len) == 0 && other_str[len] == '\0')
+        {
+          break;
+        }
+      }
+    }
+
+    if(id == NO_STRING)
+    {
+      char *new_str = alloc(len + 1);
+
+      if(new_str != NULL)
+      {
+        memcpy(new_str, str, len);
+        new_str[len] = '\0';
+
+        id = static_cast<uint32>(m_strings.size());
+        m_strings.push_back(new_str);
+        m_next_ids.push_back(added ? NO_STRING : first_id);
+        first_id = id;
+      }
+      else if(added)
+      {
+        first_id = NO_STRING;
+      }
+    }
+  }
+
+  return id;
+}
+
+uint64 StringPool::hash(char const *str, size_t const len) throw()
+{
+  uint64 value = 0xcbf29ce484222325ULL;
+
+  for(size_t idx = 0; idx < len; ++idx)
+  {
+    value ^= static_cast<uchar>(str[idx]);
+    value *= 0x100000001b3ULL;
+  }
+
+  return value;
+}
+
+char *StringPool::alloc(size_t const size) throw()
+{
+  char *buf = NULL;
+
+  if(size > CHUNK_SIZE / 4)
+  {
+    // big string, do not waste the current chunk
+    buf = static_cast<char *>(qalloc(size));
+    if(buf != NULL)
+    {
+      m_chunks.push_back(buf);
+    }
+  }
+  else
+  {
+    if(size > m_chunk_left)
+    {
+      char *chunk = static_cast<char *>(qalloc(CHUNK_SIZE));
+
+      if(chunk != NULL)
+      {
+        m_chunks.push_back(chunk);
+        m_chunk_pos = chunk;
+        m_chunk_left = CHUNK_SIZE;
+      }
+    }
+
+    if(size <= m_chunk_left)
+    {
+      buf = m_chunk_pos;
+      m_chunk_pos += size;
+      m_chunk_left -= size;
+    }
+  }
+
+  return buf;
+}
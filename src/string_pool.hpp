@@ -0,0 +1,78 @@
+#ifndef IDADWARF_STRING_POOL_HPP
+#define IDADWARF_STRING_POOL_HPP
+
+// IDA headers
+#include <pro.h>
+
+// local headers
+#include "offset_table.hpp"
+
+// interned strings, allocated by big chunks
+// each different string is stored once and gets a (stable) 32-bit id,
+// the returned pointers stay valid until the pool is cleared
+class StringPool
+{
+public:
+  static uint32 const NO_STRING = 0xFFFFFFFF;
+
+  StringPool(void) throw()
+    : m_chunk_pos(NULL), m_chunk_left(0)
+  {
+
+  }
+
+  virtual ~StringPool(void) throw()
+  {
+    clear();
+  }
+
+  void clear(void) throw();
+
+  size_t size(void) const throw()
+  {
+    return m_strings.size();
+  }
+
+  // returns the id of the string
+  // (NO_STRING for the NULL string, or if there is no memory left)
+  uint32 intern(char const *str, size_t const len) throw();
+
+  uint32 intern(char const *str) throw()
+  {
+    return (str == NULL) ? NO_STRING : intern(str, strlen(str));
+  }
+
+  // 64-bit FNV-1a
+  static uint64 hash(char const *str, size_t const len) throw();
+
+  // returns NULL if there is no such string
+  char const *get(uint32 const id) const throw()
+  {
+    return (id < m_strings.size()) ? m_strings[id] : NULL;
+  }
+
+  // returns the interned string (NULL for the NULL string)
+  char const *get_str(char const *str) throw()
+  {
+    return get(intern(str));
+  }
+
+private:
+  // strings, by id
+  qvector<char const *> m_strings;
+  // next string id with the same hash (NO_STRING at the end)
+  qvector<uint32> m_next_ids;
+  // first string id, by string hash
+  OffsetTable<uint32> m_ids;
+  qvector<char *> m_chunks;
+  char *m_chunk_pos;
+  size_t m_chunk_left;
+
+  // no copying or assignment
+  StringPool(StringPool const &);
+  StringPool &operator=(StringPool const &);
+
+  char *alloc(size_t const size) throw();
+};
+
+#endif // IDADWARF_STRING_POOL_HPP
@@ -0,0 +1,152 @@
+#include "threads.hpp"
+
+#ifdef __NT__
+# include <windows.h>
+# include <process.h>
+# include <climits>
+#else
+# include <pthread.h>
+# include <semaphore.h>
+# include <unistd.h>
+#endif
+
+struct ThreadStart
+{
+#ifdef __NT__
+  static unsigned __stdcall run(void *arg)
+#else
+  static void *run(void *arg)
+#endif
+  {
+    WorkerThreads *threads = static_cast<WorkerThreads *>(arg);
+
+    threads->m_fun(threads->m_arg);
+
+    return 0;
+  }
+};
+
+size_t get_nb_cpus(void) throw()
+{
+  size_t nb_cpus = 1;
+
+#ifdef __NT__
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  nb_cpus = static_cast<size_t>(info.dwNumberOfProcessors);
+#else
+  long const nb_online = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(nb_online > 0)
+  {
+    nb_cpus = static_cast<size_t>(nb_online);
+  }
+#endif
+
+  return (nb_cpus != 0) ? nb_cpus : 1;
+}
+
+Semaphore::Semaphore(long const initial_count) throw()
+{
+#ifdef __NT__
+  m_sem = CreateSemaphore(NULL, initial_count, LONG_MAX, NULL);
+#else
+  sem_t *sem = new sem_t;
+
+  sem_init(sem, 0, static_cast<unsigned int>(initial_count));
+  m_sem = sem;
+#endif
+}
+
+Semaphore::~Semaphore(void) throw()
+{
+#ifdef __NT__
+  CloseHandle(m_sem);
+#else
+  sem_t *sem = static_cast<sem_t *>(m_sem);
+
+  sem_destroy(sem);
+  delete sem;
+#endif
+  m_sem = NULL;
+}
+
+void Semaphore::post(void) throw()
+{
+#ifdef __NT__
+  ReleaseSemaphore(m_sem, 1, NULL);
+#else
+  sem_post(static_cast<sem_t *>(m_sem));
+#endif
+}
+
+void Semaphore::wait(void) throw()
+{
+#ifdef __NT__
+  WaitForSingleObject(m_sem, INFINITE);
+#else
+  // retry when interrupted by a signal
+  while(sem_wait(static_cast<sem_t *>(m_sem)) != 0)
+  {
+
+  }
+#endif
+}
+
+WorkerThreads::WorkerThreads(void) throw()
+  : m_fun(NULL), m_arg(NULL)
+{
+
+}
+
+size_t WorkerThreads::start(size_t const nb_threads, thread_fun fun, void *arg) throw()
+{
+  m_fun = fun;
+  m_arg = arg;
+
+  for(size_t idx = 0; idx < nb_threads; ++idx)
+  {
+#ifdef __NT__
+    // _beginthreadex initializes the C runtime for the new thread
+    uintptr_t const handle = _beginthreadex(NULL, 0, ThreadStart::run, this, 0, NULL);
+
+    if(handle != 0)
+    {
+      m_threads.push_back(reinterpret_cast<void *>(handle));
+    }
+#else
+    pthread_t *thread = new pthread_t;
+
+    if(pthread_create(thread, NULL, ThreadStart::run, this) == 0)
+    {
+      m_threads.push_back(thread);
+    }
+    else
+    {
+      delete thread;
+    }
+#endif
+  }
+
+  return m_threads.size();
+}
+
+void WorkerThreads::join(void) throw()
+{
+  for(size_t idx = 0; idx < m_threads.size(); ++idx)
+  {
+#ifdef __NT__
+    WaitForSingleObject(m_threads[idx], INFINITE);
+    CloseHandle(m_threads[idx]);
+#else
+    pthread_t *thread = static_cast<pthread_t *>(m_threads[idx]);
+
+    pthread_join(*thread, NULL);
+    delete thread;
+#endif
+    m_threads[idx] = NULL;
+  }
+
+  m_threads.clear();
+}
@@ -0,0 +1,76 @@
+#ifndef IDADWARF_THREADS_HPP
+#define IDADWARF_THREADS_HPP
+
+// standard headers
+#include <vector>
+
+// IDA headers
+#include <pro.h>
+
+using namespace std;
+
+// warning: the IDA kernel is not thread-safe!
+// worker threads must only call libdwarf (with their own Dwarf_Debug)
+// and the C/C++ runtime.
+
+size_t get_nb_cpus(void) throw();
+
+// atomic helpers (GCC builtins)
+#define ATOMIC_INC(ptr) __sync_fetch_and_add((ptr), 1)
+#define MEMORY_BARRIER() __sync_synchronize()
+
+class Semaphore
+{
+public:
+  Semaphore(long const initial_count=0) throw();
+
+  virtual ~Semaphore(void) throw();
+
+  void post(void) throw();
+
+  void wait(void) throw();
+
+private:
+  void *m_sem; // HANDLE or sem_t *
+
+  // no copying or assignment
+  Semaphore(Semaphore const &);
+  Semaphore &operator=(Semaphore const &);
+};
+
+typedef void (*thread_fun)(void *arg);
+
+// a set of threads running the same function
+class WorkerThreads
+{
+public:
+  WorkerThreads(void) throw();
+
+  virtual ~WorkerThreads(void) throw()
+  {
+    join();
+  }
+
+  // returns the number of started threads
+  size_t start(size_t const nb_threads, thread_fun fun, void *arg) throw();
+
+  void join(void) throw();
+
+  size_t size(void) const throw()
+  {
+    return m_threads.size();
+  }
+
+private:
+  thread_fun m_fun;
+  void *m_arg;
+  vector<void *> m_threads; // HANDLE or pthread_t *
+
+  // no copying or assignment
+  WorkerThreads(WorkerThreads const &);
+  WorkerThreads &operator=(WorkerThreads const &);
+
+  friend struct ThreadStart;
+};
+
+#endif // IDADWARF_THREADS_HPP
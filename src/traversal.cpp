@@ -0,0 +1,335 @@
+#include "traversal.hpp"
+
+// local headers
+#include "iterators.hpp"
+
+extern DieCache diecache;
+
+static char const *phase_names[NB_PHASES] = { "types", "functions", "globals" };
+
+// the finishers have their own timers
+static profile_timer const phase_timers[NB_PHASES] = { TIMER_TYPES, TIMER_FUNCS, TIMER_GLOBALS };
+
+DieTraversal::DieTraversal(CUsHolder const &cus_holder) throw()
+  : m_cus_holder(cus_holder), m_index(NULL), m_decoder(NULL), m_cu_idxs(NULL)
+{
+  memset(m_counts, 0, sizeof(m_counts));
+}
+
+DieTraversal::~DieTraversal(void) throw()
+{
+  clean();
+}
+
+void DieTraversal::add_visitor(traversal_phase const phase, Dwarf_Half const tag,
+                               die_visitor_fun visit)
+{
+  TagVisitor tag_visitor;
+
+  tag_visitor.phase = phase;
+  tag_visitor.visit = visit;
+
+  if(tag >= m_visitors.size())
+  {
+    m_visitors.resize(tag + 1);
+    m_tag_offsets.resize(tag + 1);
+  }
+
+  m_visitors[tag].push_back(tag_visitor);
+}
+
+void DieTraversal::add_finisher(traversal_phase const phase, phase_finisher_fun finish)
+{
+  m_finishers[phase].push_back(finish);
+}
+
+void DieTraversal::run(void)
+{
+  diecache.start_traversal();
+
+  // the first phase is done during the walk
+  profiler.start(phase_timers[PHASE_TYPES]);
+  walk_cus();
+  profiler.stop(phase_timers[PHASE_TYPES]);
+  finish_phase(PHASE_TYPES);
+
+  for(int phase = PHASE_TYPES + 1; phase < NB_PHASES; ++phase)
+  {
+    profiler.start(phase_timers[phase]);
+    visit_tag_offsets(static_cast<traversal_phase>(phase));
+    profiler.stop(phase_timers[phase]);
+    finish_phase(static_cast<traversal_phase>(phase));
+  }
+
+  clean();
+}
+
+void DieTraversal::walk_cus(void)
+{
+  size_t const nb_cus = (m_cu_idxs == NULL) ? m_cus_holder.size() : m_cu_idxs->size();
+
+  for(size_t idx = 0; idx < nb_cus; ++idx)
+  {
+    size_t const cu_idx = (m_cu_idxs == NULL) ? idx : (*m_cu_idxs)[idx];
+
+    // the DIEs of a restored CU are already in the cache
+    if(m_index == NULL || !m_index->restore_cu(cu_idx))
+    {
+      if(m_decoder != NULL)
+      {
+        m_decoder->import_cu(cu_idx);
+      }
+
+      walk_cu(cu_idx);
+    }
+
+    // do not keep the holders of the widest CU for the whole analysis
+    die_holder_pool.clear();
+  }
+}
+
+// the DIEs are visited while walking the CU
+// (they are not got again from their offset)
+void DieTraversal::walk_cu(size_t const cu_idx)
+{
+  Dwarf_Debug dbg = m_cus_holder.get_dbg();
+  Dwarf_Die cu_die = m_cus_holder[cu_idx];
+  qvector<Dwarf_Die> stack;
+
+  stack.push_back(cu_die);
+
+  while(!stack.empty())
+  {
+    Dwarf_Die die = stack.back();
+    // the CU DIE belongs to the CUs holder
+    DieHolder holder(dbg, die, die != cu_die);
+
+    stack.pop_back();
+
+    // separate tries: a bad sibling link does not skip the subtree of the DIE,
+    // a bad child link does not skip the DIE itself
+    // the compilation unit DIE has no sibling in its CU
+    if(die != cu_die)
+    {
+      try
+      {
+        Dwarf_Die const sibling_die = holder.get_sibling();
+
+        if(sibling_die != NULL)
+        {
+          stack.push_back(sibling_die);
+        }
+      }
+      catch(DieException const &exc)
+      {
+        walk_error(exc, cu_idx);
+      }
+    }
+
+    try
+    {
+      Dwarf_Die const child_die = holder.get_child();
+
+      if(child_die != NULL)
+      {
+        stack.push_back(child_die);
+      }
+    }
+    catch(DieException const &exc)
+    {
+      walk_error(exc, cu_idx);
+    }
+
+    try
+    {
+      visit_die(holder.get_offset(), holder.get_tag(), &holder, cu_idx);
+    }
+    catch(DieException const &exc)
+    {
+      walk_error(exc, cu_idx);
+    }
+  }
+}
+
+void DieTraversal::walk_error(DieException const &exc, size_t const cu_idx) throw()
+{
+  if(count_dwarf_error(DWERR_SKIPPED_DIE))
+  {
+    MSG("cannot walk DIE (skipping): %s\n", exc.what());
+  }
+
+  if(m_index != NULL)
+  {
+    m_index->set_cu_failed(cu_idx);
+  }
+}
+
+// the holder is NULL if the DIE has to be got from its offset
+void DieTraversal::visit_die(Dwarf_Off const offset, Dwarf_Half const tag,
+                             DieHolder *holder, size_t const cu_idx)
+{
+  bool deferred = false;
+
+  if(tag < m_visitors.size())
+  {
+    TagVisitors const &tag_visitors = m_visitors[tag];
+
+    for(size_t idx = 0; idx < tag_visitors.size(); ++idx)
+    {
+      TagVisitor const &tag_visitor = tag_visitors[idx];
+
+      if(tag_visitor.phase == PHASE_TYPES)
+      {
+        visit_offset(offset, holder, tag_visitor.visit, PHASE_TYPES, cu_idx);
+      }
+      else
+      {
+        deferred = true;
+      }
+    }
+  }
+
+  if(deferred)
+  {
+    TagOffset tag_offset;
+
+    tag_offset.offset = offset;
+    tag_offset.cu_idx = static_cast<uint32>(cu_idx);
+    m_tag_offsets[tag].push_back(tag_offset);
+  }
+}
+
+// only get the DIE from libdwarf if it has not been cached yet
+void DieTraversal::visit_offset(Dwarf_Off const offset, DieHolder *holder,
+                                die_visitor_fun visit, traversal_phase const phase,
+                                size_t const cu_idx)
+{
+  if(!diecache.in_cache(offset))
+  {
+    PhaseCounts &counts = m_counts[phase];
+
+    counts.nb_visited++;
+    profiler.count(COUNTER_DIES_VISITED);
+
+    try
+    {
+      die_cache cache;
+
+      if(holder == NULL)
+      {
+        DieHolder offset_holder(m_cus_holder.get_dbg(), offset);
+
+        visit(offset_holder);
+      }
+      else
+      {
+        visit(*holder);
+      }
+
+      if(diecache.get_cache(offset, &cache) && cache.type != DIE_USELESS)
+      {
+        counts.nb_retrieved++;
+      }
+    }
+    catch(DieException const &exc)
+    {
+      if(count_dwarf_error(DWERR_SKIPPED_DIE))
+      {
+        MSG("cannot retrieve DIE at offset 0x%" DW_PR_DUx " (skipping): %s\n",
+            offset, exc.what());
+      }
+      counts.nb_errors++;
+
+      if(m_index != NULL)
+      {
+        m_index->set_cu_failed(cu_idx);
+      }
+    }
+  }
+}
+
+// the offsets of the phase tags are merged,
+// to visit the DIEs in the order of the walk (e.g. functions and labels)
+void DieTraversal::visit_tag_offsets(traversal_phase const phase)
+{
+  qvector<Dwarf_Half> tags;
+  qvector<size_t> positions;
+  bool done = false;
+
+  for(size_t tag = 0; tag < m_visitors.size(); ++tag)
+  {
+    TagVisitors const &tag_visitors = m_visitors[tag];
+
+    for(size_t idx = 0; idx < tag_visitors.size(); ++idx)
+    {
+      if(tag_visitors[idx].phase == phase && !m_tag_offsets[tag].empty())
+      {
+        tags.push_back(static_cast<Dwarf_Half>(tag));
+        positions.push_back(0);
+        break;
+      }
+    }
+  }
+
+  while(!done)
+  {
+    size_t next_idx = tags.size();
+
+    // the tag with the lowest next offset
+    for(size_t idx = 0; idx < tags.size(); ++idx)
+    {
+      TagOffsets const &tag_offsets = m_tag_offsets[tags[idx]];
+
+      if(positions[idx] != tag_offsets.size() &&
+         (next_idx == tags.size() ||
+          tag_offsets[positions[idx]].offset <
+          m_tag_offsets[tags[next_idx]][positions[next_idx]].offset))
+      {
+        next_idx = idx;
+      }
+    }
+
+    done = (next_idx == tags.size());
+    if(!done)
+    {
+      Dwarf_Half const tag = tags[next_idx];
+      TagOffset const &tag_offset = m_tag_offsets[tag][positions[next_idx]++];
+      TagVisitors const &tag_visitors = m_visitors[tag];
+
+      for(size_t idx = 0; idx < tag_visitors.size(); ++idx)
+      {
+        TagVisitor const &tag_visitor = tag_visitors[idx];
+
+        if(tag_visitor.phase == phase)
+        {
+          visit_offset(tag_offset.offset, NULL, tag_visitor.visit, phase,
+                       tag_offset.cu_idx);
+        }
+      }
+    }
+  }
+}
+
+void DieTraversal::finish_phase(traversal_phase const phase)
+{
+  qvector<phase_finisher_fun> const &finishers = m_finishers[phase];
+
+  PhaseCounts const &counts = m_counts[phase];
+
+  for(size_t idx = 0; idx < finishers.size(); ++idx)
+  {
+    finishers[idx](m_cus_holder.get_dbg());
+  }
+
+  MSG("%s phase: %u DIEs visited, %u retrieved, %u errors\n", phase_names[phase],
+      counts.nb_visited, counts.nb_retrieved, counts.nb_errors);
+}
+
+void DieTraversal::clean(void) throw()
+{
+  for(size_t tag = 0; tag < m_tag_offsets.size(); ++tag)
+  {
+    m_tag_offsets[tag].clear();
+  }
+  die_holder_pool.clear();
+}
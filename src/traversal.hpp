@@ -0,0 +1,131 @@
+#ifndef IDADWARF_TRAVERSAL_HPP
+#define IDADWARF_TRAVERSAL_HPP
+
+// additional libs headers
+#include <dwarf.h>
+#include <libdwarf.h>
+
+// local headers
+#include "die_index.hpp"
+#include "die_utils.hpp"
+#include "type_decoder.hpp"
+
+// retrieval phases, in dependency order:
+// a phase only begins when the previous one is finished
+// (function retrieval needs all the types,
+// global retrieval only gets what function retrieval did not cache)
+enum traversal_phase { PHASE_TYPES, PHASE_FUNCS, PHASE_GLOBALS, NB_PHASES };
+
+// called when all the DIEs of a phase have been visited
+typedef void (*phase_finisher_fun)(Dwarf_Debug dbg);
+
+// walks the DIEs of each compilation unit only once.
+// during the walk, DIEs are given to the first phase visitors for their tag.
+// the offsets of the DIEs wanted by the next phases are recorded by tag
+// during the walk, and only visited when the previous phases are finished
+// (in .debug_info order, only them are got again from libdwarf:
+// a phase goes over the offsets of its tags, not over all the DIEs).
+// visitors are only given the DIEs not already in the cache.
+// with a DIE index, the CUs it restores are not visited at all.
+// with a type decoder, the type DIEs of a CU are decoded by worker threads
+// before the CU is walked.
+// with a CU selection, only the selected CUs are walked
+// (the DIEs they reference in the other CUs are still visited on demand).
+class DieTraversal
+{
+public:
+  DieTraversal(CUsHolder const &cus_holder) throw();
+
+  virtual ~DieTraversal(void) throw();
+
+  void add_visitor(traversal_phase const phase, Dwarf_Half const tag,
+                   die_visitor_fun visit);
+
+  void add_finisher(traversal_phase const phase, phase_finisher_fun finish);
+
+  // the index is told about the CUs that could not be applied
+  void set_index(DieIndex *index) throw()
+  {
+    m_index = index;
+  }
+
+  // the decoder imports the types of each CU before it is walked
+  void set_decoder(TypeDecoder *decoder) throw()
+  {
+    m_decoder = decoder;
+  }
+
+  // only walk these CUs (indexes in the holder), instead of all of them
+  // the selection must live until the end of the run
+  void set_cus(qvector<size_t> const *cu_idxs) throw()
+  {
+    m_cu_idxs = cu_idxs;
+  }
+
+  // the finishers only go over the DIEs cached by this run (see CacheIterator)
+  void run(void);
+
+private:
+  struct TagVisitor
+  {
+    traversal_phase phase;
+    die_visitor_fun visit;
+  };
+
+  typedef qvector<TagVisitor> TagVisitors;
+
+  // reported when a phase is finished
+  struct PhaseCounts
+  {
+    uint32 nb_visited;
+    uint32 nb_retrieved; // visited DIEs with a useful cache
+    uint32 nb_errors;
+  };
+
+  // a DIE to be visited by later phases
+  struct TagOffset
+  {
+    Dwarf_Off offset;
+    uint32 cu_idx;
+  };
+
+  typedef qvector<TagOffset> TagOffsets;
+
+  CUsHolder const &m_cus_holder;
+  // visitors, indexed by DIE tag
+  qvector<TagVisitors> m_visitors;
+  qvector<phase_finisher_fun> m_finishers[NB_PHASES];
+  PhaseCounts m_counts[NB_PHASES];
+  // offsets of the walked DIEs wanted by the next phases, indexed by DIE tag
+  // (in walk order, i.e. ascending offsets in a CU)
+  qvector<TagOffsets> m_tag_offsets;
+  DieIndex *m_index;
+  TypeDecoder *m_decoder;
+  // NULL to walk all the CUs
+  qvector<size_t> const *m_cu_idxs;
+
+  // no copying or assignment
+  DieTraversal(DieTraversal const &);
+  DieTraversal &operator=(DieTraversal const &);
+
+  void walk_cus(void);
+
+  void walk_cu(size_t const cu_idx);
+
+  void walk_error(DieException const &exc, size_t const cu_idx) throw();
+
+  void visit_die(Dwarf_Off const offset, Dwarf_Half const tag, DieHolder *holder,
+                 size_t const cu_idx);
+
+  void visit_offset(Dwarf_Off const offset, DieHolder *holder, die_visitor_fun visit,
+                    traversal_phase const phase, size_t const cu_idx);
+
+  // the recorded offsets of the tags with a visitor for the phase
+  void visit_tag_offsets(traversal_phase const phase);
+
+  void finish_phase(traversal_phase const phase);
+
+  void clean(void) throw();
+};
+
+#endif // IDADWARF_TRAVERSAL_HPP
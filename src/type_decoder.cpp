@@ -0,0 +1,643 @@
+#include "type_decoder.hpp"
+
+// local headers
+#include "type_graph.hpp"
+#include "type_retrieval.hpp"
+
+// at most that many libdwarf handles are opened at the same time
+// (the mapped debug sections are shared, not the libdwarf state)
+#define MAX_DECODE_WORKERS 64
+// at most that many decoded CUs are waiting to be imported
+#define DECODE_WINDOW 128
+
+// the decoding does not count nor log its libdwarf errors (only its calls):
+// the DIEs with an error are decoded again by the main thread (see TypeGraph::build_node)
+
+static void dealloc_error(Dwarf_Debug dbg, Dwarf_Error err) throw()
+{
+  if(err != NULL)
+  {
+    dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+  }
+}
+
+// a checked libdwarf call, counted like CHECK_DWERR does
+// (the main thread adds the calls of the decoded types to the profiler)
+static int count_call(DecodedTypes &types, int const ret) throw()
+{
+  types.nb_dwarf_calls++;
+
+  return ret;
+}
+
+// attributes of a DIE, without the profiler and the DIE names pool
+// of the DIE holders (those are not thread-safe)
+class AttrList
+{
+public:
+  AttrList(Dwarf_Debug dbg, Dwarf_Die die, DecodedTypes &types) throw()
+    : m_dbg(dbg), m_attrs(NULL), m_nb_attrs(0), m_valid(true)
+  {
+    Dwarf_Error err = NULL;
+
+    // the DIE may have no attribute
+    if(count_call(types, dwarf_attrlist(die, &m_attrs, &m_nb_attrs, &err)) == DW_DLV_ERROR)
+    {
+      dealloc_error(m_dbg, err);
+      m_valid = false;
+    }
+
+    for(Dwarf_Signed idx = 0; m_valid && idx < m_nb_attrs; ++idx)
+    {
+      Dwarf_Half code = 0;
+
+      if(count_call(types, dwarf_whatattr(m_attrs[idx], &code, &err)) != DW_DLV_OK)
+      {
+        dealloc_error(m_dbg, err);
+        m_valid = false;
+      }
+
+      m_codes.push_back(code);
+    }
+  }
+
+  virtual ~AttrList(void) throw()
+  {
+    if(m_attrs != NULL)
+    {
+      for(Dwarf_Signed idx = 0; idx < m_nb_attrs; ++idx)
+      {
+        dwarf_dealloc(m_dbg, m_attrs[idx], DW_DLA_ATTR);
+        m_attrs[idx] = NULL;
+      }
+
+      dwarf_dealloc(m_dbg, m_attrs, DW_DLA_LIST);
+      m_attrs = NULL;
+    }
+  }
+
+  // could all the attribute codes be read?
+  bool is_valid(void) const throw()
+  {
+    return m_valid;
+  }
+
+  // returns NULL if there is no such attribute
+  Dwarf_Attribute get(int attr) const throw()
+  {
+    Dwarf_Attribute attrib = NULL;
+
+    for(size_t idx = 0; attrib == NULL && idx < m_codes.size(); ++idx)
+    {
+      if(m_codes[idx] == attr)
+      {
+        attrib = m_attrs[idx];
+      }
+    }
+
+    return attrib;
+  }
+
+private:
+  Dwarf_Debug m_dbg;
+  Dwarf_Attribute *m_attrs;
+  Dwarf_Signed m_nb_attrs;
+  vector<Dwarf_Half> m_codes;
+  bool m_valid;
+
+  // no copying or assignment
+  AttrList(AttrList const &);
+  AttrList &operator=(AttrList const &);
+};
+
+static int read_small_val(Dwarf_Debug dbg, DecodedTypes &types, Dwarf_Attribute attrib,
+                          Dwarf_Signed *val) throw()
+{
+  Dwarf_Error err = NULL;
+  int const ret = (attrib == NULL) ? DW_DLV_NO_ENTRY :
+    count_call(types, get_small_encoding_value(attrib, val, &err));
+
+  dealloc_error(dbg, err);
+
+  return ret;
+}
+
+static bool read_name(Dwarf_Debug dbg, DecodedTypes &types, AttrList const &attrs,
+                      string *name, bool *has_name) throw()
+{
+  Dwarf_Attribute attrib = attrs.get(DW_AT_name);
+  bool read = true;
+
+  *has_name = false;
+  if(attrib != NULL)
+  {
+    char *str = NULL;
+    Dwarf_Error err = NULL;
+
+    // points in the string section (or in the DIE), nothing to deallocate
+    read = (count_call(types, dwarf_formstring(attrib, &str, &err)) == DW_DLV_OK);
+    if(read)
+    {
+      *name = str;
+      *has_name = true;
+    }
+
+    dealloc_error(dbg, err);
+  }
+
+  return read;
+}
+
+// a type reference, DW_DLV_NO_ENTRY for void
+static int read_ref(Dwarf_Debug dbg, DecodedTypes &types, Dwarf_Die die,
+                    Dwarf_Off const die_offset, AttrList const &attrs,
+                    Dwarf_Off *type_offset, uint64 *signature) throw()
+{
+  Dwarf_Attribute attrib = attrs.get(DW_AT_type);
+  Dwarf_Error err = NULL;
+  int ret = DW_DLV_NO_ENTRY;
+
+  *signature = 0;
+  if(attrib != NULL)
+  {
+    ret = count_call(types, read_die_ref(die, die_offset, attrib, type_offset, signature, &err));
+  }
+
+  dealloc_error(dbg, err);
+
+  return ret;
+}
+
+// a type reference that must be there
+static bool read_type(Dwarf_Debug dbg, DecodedTypes &types, Dwarf_Die die,
+                      Dwarf_Off const die_offset, AttrList const &attrs,
+                      Dwarf_Off *type_offset) throw()
+{
+  uint64 signature = 0;
+
+  return (read_ref(dbg, types, die, die_offset, attrs, type_offset, &signature) == DW_DLV_OK);
+}
+
+static bool read_member_offset(Dwarf_Debug dbg, DecodedTypes &types, Dwarf_Off const die_offset,
+                               AttrList const &attrs, Dwarf_Unsigned *offset) throw()
+{
+  Dwarf_Attribute attrib = attrs.get(DW_AT_data_member_location);
+  Dwarf_Error err = NULL;
+  bool const read = (attrib != NULL &&
+                     count_call(types, read_die_member_offset(dbg, die_offset, attrib,
+                                                              offset, &err)) == DW_DLV_OK);
+
+  dealloc_error(dbg, err);
+
+  return read;
+}
+
+// a member, enumerator or parameter DIE
+// returns false if it cannot be decoded
+static bool decode_member(Dwarf_Debug dbg, Dwarf_Die child_die, Dwarf_Half const tag,
+                          DecodedTypes &types, bool *ellipsis) throw()
+{
+  AttrList const attrs(dbg, child_die, types);
+  Dwarf_Half child_tag = 0;
+  DecodedMember member;
+  Dwarf_Error err = NULL;
+  bool decoded = (attrs.is_valid() &&
+                  count_call(types, dwarf_tag(child_die, &child_tag, &err)) == DW_DLV_OK &&
+                  count_call(types, get_die_offset(child_die, &member.offset, &err)) == DW_DLV_OK);
+
+  dealloc_error(dbg, err);
+
+  member.has_name = false;
+  member.member_offset = 0;
+  member.value = 0;
+  member.has_type = false;
+  member.type_offset = 0;
+
+  if(!decoded)
+  {
+    // nothing more
+  }
+  else if(child_tag == DW_TAG_member &&
+          (tag == DW_TAG_structure_type || tag == DW_TAG_union_type))
+  {
+    decoded = (read_name(dbg, types, attrs, &member.name, &member.has_name) &&
+               (tag != DW_TAG_structure_type ||
+                read_member_offset(dbg, types, member.offset, attrs, &member.member_offset)) &&
+               read_type(dbg, types, child_die, member.offset, attrs, &member.type_offset));
+    member.has_type = true;
+    types.members.push_back(member);
+  }
+  else if(child_tag == DW_TAG_enumerator && tag == DW_TAG_enumeration_type)
+  {
+    decoded = (read_name(dbg, types, attrs, &member.name, &member.has_name) &&
+               read_small_val(dbg, types, attrs.get(DW_AT_const_value), &member.value) == DW_DLV_OK);
+    types.members.push_back(member);
+  }
+  else if(child_tag == DW_TAG_formal_parameter && tag == DW_TAG_subroutine_type)
+  {
+    decoded = read_type(dbg, types, child_die, member.offset, attrs, &member.type_offset);
+    member.has_type = true;
+    types.members.push_back(member);
+  }
+  else if(child_tag == DW_TAG_unspecified_parameters)
+  {
+    *ellipsis = true;
+  }
+
+  return decoded;
+}
+
+// the children of a type DIE (all read before being added to the graph)
+static bool decode_members(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Half const tag,
+                           DecodedType &type, DecodedTypes &types) throw()
+{
+  Dwarf_Die child_die = NULL;
+  Dwarf_Error err = NULL;
+  int ret = count_call(types, dwarf_child(die, &child_die, &err));
+  bool decoded = (ret != DW_DLV_ERROR);
+
+  type.first_member = types.members.size();
+  type.ellipsis = false;
+
+  while(decoded && ret == DW_DLV_OK)
+  {
+    Dwarf_Die sibling_die = NULL;
+
+    decoded = decode_member(dbg, child_die, tag, types, &type.ellipsis);
+    ret = count_call(types, dwarf_siblingof(dbg, child_die, &sibling_die, &err));
+    decoded = (decoded && ret != DW_DLV_ERROR);
+    dwarf_dealloc(dbg, child_die, DW_DLA_DIE);
+    child_die = sibling_die;
+  }
+
+  if(child_die != NULL)
+  {
+    dwarf_dealloc(dbg, child_die, DW_DLA_DIE);
+  }
+
+  dealloc_error(dbg, err);
+  type.nb_members = types.members.size() - type.first_member;
+
+  return decoded;
+}
+
+// number of elements of an array, from its first subrange
+static bool decode_nb_elems(Dwarf_Debug dbg, Dwarf_Die die, DecodedTypes &types,
+                            Dwarf_Signed *nb_elems) throw()
+{
+  Dwarf_Die child_die = NULL;
+  Dwarf_Error err = NULL;
+  int ret = count_call(types, dwarf_child(die, &child_die, &err));
+  bool found = false;
+  bool decoded = (ret != DW_DLV_ERROR);
+
+  *nb_elems = 0;
+  while(decoded && !found && ret == DW_DLV_OK)
+  {
+    Dwarf_Die sibling_die = NULL;
+    Dwarf_Half child_tag = 0;
+
+    decoded = (count_call(types, dwarf_tag(child_die, &child_tag, &err)) == DW_DLV_OK);
+    found = (decoded && child_tag == DW_TAG_subrange_type);
+    if(found)
+    {
+      AttrList const attrs(dbg, child_die, types);
+      Dwarf_Signed upper_bound = 0;
+      int const bound_ret = attrs.is_valid() ?
+        read_small_val(dbg, types, attrs.get(DW_AT_upper_bound), &upper_bound) : DW_DLV_ERROR;
+
+      // a bound that cannot be read is counted by the main thread
+      decoded = (bound_ret != DW_DLV_ERROR);
+      if(bound_ret == DW_DLV_OK)
+      {
+        *nb_elems = upper_bound + 1;
+      }
+    }
+    else if(decoded)
+    {
+      ret = count_call(types, dwarf_siblingof(dbg, child_die, &sibling_die, &err));
+      decoded = (ret != DW_DLV_ERROR);
+    }
+
+    dwarf_dealloc(dbg, child_die, DW_DLA_DIE);
+    child_die = sibling_die;
+  }
+
+  if(child_die != NULL)
+  {
+    dwarf_dealloc(dbg, child_die, DW_DLA_DIE);
+  }
+
+  dealloc_error(dbg, err);
+
+  return decoded;
+}
+
+// (the members of a type that cannot be decoded are dropped)
+bool decode_type_die(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Half const tag,
+                     DecodedTypes &types) throw()
+{
+  uint8 const kind = TypeGraph::get_kind(tag);
+  bool decoded = true;
+
+  if(kind != NODE_UNKNOWN)
+  {
+    AttrList const attrs(dbg, die, types);
+    size_t const nb_members = types.members.size();
+    DecodedType type;
+    Dwarf_Error err = NULL;
+    int type_ret = DW_DLV_NO_ENTRY;
+
+    decoded = (attrs.is_valid() &&
+               count_call(types, get_die_offset(die, &type.offset, &err)) == DW_DLV_OK);
+
+    type.kind = kind;
+    type.has_name = false;
+    type.byte_size = 0;
+    type.encoding = 0;
+    type.nb_elems = 0;
+    type.has_type = false;
+    type.type_offset = 0;
+    type.signature = 0;
+    type.declaration = (attrs.get(DW_AT_declaration) != NULL);
+    type.ellipsis = false;
+    type.first_member = nb_members;
+    type.nb_members = 0;
+
+    if(decoded)
+    {
+      // a missing type is void, but an unreadable one is counted by the main thread
+      type_ret = read_ref(dbg, types, die, type.offset, attrs, &type.type_offset, &type.signature);
+      type.has_type = (type_ret == DW_DLV_OK);
+      decoded = (type_ret != DW_DLV_ERROR &&
+                 read_name(dbg, types, attrs, &type.name, &type.has_name));
+    }
+
+    if(decoded && attrs.get(DW_AT_byte_size) != NULL)
+    {
+      decoded = (count_call(types, dwarf_bytesize(die, &type.byte_size, &err)) == DW_DLV_OK);
+    }
+
+    if(decoded && kind == NODE_BASE)
+    {
+      decoded = (read_small_val(dbg, types, attrs.get(DW_AT_encoding), &type.encoding) == DW_DLV_OK);
+    }
+    else if(decoded && kind == NODE_ARRAY)
+    {
+      decoded = decode_nb_elems(dbg, die, types, &type.nb_elems);
+    }
+
+    if(decoded)
+    {
+      decoded = decode_members(dbg, die, tag, type, types);
+    }
+
+    dealloc_error(dbg, err);
+
+    if(decoded)
+    {
+      types.types.push_back(type);
+    }
+    else
+    {
+      types.members.resize(nb_members);
+    }
+  }
+
+  return decoded;
+}
+
+// the DIEs are walked like DieTraversal::walk_cu does
+void decode_unit_types(Dwarf_Debug dbg, Dwarf_Off const unit_offset,
+                       DecodedTypes &types) throw()
+{
+  vector<Dwarf_Die> stack;
+  Dwarf_Die unit_die = NULL;
+  Dwarf_Error err = NULL;
+
+  if(count_call(types, get_die_from_offset(dbg, unit_offset, &unit_die, &err)) == DW_DLV_OK)
+  {
+    stack.push_back(unit_die);
+  }
+
+  dealloc_error(dbg, err);
+
+  while(!stack.empty())
+  {
+    Dwarf_Die die = stack.back();
+    Dwarf_Die other_die = NULL;
+    Dwarf_Half tag = 0;
+
+    err = NULL;
+    stack.pop_back();
+
+    // the unit DIE has no sibling in its unit
+    if(die != unit_die &&
+       count_call(types, dwarf_siblingof(dbg, die, &other_die, &err)) == DW_DLV_OK)
+    {
+      stack.push_back(other_die);
+    }
+
+    dealloc_error(dbg, err);
+    err = NULL;
+
+    if(count_call(types, dwarf_child(die, &other_die, &err)) == DW_DLV_OK)
+    {
+      stack.push_back(other_die);
+    }
+
+    dealloc_error(dbg, err);
+    err = NULL;
+
+    if(count_call(types, dwarf_tag(die, &tag, &err)) == DW_DLV_OK)
+    {
+      // the DIEs that cannot be decoded are left to the main thread
+      decode_type_die(dbg, die, tag, types);
+    }
+
+    dealloc_error(dbg, err);
+    dwarf_dealloc(dbg, die, DW_DLA_DIE);
+  }
+}
+
+size_t const TypeDecoder::NO_SLOT;
+
+TypeDecoder::TypeDecoder(CUsHolder const &cus_holder) throw()
+  : m_cus_holder(cus_holder), m_next_file(0), m_next_slot(0), m_stop(false),
+    m_window(DECODE_WINDOW)
+{
+
+}
+
+bool TypeDecoder::start(DieIndex const *index) throw()
+{
+  Dwarf_Debug dbg = m_cus_holder.get_dbg();
+  // the main thread imports the decoded CUs (and applies them)
+  size_t nb_workers = get_nb_cpus() - 1;
+
+  m_slots.resize(m_cus_holder.size(), NO_SLOT);
+
+  for(size_t cu_idx = 0; cu_idx < m_cus_holder.size(); ++cu_idx)
+  {
+    Dwarf_Off unit_offset = 0;
+    Dwarf_Error err = NULL;
+
+    // the CUs restored by the index are not walked
+    if((index == NULL || !index->is_unchanged(cu_idx)) &&
+       get_die_offset(m_cus_holder[cu_idx], &unit_offset, &err) == DW_DLV_OK)
+    {
+      m_slots[cu_idx] = m_unit_offsets.size();
+      m_unit_offsets.push_back(unit_offset);
+    }
+
+    dealloc_error(dbg, err);
+  }
+
+  m_types.resize(m_unit_offsets.size(), NULL);
+  m_ready.resize(m_unit_offsets.size(), 0);
+
+  // a CU is imported while the next ones are decoded,
+  // there is nothing to overlap with a single CU
+  nb_workers = qmin(nb_workers, static_cast<size_t>(MAX_DECODE_WORKERS));
+  nb_workers = qmin(nb_workers, (m_unit_offsets.size() < 2) ? 0 : m_unit_offsets.size() - 1);
+
+  // with a single CPU, the main thread reads the type DIEs itself
+  if(nb_workers != 0)
+  {
+    // libelf/libdwarf initialization must not be done concurrently
+    open_files(nb_workers);
+    m_workers.start(m_files.size(), run_worker, this);
+  }
+
+  if(m_workers.size() == 0)
+  {
+    m_slots.assign(m_slots.size(), NO_SLOT);
+  }
+  else
+  {
+    MSG("decoding the types with %u threads\n", static_cast<uint32>(m_workers.size()));
+  }
+
+  return (m_workers.size() != 0);
+}
+
+void TypeDecoder::import_cu(size_t const cu_idx) throw()
+{
+  size_t const slot = (cu_idx < m_slots.size()) ? m_slots[cu_idx] : NO_SLOT;
+
+  if(slot != NO_SLOT)
+  {
+    MEMORY_BARRIER();
+
+    while(m_ready[slot] == 0)
+    {
+      m_done.wait();
+      MEMORY_BARRIER();
+    }
+
+    import_decoded_types(*m_types[slot]);
+    delete m_types[slot], m_types[slot] = NULL;
+    m_slots[cu_idx] = NO_SLOT;
+    m_window.post();
+  }
+}
+
+void TypeDecoder::stop(void) throw()
+{
+  if(m_workers.size() != 0)
+  {
+    m_stop = true;
+    MEMORY_BARRIER();
+
+    // wake up the workers waiting for a window slot
+    for(size_t idx = 0; idx < m_workers.size(); ++idx)
+    {
+      m_window.post();
+    }
+
+    m_workers.join();
+  }
+
+  for(size_t idx = 0; idx < m_types.size(); ++idx)
+  {
+    delete m_types[idx], m_types[idx] = NULL;
+  }
+
+  m_slots.clear();
+  close_files();
+}
+
+void TypeDecoder::open_files(size_t const nb_files) throw()
+{
+  char const *path = m_cus_holder.get_path();
+
+  for(size_t idx = 0; idx < nb_files; ++idx)
+  {
+    DwarfFile *file = new DwarfFile();
+    Dwarf_Error err = NULL;
+
+    if(file->open(path, &err) != DW_DLV_OK)
+    {
+      delete file, file = NULL;
+      break;
+    }
+
+    m_files.push_back(file);
+  }
+
+  if(m_files.size() != nb_files)
+  {
+    MSG("only %u libdwarf handles could be opened for the decoding threads\n",
+        static_cast<uint32>(m_files.size()));
+  }
+}
+
+void TypeDecoder::close_files(void) throw()
+{
+  for(size_t idx = 0; idx < m_files.size(); ++idx)
+  {
+    delete m_files[idx], m_files[idx] = NULL;
+  }
+
+  m_files.clear();
+}
+
+void TypeDecoder::run_worker(void *arg) throw()
+{
+  TypeDecoder *decoder = static_cast<TypeDecoder *>(arg);
+  size_t const file_idx = static_cast<size_t>(ATOMIC_INC(&decoder->m_next_file));
+
+  decoder->decode_units(decoder->m_files[file_idx]->get_dbg());
+}
+
+void TypeDecoder::decode_units(Dwarf_Debug dbg) throw()
+{
+  bool stop = false;
+
+  while(!stop)
+  {
+    // the slots are taken after getting a window place,
+    // so the CU the main thread waits for always has one
+    m_window.wait();
+    MEMORY_BARRIER();
+
+    size_t const slot = static_cast<size_t>(ATOMIC_INC(&m_next_slot));
+
+    if(m_stop || slot >= m_unit_offsets.size())
+    {
+      // let the other workers see the end too
+      m_window.post();
+      stop = true;
+    }
+    else
+    {
+      DecodedTypes *types = new DecodedTypes;
+
+      decode_unit_types(dbg, m_unit_offsets[slot], *types);
+      m_types[slot] = types;
+      MEMORY_BARRIER();
+      m_ready[slot] = 1;
+      m_done.post();
+    }
+  }
+}
@@ -0,0 +1,148 @@
+#ifndef IDADWARF_TYPE_DECODER_HPP
+#define IDADWARF_TYPE_DECODER_HPP
+
+// standard headers
+#include <string>
+#include <vector>
+
+// additional libs headers
+#include <dwarf.h>
+#include <libdwarf.h>
+
+// local headers
+#include "die_index.hpp"
+#include "die_utils.hpp"
+#include "dwarf_file.hpp"
+#include "threads.hpp"
+
+using namespace std;
+
+// the decoded types are built by the worker threads,
+// so they only use the C++ runtime (no qvector, no string pool)
+
+// struct/union member, enumerator or subroutine parameter
+struct DecodedMember
+{
+  Dwarf_Off offset; // DIE offset
+  string name;
+  bool has_name;
+  Dwarf_Unsigned member_offset; // 0 for union members
+  Dwarf_Signed value; // enumerator value
+  bool has_type;
+  Dwarf_Off type_offset;
+};
+
+// what the type graph needs from a type DIE
+struct DecodedType
+{
+  Dwarf_Off offset; // DIE offset
+  uint8 kind; // see type_node_kind
+  string name;
+  bool has_name;
+  Dwarf_Unsigned byte_size; // 0 if unknown
+  Dwarf_Signed encoding; // base types only
+  Dwarf_Signed nb_elems; // arrays only (0 if unknown)
+  bool has_type;
+  Dwarf_Off type_offset;
+  // signature of a type without its type unit (0 if none), the type is void
+  uint64 signature;
+  bool declaration; // incomplete struct/union
+  bool ellipsis; // subroutine with unspecified parameters
+  size_t first_member; // index in the members
+  size_t nb_members;
+};
+
+// the type DIEs of a compilation unit (or of a type unit)
+// the DIEs that cannot be decoded (libdwarf error, unexpected form...)
+// are left out: the main thread decodes them again, and logs and counts the error.
+struct DecodedTypes
+{
+  DecodedTypes(void) throw()
+    : nb_dwarf_calls(0)
+  {
+
+  }
+
+  vector<DecodedType> types; // in .debug_info order
+  vector<DecodedMember> members;
+  // checked libdwarf calls of the decoding (see COUNTER_DWARF_CALLS)
+  uint32 nb_dwarf_calls;
+};
+
+// decode a DIE (nothing is added if it is not a type DIE)
+// returns false if it cannot be decoded (libdwarf error, unexpected form...):
+// it is the only type DIE reader, for the main thread too (see TypeGraph::build_node)
+bool decode_type_die(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Half const tag,
+                     DecodedTypes &types) throw();
+
+// decode the type DIEs of the unit with its DIE at this offset
+void decode_unit_types(Dwarf_Debug dbg, Dwarf_Off const unit_offset,
+                       DecodedTypes &types) throw();
+
+// the type DIEs of the compilation units are decoded in parallel
+// by worker threads, each one with its own libdwarf handle,
+// while the main thread walks the CUs (first stage of the pipeline).
+// before walking a CU, the main thread imports its decoded types
+// in the type graph (see TypeGraph::import_types), so the type visitors
+// do not read the members from libdwarf (second stage, with the IDA calls).
+// only a window of decoded CUs waits to be imported.
+// only the type DIEs are decoded in parallel: the functions, variables
+// and locations are still read by the main thread.
+class TypeDecoder
+{
+public:
+  TypeDecoder(CUsHolder const &cus_holder) throw();
+
+  virtual ~TypeDecoder(void) throw()
+  {
+    stop();
+  }
+
+  // start the worker threads for the CUs of the holder
+  // (but the ones the index will restore)
+  // returns false if there are not enough CPUs or libdwarf handles:
+  // then the type DIEs are only read by the main thread.
+  bool start(DieIndex const *index) throw();
+
+  // wait for the types of the CU to be decoded and import them
+  // (nothing is done for a CU that is not decoded)
+  void import_cu(size_t const cu_idx) throw();
+
+  // stop the workers (the CUs not imported yet are dropped)
+  void stop(void) throw();
+
+private:
+  static size_t const NO_SLOT = static_cast<size_t>(-1);
+
+  CUsHolder const &m_cus_holder;
+  // the unit DIE offsets to decode, in walk order
+  vector<Dwarf_Off> m_unit_offsets;
+  // slot of each CU of the holder (NO_SLOT if not decoded)
+  vector<size_t> m_slots;
+  vector<DecodedTypes *> m_types;
+  vector<int> m_ready;
+  // one handle per worker
+  vector<DwarfFile *> m_files;
+  int m_next_file;
+  int m_next_slot;
+  bool m_stop;
+  // decoded but not yet imported CUs
+  Semaphore m_window;
+  // signaled each time a CU is decoded
+  Semaphore m_done;
+  WorkerThreads m_workers;
+
+  // no copying or assignment
+  TypeDecoder(TypeDecoder const &);
+  TypeDecoder &operator=(TypeDecoder const &);
+
+  void open_files(size_t const nb_files) throw();
+
+  void close_files(void) throw();
+
+  static void run_worker(void *arg) throw();
+
+  void decode_units(Dwarf_Debug dbg) throw();
+};
+
+#endif // IDADWARF_TYPE_DECODER_HPP
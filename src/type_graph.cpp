@@ -0,0 +1,482 @@
+#include "type_graph.hpp"
+
+// local headers
+#include "die_cache.hpp"
+
+extern DieCache diecache;
+extern StringPool die_names;
+
+// referenced types deeper than that only count as a truncation mark
+// (a chain of pointers/typedefs can loop through subroutine types)
+#define MAX_HASH_DEPTH 16
+#define TRUNCATED_HASH 0x7472756e63617465ULL
+
+// 64-bit finalizer (from MurmurHash3)
+static uint64 mix_hash(uint64 value) throw()
+{
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+
+  return value;
+}
+
+static uint64 combine_hash(uint64 const hash, uint64 const value) throw()
+{
+  return (hash ^ mix_hash(value)) * 0x100000001b3ULL;
+}
+
+static uint64 hash_name(char const *name) throw()
+{
+  return (name == NULL) ? 0 : StringPool::hash(name, strlen(name));
+}
+
+void TypeGraph::clear(void) throw()
+{
+  m_nodes.clear();
+  m_members.clear();
+  m_node_idxs.clear();
+}
+
+uint8 TypeGraph::get_kind(Dwarf_Half const tag) throw()
+{
+  uint8 kind = NODE_UNKNOWN;
+
+  switch(tag)
+  {
+  case DW_TAG_base_type:
+    kind = NODE_BASE;
+    break;
+  case DW_TAG_unspecified_type:
+    kind = NODE_UNSPECIFIED;
+    break;
+  case DW_TAG_const_type:
+    kind = NODE_CONST;
+    break;
+  case DW_TAG_volatile_type:
+    kind = NODE_VOLATILE;
+    break;
+  case DW_TAG_pointer_type:
+    kind = NODE_POINTER;
+    break;
+  case DW_TAG_typedef:
+    kind = NODE_TYPEDEF;
+    break;
+  case DW_TAG_array_type:
+    kind = NODE_ARRAY;
+    break;
+  case DW_TAG_structure_type:
+    kind = NODE_STRUCT;
+    break;
+  case DW_TAG_union_type:
+    kind = NODE_UNION;
+    break;
+  case DW_TAG_enumeration_type:
+    kind = NODE_ENUM;
+    break;
+  case DW_TAG_subroutine_type:
+    kind = NODE_SUBROUTINE;
+    break;
+  default:
+    break;
+  }
+
+  return kind;
+}
+
+uint32 TypeGraph::build_node(DieHolder &type_holder)
+{
+  uint32 const node_idx = get_node(type_holder.get_offset());
+
+  if(m_nodes[node_idx].kind == NODE_UNKNOWN)
+  {
+    DecodedTypes types;
+    // same decoding as the worker threads
+    bool const decoded = decode_type_die(type_holder.get_dbg(), type_holder.get_die(),
+                                         type_holder.get_tag(), types);
+
+    profiler.count(COUNTER_DWARF_CALLS, types.nb_dwarf_calls);
+    CHECK_DWERR2(!decoded, NULL, "cannot decode type DIE at offset 0x%" DW_PR_DUx,
+                 type_holder.get_offset());
+    if(!types.types.empty())
+    {
+      import_type(types, types.types[0]);
+    }
+  }
+
+  return node_idx;
+}
+
+void TypeGraph::import_types(DecodedTypes const &types)
+{
+  // the libdwarf calls of the worker threads
+  profiler.count(COUNTER_DWARF_CALLS, types.nb_dwarf_calls);
+
+  for(size_t type_idx = 0; type_idx < types.types.size(); ++type_idx)
+  {
+    if(import_type(types, types.types[type_idx]))
+    {
+      profiler.count(COUNTER_DECODED_TYPES);
+    }
+  }
+}
+
+uint32 TypeGraph::find_node(Dwarf_Off const offset) const throw()
+{
+  uint32 const *node_idx = m_node_idxs.find(offset);
+
+  return (node_idx == NULL || m_nodes[*node_idx].kind == NODE_UNKNOWN) ?
+    NO_NODE : *node_idx;
+}
+
+uint32 TypeGraph::find_or_build_node(Dwarf_Debug dbg, Dwarf_Off const offset)
+{
+  uint32 const node_idx = get_node(offset);
+
+  if(m_nodes[node_idx].kind == NODE_UNKNOWN && !m_nodes[node_idx].unhashable)
+  {
+    build_ref_node(dbg, node_idx);
+  }
+
+  return (m_nodes[node_idx].kind == NODE_UNKNOWN) ? NO_NODE : node_idx;
+}
+
+uint32 TypeGraph::get_node(Dwarf_Off const offset)
+{
+  bool added = false;
+  uint32 &node_idx = m_node_idxs.get(offset, &added);
+
+  if(added)
+  {
+    TypeNode node;
+
+    memset(&node, 0, sizeof(node));
+    node.offset = offset;
+    node.type = NO_NODE;
+    node.kind = NODE_UNKNOWN;
+
+    node_idx = static_cast<uint32>(m_nodes.size());
+    m_nodes.push_back(node);
+  }
+
+  return node_idx;
+}
+
+bool TypeGraph::import_type(DecodedTypes const &types, DecodedType const &type)
+{
+  uint32 const node_idx = get_node(type.offset);
+  bool imported = false;
+
+  // already built (or known to be unreadable)
+  if(m_nodes[node_idx].kind == NODE_UNKNOWN && !m_nodes[node_idx].unhashable)
+  {
+    // get_node can add nodes, no reference to m_nodes is kept
+    uint32 const type_node_idx = type.has_type ? get_node(type.type_offset) : NO_NODE;
+    uint32 const first_member = static_cast<uint32>(m_members.size());
+
+    if(type.signature != 0 && count_dwarf_error(DWERR_UNKNOWN_SIGNATURE))
+    {
+      MSG("no type unit for the signature 0x%" FMT_64 "x of DIE at offset 0x%" DW_PR_DUx "\n",
+          type.signature, type.offset);
+    }
+
+    for(size_t idx = 0; idx < type.nb_members; ++idx)
+    {
+      DecodedMember const &decoded_member = types.members[type.first_member + idx];
+      TypeMember member;
+
+      member.offset = decoded_member.offset;
+      member.name_id = decoded_member.has_name ?
+        die_names.intern(decoded_member.name.c_str()) : StringPool::NO_STRING;
+      member.name = die_names.get(member.name_id);
+      if(type.kind == NODE_ENUM)
+      {
+        member.value = decoded_member.value;
+      }
+      else
+      {
+        member.member_offset = decoded_member.member_offset;
+      }
+      member.type = decoded_member.has_type ? get_node(decoded_member.type_offset) : NO_NODE;
+      m_members.push_back(member);
+    }
+
+    m_nodes[node_idx].name = type.has_name ? die_names.get_str(type.name.c_str()) : NULL;
+    m_nodes[node_idx].byte_size = type.byte_size;
+    m_nodes[node_idx].encoding = type.encoding;
+    m_nodes[node_idx].nb_elems = type.nb_elems;
+    m_nodes[node_idx].type = type_node_idx;
+    m_nodes[node_idx].declaration = type.declaration;
+    m_nodes[node_idx].first_member = first_member;
+    m_nodes[node_idx].nb_members = static_cast<uint32>(type.nb_members);
+    m_nodes[node_idx].ellipsis = type.ellipsis;
+    m_nodes[node_idx].kind = type.kind;
+    imported = true;
+  }
+
+  return imported;
+}
+
+
+uint64 TypeGraph::get_hash(Dwarf_Debug dbg, uint32 const node_idx)
+{
+  if(!m_nodes[node_idx].hashed)
+  {
+    bool unhashable = false;
+    bool truncated = false;
+    uint64 hash = get_ref_hash(dbg, node_idx, 0, &unhashable, &truncated);
+    // get_ref_hash can add nodes, keep a copy
+    TypeNode const node = m_nodes[node_idx];
+
+    // only structs/unions/enums are not completely hashed as references
+    if(node.kind == NODE_STRUCT || node.kind == NODE_UNION || node.kind == NODE_ENUM)
+    {
+      for(uint32 idx = 0; idx < node.nb_members; ++idx)
+      {
+        TypeMember const member = get_member(node, idx);
+
+        hash = combine_hash(hash, hash_name(member.name));
+        if(node.kind == NODE_ENUM)
+        {
+          hash = combine_hash(hash, static_cast<uint64>(member.value));
+        }
+        else
+        {
+          hash = combine_hash(hash, member.member_offset);
+          hash = combine_hash(hash, get_ref_hash(dbg, member.type, 1, &unhashable, &truncated));
+        }
+      }
+    }
+
+    m_nodes[node_idx].hash = hash;
+    m_nodes[node_idx].hashed = true;
+    m_nodes[node_idx].unhashable = unhashable;
+  }
+
+  return m_nodes[node_idx].hash;
+}
+
+uint64 TypeGraph::get_members_hash(TypeNode const &node) const throw()
+{
+  uint64 hash = combine_hash(0, node.kind);
+
+  for(uint32 idx = 0; idx < node.nb_members; ++idx)
+  {
+    TypeMember const &member = m_members[node.first_member + idx];
+
+    hash = combine_hash(hash, hash_name(member.name));
+    hash = combine_hash(hash, (node.kind == NODE_ENUM) ?
+                        static_cast<uint64>(member.value) : member.member_offset);
+  }
+
+  // 0 means no hash in the DIE cache
+  return (hash != 0) ? hash : 1;
+}
+
+bool TypeGraph::may_be_equal(uint32 const ordinal, TypeNode const &node) const throw()
+{
+  uint64 const type_hash = diecache.get_type_hash(ordinal);
+
+  return (type_hash == 0 || type_hash == get_members_hash(node));
+}
+
+bool TypeGraph::same_members(Dwarf_Debug dbg, uint32 const node_idx, uint32 const other_idx)
+{
+  // same_ref_type can add nodes, keep copies
+  TypeNode const node = m_nodes[node_idx];
+  TypeNode const other_node = m_nodes[other_idx];
+  // names are interned, comparing the pointers is enough
+  bool same = (node.kind == other_node.kind && node.name == other_node.name &&
+               node.byte_size == other_node.byte_size &&
+               node.nb_members == other_node.nb_members);
+
+  for(uint32 idx = 0; same && idx < node.nb_members; ++idx)
+  {
+    TypeMember const member = get_member(node, idx);
+    TypeMember const other_member = get_member(other_node, idx);
+
+    if(node.kind == NODE_ENUM)
+    {
+      same = (member.name == other_member.name && member.value == other_member.value);
+    }
+    else
+    {
+      same = (member.name == other_member.name &&
+              member.member_offset == other_member.member_offset &&
+              same_ref_type(dbg, member.type, other_member.type));
+    }
+  }
+
+  return same;
+}
+
+// the modifiers, typedefs and arrays are followed in both chains,
+// so the anonymous structs/unions/enums they lead to are compared
+// with their structural hash, not only with their name
+bool TypeGraph::same_ref_type(Dwarf_Debug dbg, uint32 node_idx, uint32 other_idx)
+{
+  bool same = true;
+  bool done = false;
+
+  for(int depth = 0; same && !done && depth < MAX_HASH_DEPTH; ++depth)
+  {
+    if(node_idx == other_idx)
+    {
+      done = true;
+    }
+    else if(node_idx == NO_NODE || other_idx == NO_NODE)
+    {
+      same = false;
+    }
+    else
+    {
+      // get_hash can add nodes, keep copies
+      TypeNode const node = m_nodes[node_idx];
+      TypeNode const other_node = m_nodes[other_idx];
+
+      same = (node.kind == other_node.kind && node.name == other_node.name &&
+              node.byte_size == other_node.byte_size);
+
+      switch(node.kind)
+      {
+      case NODE_ARRAY:
+        same = (same && node.nb_elems == other_node.nb_elems);
+        // FALLTHROUGH
+      case NODE_CONST:
+      case NODE_VOLATILE:
+      case NODE_POINTER:
+      case NODE_TYPEDEF:
+        node_idx = node.type;
+        other_idx = other_node.type;
+        break;
+      case NODE_STRUCT:
+      case NODE_UNION:
+      case NODE_ENUM:
+        same = (same && get_hash(dbg, node_idx) == get_hash(dbg, other_idx) &&
+                !m_nodes[node_idx].unhashable && !m_nodes[other_idx].unhashable);
+        done = true;
+        break;
+      default:
+        {
+          bool unhashable = false;
+          bool truncated = false;
+
+          same = (same &&
+                  get_ref_hash(dbg, node_idx, 0, &unhashable, &truncated) ==
+                  get_ref_hash(dbg, other_idx, 0, &unhashable, &truncated) &&
+                  !unhashable && !truncated);
+          done = true;
+        }
+        break;
+      }
+    }
+  }
+
+  // a chain too long to be followed is not the same
+  return (same && done);
+}
+
+// a referenced type that cannot be read does not abort the hash
+// of the referencing type, its node is marked unhashable instead
+void TypeGraph::build_ref_node(Dwarf_Debug dbg, uint32 const node_idx)
+{
+  try
+  {
+    DieHolder type_holder(dbg, m_nodes[node_idx].offset);
+
+    build_node(type_holder);
+  }
+  catch(DieException const &exc)
+  {
+    if(count_dwarf_error(DWERR_SKIPPED_DIE))
+    {
+      MSG("cannot read referenced type (not hashed): %s\n", exc.what());
+    }
+    m_nodes[node_idx].unhashable = true;
+  }
+}
+
+// hash of a type when referenced by another one
+// the types past the depth limit are not read at all.
+// the hash only depends on the depth if a reference was truncated,
+// otherwise it is computed once per node.
+uint64 TypeGraph::get_ref_hash(Dwarf_Debug dbg, uint32 const node_idx, int const depth,
+                               bool *unhashable, bool *truncated)
+{
+  uint64 hash = 0;
+
+  if(node_idx != NO_NODE && depth >= MAX_HASH_DEPTH)
+  {
+    hash = TRUNCATED_HASH;
+    *truncated = true;
+  }
+  else if(node_idx != NO_NODE && m_nodes[node_idx].ref_hashed)
+  {
+    hash = m_nodes[node_idx].ref_hash;
+    *unhashable = (*unhashable || m_nodes[node_idx].ref_unhashable);
+  }
+  else if(node_idx != NO_NODE)
+  {
+    bool ref_unhashable = false;
+    bool ref_truncated = false;
+
+    if(m_nodes[node_idx].kind == NODE_UNKNOWN && !m_nodes[node_idx].unhashable)
+    {
+      build_ref_node(dbg, node_idx);
+    }
+
+    TypeNode const node = m_nodes[node_idx];
+
+    ref_unhashable = node.unhashable;
+
+    hash = combine_hash(hash, node.kind);
+    hash = combine_hash(hash, hash_name(node.name));
+    hash = combine_hash(hash, node.byte_size);
+
+    switch(node.kind)
+    {
+    case NODE_BASE:
+      hash = combine_hash(hash, static_cast<uint64>(node.encoding));
+      break;
+    case NODE_ARRAY:
+      hash = combine_hash(hash, static_cast<uint64>(node.nb_elems));
+      // FALLTHROUGH
+    case NODE_CONST:
+    case NODE_VOLATILE:
+    case NODE_POINTER:
+    case NODE_TYPEDEF:
+      hash = combine_hash(hash, get_ref_hash(dbg, node.type, depth + 1,
+                                             &ref_unhashable, &ref_truncated));
+      break;
+    case NODE_SUBROUTINE:
+      hash = combine_hash(hash, get_ref_hash(dbg, node.type, depth + 1,
+                                             &ref_unhashable, &ref_truncated));
+      hash = combine_hash(hash, node.ellipsis);
+      for(uint32 idx = 0; idx < node.nb_members; ++idx)
+      {
+        TypeMember const param = get_member(node, idx);
+
+        hash = combine_hash(hash, get_ref_hash(dbg, param.type, depth + 1,
+                                               &ref_unhashable, &ref_truncated));
+      }
+      break;
+    default:
+      // structs/unions/enums are only referenced by their name
+      break;
+    }
+
+    if(!ref_truncated)
+    {
+      m_nodes[node_idx].ref_hash = hash;
+      m_nodes[node_idx].ref_hashed = true;
+      m_nodes[node_idx].ref_unhashable = ref_unhashable;
+    }
+
+    *unhashable = (*unhashable || ref_unhashable);
+    *truncated = (*truncated || ref_truncated);
+  }
+
+  return hash;
+}
@@ -0,0 +1,167 @@
+#ifndef IDADWARF_TYPE_GRAPH_HPP
+#define IDADWARF_TYPE_GRAPH_HPP
+
+// additional libs headers
+#include <dwarf.h>
+#include <libdwarf.h>
+
+// local headers
+#include "die_utils.hpp"
+#include "offset_table.hpp"
+#include "string_pool.hpp"
+#include "type_decoder.hpp"
+
+// compact copy of the type DIEs
+// each type DIE is read only once from libdwarf,
+// the next passes (second pass, equivalence checks...) use the nodes.
+// warning: nodes are added while processing the types,
+// keep node indexes or copies, not references!
+
+enum type_node_kind { NODE_UNKNOWN, NODE_BASE, NODE_UNSPECIFIED,
+                      NODE_CONST, NODE_VOLATILE, NODE_POINTER,
+                      NODE_TYPEDEF, NODE_ARRAY, NODE_STRUCT, NODE_UNION,
+                      NODE_ENUM, NODE_SUBROUTINE };
+
+#define NO_NODE 0xFFFFFFFF
+
+// struct/union member, enumerator or subroutine parameter
+struct TypeMember
+{
+  Dwarf_Off offset; // DIE offset
+  char const *name; // interned, can be NULL
+  uint32 name_id; // in the DIE names pool
+  union
+  {
+    Dwarf_Unsigned member_offset; // 0 for union members
+    Dwarf_Signed value; // enumerator value
+  };
+  uint32 type; // node index (NO_NODE for enumerators)
+};
+
+struct TypeNode
+{
+  Dwarf_Off offset; // DIE offset
+  char const *name; // interned, can be NULL
+  Dwarf_Unsigned byte_size; // 0 if unknown
+  Dwarf_Signed encoding; // base types only
+  Dwarf_Signed nb_elems; // arrays only (0 if unknown)
+  uint64 hash; // structural hash (see TypeGraph::get_hash)
+  uint64 ref_hash; // hash as a referenced type (see TypeGraph::get_ref_hash)
+  uint32 type; // referenced node index, NO_NODE if none
+  uint32 first_member; // index in the members
+  uint32 nb_members;
+  uint8 kind; // see type_node_kind
+  bool declaration; // incomplete struct/union
+  bool ellipsis; // subroutine with unspecified parameters
+  bool hashed;
+  bool unhashable; // a (referenced) type DIE could not be read
+  bool ref_hashed; // the referenced types were not truncated
+  bool ref_unhashable;
+};
+
+class TypeGraph
+{
+public:
+  TypeGraph(void) throw()
+  {
+
+  }
+
+  virtual ~TypeGraph(void) throw()
+  {
+
+  }
+
+  void clear(void) throw();
+
+  size_t size(void) const throw()
+  {
+    return m_nodes.size();
+  }
+
+  // node kind of a type DIE tag (NODE_UNKNOWN if not a type)
+  static uint8 get_kind(Dwarf_Half const tag) throw();
+
+  // decode a type DIE to fill its node (only the first time)
+  // returns the node index
+  uint32 build_node(DieHolder &type_holder);
+
+  // fill the nodes of the types decoded by the worker threads
+  // (the nodes already built are kept)
+  void import_types(DecodedTypes const &types);
+
+  // returns NO_NODE if the DIE has no built node
+  uint32 find_node(Dwarf_Off const offset) const throw();
+
+  // same, but a node not built yet is read from libdwarf
+  // (e.g. the types of the CUs restored from the persistent index)
+  // returns NO_NODE if the DIE cannot be read
+  uint32 find_or_build_node(Dwarf_Debug dbg, Dwarf_Off const offset);
+
+  TypeNode const &operator[](uint32 const idx) const throw()
+  {
+    return m_nodes[idx];
+  }
+
+  TypeMember get_member(TypeNode const &node, uint32 const idx) const throw()
+  {
+    return m_members[node.first_member + idx];
+  }
+
+  // DIE offset of the referenced type (0 if none)
+  Dwarf_Off get_type_offset(uint32 const idx) const throw()
+  {
+    return (idx == NO_NODE) ? 0 : m_nodes[idx].offset;
+  }
+
+  // structural hash of a type node, computed only once:
+  // kind, name, size, members (name, offset or value) and
+  // the referenced types (only their name for the structs/unions/enums)
+  // equal types from different CUs have the same hash (dedupe mode).
+  // referenced nodes not built yet are read from libdwarf,
+  // the node is unhashable if one of them cannot be read.
+  uint64 get_hash(Dwarf_Debug dbg, uint32 const node_idx);
+
+  // hash of what StrucCmp/EnumCmp compare: the kind and the members
+  // (name, and offset or value), but not the member types.
+  // it is kept with the DIE cache of the struct/union/enum
+  // (and by the persistent index), never 0.
+  uint64 get_members_hash(TypeNode const &node) const throw();
+
+  // same kind, name, size and members (name, offset or value, type)?
+  // the member types are compared with their hashes (see same_ref_type)
+  bool same_members(Dwarf_Debug dbg, uint32 const node_idx, uint32 const other_idx);
+
+  // can the struct/union or enum with this ordinal be equal to the node type?
+  // (types without a members hash in the DIE cache might be)
+  bool may_be_equal(uint32 const ordinal, TypeNode const &node) const throw();
+
+private:
+  qvector<TypeNode> m_nodes;
+  qvector<TypeMember> m_members;
+  // node indexes, by DIE offset
+  // (nodes only referenced and not built yet are NODE_UNKNOWN)
+  OffsetTable<uint32> m_node_idxs;
+
+  // no copying or assignment
+  TypeGraph(TypeGraph const &);
+  TypeGraph &operator=(TypeGraph const &);
+
+  // returns the node index for the DIE offset,
+  // adds an empty node if needed
+  uint32 get_node(Dwarf_Off const offset);
+
+  // fill the node of a decoded type (unless it is already built)
+  // returns true if it was filled
+  bool import_type(DecodedTypes const &types, DecodedType const &type);
+
+  void build_ref_node(Dwarf_Debug dbg, uint32 const node_idx);
+
+  bool same_ref_type(Dwarf_Debug dbg, uint32 node_idx, uint32 other_idx);
+
+  // the hash of a type without truncated references is kept in its node
+  uint64 get_ref_hash(Dwarf_Debug dbg, uint32 const node_idx, int const depth,
+                      bool *unhashable, bool *truncated);
+};
+
+#endif // IDADWARF_TYPE_GRAPH_HPP
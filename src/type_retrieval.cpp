@@ -9,10 +9,324 @@
 
 // local headers
 #include "iterators.hpp"
+#include "type_graph.hpp"
 #include "type_utils.hpp"
 
 extern DieCache diecache;
 
+// type DIEs already read, for the next passes
+static TypeGraph type_graph;
+
+// struct/union members with a simple (i.e. not BT_COMPLEX) type, by type ordinal
+// filled when the members are added, to only update the right members
+// when a type changes
+class MemberTypes
+{
+public:
+  typedef pair<tid_t, tid_t> Member; // struct/union id, member id
+  typedef qvector<Member> Members;
+
+  void add(uint32 const ordinal, tid_t const struc_id, tid_t const member_id)
+  {
+    m_members[ordinal].push_back(make_pair(struc_id, member_id));
+  }
+
+  Members const *get(uint32 const ordinal) const throw()
+  {
+    MapMembers::const_iterator iter = m_members.find(ordinal);
+
+    return (iter == m_members.end()) ? NULL : &iter->second;
+  }
+
+  void clear(void) throw()
+  {
+    m_members.clear();
+  }
+
+private:
+  typedef map<uint32, Members> MapMembers;
+  MapMembers m_members;
+};
+
+static MemberTypes member_types;
+
+// final types of the second pass and of the pointer updates
+// a type can be changed several times, idati only gets the last one:
+// the staged types are read instead of the idati ones,
+// and all written when flushing (by increasing ordinal).
+// the first pass types are not staged: the IDA type calls of the next DIEs
+// (member types, type sizes, function arguments) read them in idati.
+// they are written once per type, with the name probing done by reads
+// (see set_simple_die_type), but the anonymous typedef renames
+// delete the type then set it again (COUNTER_TYPE_WRITES counts all
+// the writes, COUNTER_STAGED_WRITES the stage ones).
+class TypeStage
+{
+public:
+  struct StagedType
+  {
+    qstring name;
+    qtype old_type; // type in idati when first staged
+    qtype type;
+    qtype fields;
+    bool written;
+  };
+
+  // the (non NULL) fields are only used for complex types
+  void replace(uint32 const ordinal, char const *name, type_t const *type,
+               p_list const *fields=NULL);
+
+  // staged type, or the idati one if none
+  bool get_type(uint32 const ordinal, type_t const **type,
+                p_list const **fields=NULL) const;
+
+  StagedType const *find(uint32 const ordinal) const throw()
+  {
+    MapTypes::const_iterator iter = m_types.find(ordinal);
+
+    return (iter == m_types.end()) ? NULL : &iter->second;
+  }
+
+  // write the staged types in idati
+  void flush(void);
+
+  void clear(void) throw()
+  {
+    m_types.clear();
+  }
+
+private:
+  typedef map<uint32, StagedType> MapTypes;
+  MapTypes m_types;
+};
+
+void TypeStage::replace(uint32 const ordinal, char const *name, type_t const *type,
+                        p_list const *fields)
+{
+  MapTypes::iterator iter = m_types.find(ordinal);
+
+  if(iter == m_types.end())
+  {
+    type_t const *old_type = NULL;
+
+    iter = m_types.insert(make_pair(ordinal, StagedType())).first;
+    if(get_numbered_type(idati, ordinal, &old_type) && old_type != NULL)
+    {
+      iter->second.old_type = old_type;
+    }
+  }
+
+  iter->second.name = name;
+  iter->second.type = type;
+  iter->second.fields.clear();
+  if(fields != NULL)
+  {
+    iter->second.fields = fields;
+  }
+  iter->second.written = false;
+}
+
+bool TypeStage::get_type(uint32 const ordinal, type_t const **type,
+                         p_list const **fields) const
+{
+  StagedType const *staged = find(ordinal);
+  bool ok = (staged != NULL);
+
+  if(ok)
+  {
+    *type = staged->type.c_str();
+    if(fields != NULL)
+    {
+      *fields = staged->fields.empty() ? NULL : staged->fields.c_str();
+    }
+  }
+  else
+  {
+    ok = get_numbered_type(idati, ordinal, type, fields);
+  }
+
+  return ok;
+}
+
+void TypeStage::flush(void)
+{
+  uint32 nb_written = 0;
+
+  for(MapTypes::iterator iter = m_types.begin(); iter != m_types.end(); ++iter)
+  {
+    uint32 const ordinal = iter->first;
+    StagedType &staged = iter->second;
+    p_list const *fields = staged.fields.empty() ? NULL : staged.fields.c_str();
+
+    profiler.count(COUNTER_TYPE_WRITES);
+    profiler.count(COUNTER_STAGED_WRITES);
+    staged.written = set_numbered_type(idati, ordinal, NTF_REPLACE, staged.name.c_str(),
+                                       staged.type.c_str(), fields);
+
+    // some types cannot be replaced in place
+    if(!staged.written && del_numbered_type(idati, ordinal))
+    {
+      profiler.count(COUNTER_TYPE_WRITES, 2);
+      profiler.count(COUNTER_STAGED_WRITES, 2);
+      staged.written = set_numbered_type(idati, ordinal, NTF_REPLACE, staged.name.c_str(),
+                                         staged.type.c_str(), fields);
+    }
+
+    if(staged.written)
+    {
+      nb_written++;
+    }
+    else
+    {
+      MSG("failed to write the staged type name='%s' ordinal=%u\n",
+          staged.name.c_str(), ordinal);
+    }
+  }
+
+  DEBUG("%u staged types written\n", nb_written);
+}
+
+static TypeStage type_stage;
+
+// content-addressed ordinals, for the dedupe mode:
+// the same types from all the CUs get the same ordinal
+// without any name probing or member comparison
+class DedupTypes
+{
+public:
+  // the simple types are the same if they have
+  // the same requested name and type string.
+  // returns the ordinal for the simple type (0 if not added yet)
+  uint32 &get_simple(char const *name, qtype const &ida_type)
+  {
+    qstring key(name == NULL ? "A" : "N");
+    uint32 id = 0;
+
+    if(name != NULL)
+    {
+      key.append(name);
+    }
+
+    // no '\0' in the key
+    key.append('\x01');
+    key.append(reinterpret_cast<char const *>(ida_type.c_str()));
+    id = m_keys.intern(key.c_str(), key.length());
+
+    if(id >= m_ordinals.size())
+    {
+      m_ordinals.resize(id + 1, 0);
+    }
+
+    return m_ordinals[id];
+  }
+
+  // the structs/unions/enums are the same if they have the same hash
+  // and the same members (with the same member types).
+  // returns the node of the same type (NO_NODE if not added yet)
+  uint32 find_complex(TypeGraph &type_graph, Dwarf_Debug dbg, uint32 const node_idx) const
+  {
+    TypeNode const &node = type_graph[node_idx];
+    uint32 const *same_idx = node.unhashable ? NULL : m_complex_nodes.find(node.hash);
+
+    return (same_idx != NULL && type_graph.same_members(dbg, *same_idx, node_idx)) ?
+      *same_idx : NO_NODE;
+  }
+
+  void add_complex(TypeNode const &node, uint32 const node_idx) throw()
+  {
+    if(!node.unhashable)
+    {
+      bool added = false;
+      uint32 &first_idx = m_complex_nodes.get(node.hash, &added);
+
+      // keep the first type with this hash
+      if(added)
+      {
+        first_idx = node_idx;
+      }
+    }
+  }
+
+  void clear(void) throw()
+  {
+    m_keys.clear();
+    m_ordinals.clear();
+    m_complex_nodes.clear();
+  }
+
+private:
+  StringPool m_keys;
+  // simple type ordinals, by key id
+  qvector<uint32> m_ordinals;
+  // struct/union/enum node indexes, by hash
+  OffsetTable<uint32> m_complex_nodes;
+};
+
+static DedupTypes dedup_types;
+static bool dedupe_mode = false;
+
+// set_simple_die_type, with the dedupe mode cache
+// a type with placeholders (BT_UNKNOWN fixed by the second pass)
+// is never shared: the second pass would replace it for all its users
+static bool set_die_type(char const *name, qtype const &ida_type, uint32 *ordinal,
+                         bool const second_pass=false)
+{
+  bool saved = false;
+
+  // only for new types, not for type replacements
+  if(dedupe_mode && *ordinal == 0 && !second_pass)
+  {
+    uint32 &dedup_ordinal = dedup_types.get_simple(name, ida_type);
+
+    saved = (dedup_ordinal != 0);
+    if(saved)
+    {
+      *ordinal = dedup_ordinal;
+    }
+    else
+    {
+      saved = set_simple_die_type(name, ida_type, ordinal);
+      if(saved)
+      {
+        dedup_ordinal = *ordinal;
+      }
+    }
+  }
+  else
+  {
+    saved = set_simple_die_type(name, ida_type, ordinal);
+  }
+
+  return saved;
+}
+
+// modifiers and arrays copy the type of their base (see make_new_type),
+// with its placeholders if the base type needs the second pass
+static bool has_placeholders(die_cache const &cache)
+{
+  die_cache base_cache;
+
+  return (cache.second_pass ||
+          (cache.base_ordinal != 0 &&
+           diecache.get_cache_by_ordinal(cache.base_ordinal, &base_cache) &&
+           base_cache.second_pass));
+}
+
+// get the cache of a referenced type DIE
+// (the DIE is processed if it is not in cache)
+static bool get_ref_type_cache(Dwarf_Debug dbg, Dwarf_Off const offset,
+                               die_cache *cache)
+{
+  if(!diecache.in_cache(offset))
+  {
+    DieHolder new_die(dbg, offset);
+
+    try_visit_type_die(new_die);
+  }
+
+  return diecache.get_cache_type(offset, cache);
+}
+
 // size is in bytes
 static flags_t get_enum_size(Dwarf_Unsigned const size)
 {
@@ -27,9 +341,10 @@ static flags_t get_enum_size(Dwarf_Unsigned const size)
   return flag;
 }
 
-static void process_enum(DieHolder &enumeration_holder)
+static void process_enum(DieHolder &enumeration_holder, uint32 const node_idx)
 {
-  char const *name = enumeration_holder.get_name();
+  TypeNode const node = type_graph[node_idx];
+  char const *name = node.name;
   enum_t enum_id = BADNODE;
   uint32 ordinal = 0;
   EnumCmp::Ptr enum_cmp;
@@ -41,11 +356,11 @@ static void process_enum(DieHolder &enumeration_holder)
   else
   {
     // anonymous enum, find by first const name
-    enum_cmp.reset(new EnumCmp(enumeration_holder));
+    enum_cmp.reset(new EnumCmp(type_graph, node));
   }
 
   if(enum_cmp.get() != NULL &&
-     enum_cmp->equal(enumeration_holder))
+     enum_cmp->equal(type_graph, node))
   {
     enum_id = enum_cmp->get_enum_id();
   }
@@ -56,21 +371,16 @@ static void process_enum(DieHolder &enumeration_holder)
     // bytesize is mandatory
     Dwarf_Unsigned byte_size = enumeration_holder.get_bytesize();
 
-    enum_id = add_dup_enum(enumeration_holder, name, get_enum_size(byte_size));
+    enum_id = add_dup_enum(type_graph, node, name, get_enum_size(byte_size));
     DEBUG("added an enum name='%s' bytesize=%" DW_PR_DUu "\n", name, byte_size);
 
-    for(DieChildIterator iter(enumeration_holder, DW_TAG_enumerator);
-        *iter != NULL; ++iter)
+    for(uint32 idx = 0; idx < node.nb_members; ++idx)
     {
-      DieHolder *child_holder = *iter;
-      char const *child_name = NULL;
-      Dwarf_Signed value = 0;
-
-      child_name = child_holder->get_name();
-      value = child_holder->get_attr_small_val(DW_AT_const_value);
-      add_const(enum_id, child_name, static_cast<uval_t>(value));
-      DEBUG("added an enumerator name='%s' value=%" DW_PR_DSd "\n", child_name, value);
-      child_holder->cache_useless();
+      TypeMember const child = type_graph.get_member(node, idx);
+
+      add_const(enum_id, child.name, static_cast<uval_t>(child.value));
+      DEBUG("added an enumerator name='%s' value=%" DW_PR_DSd "\n", child.name, child.value);
+      diecache.cache_useless(child.offset);
     }
   }
 
@@ -191,7 +501,7 @@ static void process_base_type(DieHolder &type_holder)
   if(!ida_type.empty())
   {
     uint32 ordinal = 0;
-    saved = set_simple_die_type(name, ida_type, &ordinal);
+    saved = set_die_type(name, ida_type, &ordinal);
     if(!saved)
     {
       MSG("failed to save base type name='%s' ordinal=%u\n", name, ordinal);
@@ -215,7 +525,7 @@ static bool add_unspecified_type(die_cache *cache)
   bool saved = false;
 
   type.append(BTF_VOID);
-  saved = set_simple_die_type("void", type, &new_ordinal);
+  saved = set_die_type("void", type, &new_ordinal);
   if(saved)
   {
     DEBUG("added unspecified type ordinal=%u\n", new_ordinal);
@@ -252,11 +562,9 @@ static bool look_ref_type(DieHolder &modifier_holder, die_cache *cache)
     // need to find the original type?
   {
     Dwarf_Off offset = modifier_holder.get_ref_from_attr(DW_AT_type);
-    DieHolder new_die(modifier_holder.get_dbg(), offset);
 
     // found die may not be in cache
-    try_visit_type_die(new_die);
-    found = new_die.get_cache_type(cache);
+    found = get_ref_type_cache(modifier_holder.get_dbg(), offset, cache);
   }
 
   return found;
@@ -322,7 +630,7 @@ static void process_typed_modifier(DieHolder &modifier_holder, die_cache const *
     {
       uint32 ordinal = 0;
 
-      ok = set_simple_die_type(NULL, new_type, &ordinal);
+      ok = set_die_type(NULL, new_type, &ordinal, has_placeholders(*cache));
       if(ok)
       {
         DEBUG("added modifier from original type='%s' ordinal=%u\n", type_name, ordinal);
@@ -371,6 +679,7 @@ static void process_typed_typedef(DieHolder &typedef_holder, uint32 const type_o
     {
       // there is no NTF_NOBASE support in rename_named_type
       // I need to do everything my way...
+      // (a first pass rename, written at once: delete then set)
       type_t const *type = NULL;
       // there should be no complex types with an anonymous name
       // so, we can simply get the type here, not the fields
@@ -379,6 +688,7 @@ static void process_typed_typedef(DieHolder &typedef_holder, uint32 const type_o
       {
         qtype existing_type(type);
 
+        profiler.count(COUNTER_TYPE_WRITES);
         ok = del_numbered_type(idati, type_ordinal);
         if(ok)
         {
@@ -387,6 +697,7 @@ static void process_typed_typedef(DieHolder &typedef_holder, uint32 const type_o
           // make the deleted type refer to the typedef type
           if(ok && type_ordinal != ordinal)
           {
+            profiler.count(COUNTER_TYPE_WRITES);
             set_type_alias(idati, type_ordinal, ordinal);
           }
         }
@@ -405,7 +716,8 @@ static void process_typed_typedef(DieHolder &typedef_holder, uint32 const type_o
 #endif
     else
     {
-      ordinal = get_equivalent_typedef_ordinal(typedef_holder, type_ordinal);
+      ordinal = get_equivalent_typedef_ordinal(type_graph, typedef_holder.get_dbg(),
+                                               name, type_ordinal);
 
       // got the ordinal of the equivalent typedef?
       if(ordinal != 0)
@@ -417,7 +729,7 @@ static void process_typed_typedef(DieHolder &typedef_holder, uint32 const type_o
         qtype typedef_type;
 
         make_new_type(typedef_type, NULL, type_ordinal);
-        ok = set_simple_die_type(name, typedef_type, &ordinal);
+        ok = set_die_type(name, typedef_type, &ordinal);
       }
     }
 
@@ -448,16 +760,12 @@ static void process_typedef(DieHolder &typedef_holder)
 }
 
 // TODO: handle multimensional arrays
-static void process_array(DieHolder &array_holder)
+static void process_array(DieHolder &array_holder, uint32 const node_idx)
 {
   Dwarf_Off offset = array_holder.get_ref_from_attr(DW_AT_type);
-  DieHolder new_die(array_holder.get_dbg(), offset);
   die_cache cache;
-  bool ok = false;
-
   // found die may not be in cache
-  try_visit_type_die(new_die);
-  ok = new_die.get_cache_type(&cache);
+  bool ok = get_ref_type_cache(array_holder.get_dbg(), offset, &cache);
   if(ok)
   {
     char const *type_name = get_numbered_type_name(idati, cache.ordinal);
@@ -471,32 +779,10 @@ static void process_array(DieHolder &array_holder)
     }
     else
     {
-      DieChildIterator iter(array_holder, DW_TAG_subrange_type);
       qtype array_type;
       qtype elem_type;
-      Dwarf_Signed size = 0;
-
-      if(*iter != NULL)
-      {
-        DieHolder *subrange_holder = *iter;
-
-        try
-        {
-          // get the array (max) size
-          // TODO: handle DW_AT_count too
-          size = subrange_holder->get_attr_small_val(DW_AT_upper_bound) + 1;
-        }
-        catch(DieException const &exc)
-        {
-          if(exc.get_error() != NULL)
-          {
-            throw;
-          }
-
-          // no size...
-          size = 0;
-        }
-      }
+      // array (max) size, 0 if unknown
+      Dwarf_Signed const size = type_graph[node_idx].nb_elems;
 
       // if we have an array of complex types, we need more than the type_t...
       make_new_type(elem_type, type, cache.ordinal);
@@ -510,7 +796,7 @@ static void process_array(DieHolder &array_holder)
       {
         uint32 ordinal = 0;
 
-        ok = set_simple_die_type(NULL, array_type, &ordinal);
+        ok = set_die_type(NULL, array_type, &ordinal, has_placeholders(cache));
         if(ok)
         {
           DEBUG("added array from original type='%s' ordinal=%u\n", type_name, cache.ordinal);
@@ -528,18 +814,14 @@ static void process_array(DieHolder &array_holder)
   }
 }
 
-static void add_structure_member(DieHolder *member_holder, struc_t *sptr,
-                                 bool *second_pass)
+static void add_structure_member(Dwarf_Debug dbg, TypeMember const &member,
+                                 struc_t *sptr, bool *second_pass)
 {
-  char const *member_name = member_holder->get_name();
-  Dwarf_Off const offset = member_holder->get_ref_from_attr(DW_AT_type);
-  DieHolder new_die(member_holder->get_dbg(), offset);
-  ea_t moffset = sptr->is_union() ? 0 : static_cast<ea_t>(member_holder->get_member_offset());
+  char const *member_name = member.name;
+  Dwarf_Off const offset = type_graph.get_type_offset(member.type);
+  ea_t moffset = sptr->is_union() ? 0 : static_cast<ea_t>(member.member_offset);
   die_cache cache;
-  bool ok = false;
-
-  try_visit_type_die(new_die);
-  ok = new_die.get_cache_type(&cache);
+  bool ok = get_ref_type_cache(dbg, offset, &cache);
   if(!ok)
   {
     // member type not in cache
@@ -579,6 +861,11 @@ static void add_structure_member(DieHolder *member_holder, struc_t *sptr,
           add_struc_member(sptr, member_name, moffset, flags, NULL, size);
           member_t *mptr = get_member_by_name(sptr, member_name);
           set_member_tinfo(idati, sptr, mptr, 0, type, NULL, 0);
+
+          if(mptr != NULL)
+          {
+            member_types.add(cache.ordinal, sptr->id, mptr->id);
+          }
         }
 
         DEBUG("adding one member name='%s'\n", member_name);
@@ -586,11 +873,11 @@ static void add_structure_member(DieHolder *member_holder, struc_t *sptr,
     }
   }
 
-  member_holder->cache_useless();
+  diecache.cache_useless(member.offset);
 }
 
 // find if the struct/union being processed is the copy of another one
-static tid_t get_other_structure(DieHolder &structure_holder, char const *name,
+static tid_t get_other_structure(TypeNode const &structure_node, char const *name,
                                  uint32 *ordinal)
 {
   tid_t struc_id = BADNODE;
@@ -602,7 +889,7 @@ static tid_t get_other_structure(DieHolder &structure_holder, char const *name,
   // being processed. Just generate another name for the struct.
   if(other_id != BADNODE && sptr == NULL)
   {
-    struc_id = add_dup_struc(structure_holder, name, ordinal);
+    struc_id = add_dup_struc(type_graph, structure_node, name, ordinal);
   }
   else if(sptr != NULL)
   {
@@ -610,7 +897,7 @@ static tid_t get_other_structure(DieHolder &structure_holder, char const *name,
 
     if(other_ordinal != 0 && other_ordinal != BADADDR)
     {
-      Dwarf_Off const offset = structure_holder.get_offset();
+      Dwarf_Off const offset = structure_node.offset;
       Dwarf_Off other_offset = 0;
       bool const ok = diecache.get_type_offset(other_ordinal, &other_offset);
 
@@ -619,14 +906,14 @@ static tid_t get_other_structure(DieHolder &structure_holder, char const *name,
       {
         StrucCmp struc_cmp(name);
 
-        if(struc_cmp.equal(structure_holder))
+        if(struc_cmp.equal(type_graph, structure_node))
         {
           *ordinal = other_ordinal;
         }
         else
         {
           // generate a new name for the struct/union
-          struc_id = add_dup_struc(structure_holder, name, ordinal);
+          struc_id = add_dup_struc(type_graph, structure_node, name, ordinal);
         }
       }
     }
@@ -656,16 +943,19 @@ static tid_t decl_add_struc(char const *name, bool const is_union,
 }
 
 // structure/union processing (no incomplete type)
-static void process_complete_structure(DieHolder &structure_holder, char const *name,
+static void process_complete_structure(DieHolder &structure_holder, uint32 const node_idx,
                                        uint32 *ordinal, bool *second_pass)
 {
-  bool const is_union = structure_holder.get_tag() == DW_TAG_union_type;
+  // copy: processing the members can add nodes
+  TypeNode const node = type_graph[node_idx];
+  char const *name = node.name;
+  bool const is_union = (node.kind == NODE_UNION);
   uint32 decl_ordinal = 0;
   tid_t struc_id = decl_add_struc(name, is_union, &decl_ordinal);
 
   if(struc_id == BADNODE)
   {
-    struc_id = get_other_structure(structure_holder, name, ordinal);
+    struc_id = get_other_structure(node, name, ordinal);
   }
 
   // handle only newly added struct/unions
@@ -673,10 +963,11 @@ static void process_complete_structure(DieHolder &structure_holder, char const *
   {
     struc_t *sptr = get_struc(struc_id);
 
-    for(DieChildIterator iter(structure_holder, DW_TAG_member);
-        *iter != NULL; ++iter)
+    for(uint32 idx = 0; idx < node.nb_members; ++idx)
     {
-      add_structure_member(*iter, sptr, second_pass);
+      add_structure_member(structure_holder.get_dbg(),
+                           type_graph.get_member(node, idx),
+                           sptr, second_pass);
     }
 
     // TODO: how to set the final struct/union size?
@@ -699,32 +990,33 @@ static void process_complete_structure(DieHolder &structure_holder, char const *
     }
     else if(decl_ordinal != 0)
     {
+      profiler.count(COUNTER_TYPE_WRITES);
       set_type_alias(idati, decl_ordinal, *ordinal);
     }
   }
 }
 
 // TODO: handle bitfields
-static void process_structure(DieHolder &structure_holder)
+static void process_structure(DieHolder &structure_holder, uint32 const node_idx)
 {
-  char const *name = structure_holder.get_name();
-  Dwarf_Attribute declaration = structure_holder.get_attr(DW_AT_declaration);
-  bool const is_union = structure_holder.get_tag() == DW_TAG_union_type;
+  char const *name = type_graph[node_idx].name;
+  // only for the debug messages
+  GCC_UNUSED bool const is_union = (type_graph[node_idx].kind == NODE_UNION);
   uint32 ordinal = 0;
   bool second_pass = false;
 
   // got an incomplete type?
-  if(declaration != NULL)
+  if(type_graph[node_idx].declaration)
   {
     // add a void type for now...
     qtype void_type;
 
     void_type.append(BTF_VOID);
-    set_simple_die_type(name, void_type, &ordinal);
+    set_die_type(name, void_type, &ordinal);
   }
   else
   {
-    process_complete_structure(structure_holder, name,
+    process_complete_structure(structure_holder, node_idx,
                                &ordinal, &second_pass);
   }
 
@@ -743,19 +1035,15 @@ static void process_structure(DieHolder &structure_holder)
   }
 }
 
-static void add_subroutine_parameter(DieHolder *param_holder, qtype &params_type,
-                                     bool *second_pass)
+static void add_subroutine_parameter(Dwarf_Debug dbg, TypeMember const &param,
+                                     qtype &params_type, bool *second_pass)
 {
-  Dwarf_Off offset = param_holder->get_ref_from_attr(DW_AT_type);
-  DieHolder new_die(param_holder->get_dbg(), offset);
+  Dwarf_Off const offset = type_graph.get_type_offset(param.type);
   type_t const *type = NULL;
   qtype new_type;
   die_cache cache;
-  bool ok = false;
-
   // found die may not be in cache
-  try_visit_type_die(new_die);
-  ok = new_die.get_cache_type(&cache);
+  bool ok = get_ref_type_cache(dbg, offset, &cache);
 
   if(ok)
   {
@@ -780,27 +1068,23 @@ static void add_subroutine_parameter(DieHolder *param_holder, qtype &params_type
   params_type.append(new_type);
 }
 
-static void add_subroutine_return(DieHolder &subroutine_holder, qtype &func_type,
-                                  bool *second_pass)
+static void add_subroutine_return(Dwarf_Debug dbg, uint32 const return_type,
+                                  qtype &func_type, bool *second_pass)
 {
   qtype new_type;
 
   // no return type?
-  if(subroutine_holder.get_attr(DW_AT_type) == NULL)
+  if(return_type == NO_NODE)
   {
     // assume the function returns void
     new_type.append(BTF_VOID);
   }
   else
   {
-    Dwarf_Off offset = subroutine_holder.get_ref_from_attr(DW_AT_type);
-    DieHolder new_die(subroutine_holder.get_dbg(), offset);
+    Dwarf_Off const offset = type_graph.get_type_offset(return_type);
     die_cache cache;
-    bool ok = false;
-
     // found die may not be in cache
-    try_visit_type_die(new_die);
-    ok = new_die.get_cache_type(&cache);
+    bool ok = get_ref_type_cache(dbg, offset, &cache);
 
     if(ok)
     {
@@ -828,12 +1112,12 @@ static void add_subroutine_return(DieHolder &subroutine_holder, qtype &func_type
   func_type.append(new_type);
 }
 
-static void process_subroutine(DieHolder &subroutine_holder)
+static void process_subroutine(DieHolder &subroutine_holder, uint32 const node_idx)
 {
+  TypeNode const node = type_graph[node_idx];
+  Dwarf_Debug dbg = subroutine_holder.get_dbg();
   qtype func_type;
   qtype params_type;
-  DieChildIterator ellipsis(subroutine_holder,
-                            DW_TAG_unspecified_parameters);
   int nb_params = 0;
   uint32 ordinal = 0;
   bool second_pass = false;
@@ -843,28 +1127,28 @@ static void process_subroutine(DieHolder &subroutine_holder)
   func_type.append(static_cast<type_t>(CM_UNKNOWN | CM_M_NN));
 
   // look for the return type
-  add_subroutine_return(subroutine_holder, func_type, &second_pass);
+  add_subroutine_return(dbg, node.type, func_type, &second_pass);
 
   // look for the parameters types
-  for(DieChildIterator iter(subroutine_holder, DW_TAG_formal_parameter);
-      *iter != NULL; ++iter)
+  for(uint32 idx = 0; idx < node.nb_members; ++idx)
   {
-    add_subroutine_parameter(*iter, params_type, &second_pass);
+    add_subroutine_parameter(dbg, type_graph.get_member(node, idx),
+                             params_type, &second_pass);
     nb_params++;
   }
 
-  if(nb_params == 0 && *ellipsis == NULL)
+  if(nb_params == 0 && !node.ellipsis)
   {
     func_type[1] |= CM_CC_VOIDARG;
   }
   else
   {
-    func_type[1] |= (*ellipsis != NULL) ? CM_CC_ELLIPSIS : CM_CC_UNKNOWN;
+    func_type[1] |= node.ellipsis ? CM_CC_ELLIPSIS : CM_CC_UNKNOWN;
     append_dt(&func_type, nb_params);
     func_type.append(params_type);
   }
 
-  saved = set_simple_die_type(NULL, func_type, &ordinal);
+  saved = set_die_type(NULL, func_type, &ordinal, second_pass);
   if(!saved)
   {
     MSG("cannot process function type offset=0x%" DW_PR_DUx "\n",
@@ -878,87 +1162,162 @@ static void process_subroutine(DieHolder &subroutine_holder)
   }
 }
 
+static bool is_dedup_complex(uint32 const node_idx) throw()
+{
+  TypeNode const &node = type_graph[node_idx];
+
+  return (dedupe_mode && !node.declaration &&
+          (node.kind == NODE_STRUCT || node.kind == NODE_UNION ||
+           node.kind == NODE_ENUM));
+}
+
+// in dedupe mode, reuse the ordinal of an equal struct/union/enum
+// that was already added from another DIE
+static bool dedup_complex_type(DieHolder &type_holder, uint32 const node_idx)
+{
+  bool found = false;
+
+  if(is_dedup_complex(node_idx))
+  {
+    type_graph.get_hash(type_holder.get_dbg(), node_idx);
+
+    uint32 const same_idx = dedup_types.find_complex(type_graph, type_holder.get_dbg(), node_idx);
+    die_cache cache;
+
+    if(same_idx != NO_NODE &&
+       diecache.get_cache_type(type_graph[same_idx].offset, &cache) &&
+       cache.ordinal != 0)
+    {
+      DEBUG("deduped type ordinal=%u offset=0x%" DW_PR_DUx "\n",
+            cache.ordinal, type_holder.get_offset());
+      type_holder.cache_type(cache.ordinal);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+// the members hash of a struct/union/enum is kept with the cache of the type
+// (the comparisons with this type do not need its node)
+static void cache_type_hash(DieHolder &type_holder, uint32 const node_idx)
+{
+  TypeNode const &node = type_graph[node_idx];
+
+  if(!node.declaration &&
+     (node.kind == NODE_STRUCT || node.kind == NODE_UNION || node.kind == NODE_ENUM))
+  {
+    diecache.set_type_hash(type_holder.get_offset(), type_graph.get_members_hash(node));
+  }
+}
+
+// the added struct/union/enum will be reused for the next equal ones
+static void add_dedup_complex_type(DieHolder &type_holder, uint32 const node_idx)
+{
+  die_cache cache;
+
+  // not with placeholders (see set_die_type)
+  if(is_dedup_complex(node_idx) && type_holder.get_cache_type(&cache) &&
+     !cache.second_pass)
+  {
+    dedup_types.add_complex(type_graph[node_idx], node_idx);
+  }
+}
+
+void import_decoded_types(DecodedTypes const &types)
+{
+  type_graph.import_types(types);
+}
+
 void visit_type_die(DieHolder &die_holder)
 {
   if(!die_holder.in_cache())
   {
     Dwarf_Half const tag = die_holder.get_tag();
+    // the DIE is only read here, the next passes use its node
+    uint32 const node_idx = type_graph.build_node(die_holder);
 
-    switch(tag)
+    if(!dedup_complex_type(die_holder, node_idx))
     {
-    case DW_TAG_enumeration_type:
-      process_enum(die_holder);
-      break;
-    case DW_TAG_base_type:
-      process_base_type(die_holder);
-      break;
-    case DW_TAG_unspecified_type:
-      process_unspecified(die_holder);
-      break;
-    case DW_TAG_volatile_type:
-    case DW_TAG_const_type:
-    case DW_TAG_pointer_type:
-      process_modifier(die_holder);
-      break;
-    case DW_TAG_typedef:
-      process_typedef(die_holder);
-      break;
-    case DW_TAG_array_type:
-      process_array(die_holder);
-      break;
-    case DW_TAG_structure_type:
-    case DW_TAG_union_type:
-      process_structure(die_holder);
-      break;
-    case DW_TAG_subroutine_type:
-      process_subroutine(die_holder);
-      break;
-    default:
-      break;
+      switch(tag)
+      {
+      case DW_TAG_enumeration_type:
+        process_enum(die_holder, node_idx);
+        break;
+      case DW_TAG_base_type:
+        process_base_type(die_holder);
+        break;
+      case DW_TAG_unspecified_type:
+        process_unspecified(die_holder);
+        break;
+      case DW_TAG_volatile_type:
+      case DW_TAG_const_type:
+      case DW_TAG_pointer_type:
+        process_modifier(die_holder);
+        break;
+      case DW_TAG_typedef:
+        process_typedef(die_holder);
+        break;
+      case DW_TAG_array_type:
+        process_array(die_holder, node_idx);
+        break;
+      case DW_TAG_structure_type:
+      case DW_TAG_union_type:
+        process_structure(die_holder, node_idx);
+        break;
+      case DW_TAG_subroutine_type:
+        process_subroutine(die_holder, node_idx);
+        break;
+      default:
+        break;
+      }
+
+      cache_type_hash(die_holder, node_idx);
+      add_dedup_complex_type(die_holder, node_idx);
     }
   }
 }
 
 // find members we did not get when doing first pass
-static void second_process_structure(DieHolder &structure_holder,
+static void second_process_structure(Dwarf_Debug dbg, uint32 const node_idx,
                                      uint32 const ordinal)
 {
+  TypeNode const node = type_graph[node_idx];
   char const *type_name = get_numbered_type_name(idati, ordinal);
   tid_t struc_id = get_struc_id(type_name);
   struc_t *sptr = get_struc(struc_id);
   bool third_pass = false;
 
-  for(DieChildIterator child_iter(structure_holder, DW_TAG_member);
-      *child_iter != NULL; ++child_iter)
+  for(uint32 idx = 0; idx < node.nb_members; ++idx)
   {
-    DieHolder *member_holder = *child_iter;
-    char const *member_name = member_holder->get_name();
-    member_t *mptr = get_member_by_name(sptr, member_name);
+    TypeMember const member = type_graph.get_member(node, idx);
+    member_t *mptr = get_member_by_name(sptr, member.name);
 
     // no member at this offset?
     if(mptr == NULL)
     {
-      add_structure_member(member_holder, sptr, &third_pass);
+      add_structure_member(dbg, member, sptr, &third_pass);
     }
   }
 
   if(third_pass)
   {
     MSG("structure/union name='%s' ordinal=%u needs a third pass\n", type_name, ordinal);
-    structure_holder.cache_useless();
+    diecache.cache_useless(node.offset);
   }
 }
 
 // find return type/parameters we did not get when doing first pass
-static void second_process_subroutine(DieHolder &subroutine_holder,
+static void second_process_subroutine(Dwarf_Debug dbg, uint32 const node_idx,
                                       uint32 const ordinal)
 {
+  TypeNode const node = type_graph[node_idx];
   type_t const *type = NULL;
   p_list const *fields = NULL;
   char const *type_name = get_numbered_type_name(idati, ordinal);
   bool ok = false;
 
-  ok = get_numbered_type(idati, ordinal, &type, &fields);
+  ok = type_stage.get_type(ordinal, &type, &fields);
   if(type_name == NULL || !ok)
   {
     MSG("cannot get type from ordinal=%u\n", ordinal);
@@ -986,7 +1345,7 @@ static void second_process_subroutine(DieHolder &subroutine_holder,
 
       if(is_type_unknown(info.rettype[0]))
       {
-        add_subroutine_return(subroutine_holder, func_type, &third_pass);
+        add_subroutine_return(dbg, node.type, func_type, &third_pass);
       }
       else
       {
@@ -998,14 +1357,14 @@ static void second_process_subroutine(DieHolder &subroutine_holder,
         append_dt(&func_type, nb_args);
       }
 
-      for(DieChildIterator iter(subroutine_holder, DW_TAG_formal_parameter);
-          *iter != NULL; ++iter, ++idx)
+      for(; idx < static_cast<int>(node.nb_members); ++idx)
       {
         qtype param_type;
 
         if(is_type_unknown(info[idx].type[0]))
         {
-          add_subroutine_parameter(*iter, param_type, &third_pass);
+          add_subroutine_parameter(dbg, type_graph.get_member(node, idx),
+                                   param_type, &third_pass);
         }
         else
         {
@@ -1020,7 +1379,8 @@ static void second_process_subroutine(DieHolder &subroutine_holder,
         MSG("function ordinal=%u needs a third pass\n", ordinal);
       }
 
-      ok = set_numbered_type(idati, ordinal, NTF_REPLACE, type_name, func_type.c_str());
+      // written with the pointer updates
+      type_stage.replace(ordinal, type_name, func_type.c_str());
     }
   }
 
@@ -1032,96 +1392,85 @@ static void second_process_subroutine(DieHolder &subroutine_holder,
 
 static void do_second_pass(Dwarf_Debug dbg)
 {
-  for(CachedDieIterator cached_iter(dbg);
-      *cached_iter != NULL; ++cached_iter)
+  // the DIEs needing a second pass are not read again from libdwarf
+  for(CacheIterator iter(DIE_TYPE); *iter != NULL; ++iter)
   {
-    DieHolder *die_holder = *cached_iter;
-    die_cache cache;
-    bool const found = die_holder->get_cache(&cache);
+    die_cache const *cache = *iter;
 
-    // this DIE needs a second pass?
-    if(found && cache.type == DIE_TYPE && cache.second_pass)
+    if(cache->second_pass)
     {
-      Dwarf_Half const tag = die_holder->get_tag();
+      uint32 const node_idx = type_graph.find_node(iter.get_offset());
+      uint8 const kind = (node_idx == NO_NODE) ?
+        static_cast<uint8>(NODE_UNKNOWN) : type_graph[node_idx].kind;
 
-      switch(tag)
+      try
       {
-      case DW_TAG_structure_type:
-      case DW_TAG_union_type:
-        second_process_structure(*die_holder, cache.ordinal);
-        break;
-      case DW_TAG_subroutine_type:
-        second_process_subroutine(*die_holder, cache.ordinal);
-        break;
-      default:
-        break;
+        switch(kind)
+        {
+        case NODE_STRUCT:
+        case NODE_UNION:
+          second_process_structure(dbg, node_idx, cache->ordinal);
+          break;
+        case NODE_SUBROUTINE:
+          second_process_subroutine(dbg, node_idx, cache->ordinal);
+          break;
+        default:
+          break;
+        }
+      }
+      catch(DieException const &exc)
+      {
+        if(count_dwarf_error(DWERR_SKIPPED_DIE))
+        {
+          MSG("cannot do second pass for DIE (skipping): %s\n", exc.what());
+        }
       }
     }
   }
 }
 
-// update a simple (i.e. not BT_COMPLEX) type in all members of all struct/unions
-static void update_structure_member(Dwarf_Debug dbg, Dwarf_Half const tag,
-                                    qtype const &old_type, qtype const &new_type)
+// update a simple (i.e. not BT_COMPLEX) type in the struct/union members using it
+static void update_structure_members(uint32 const ordinal, qtype const &old_type,
+                                     qtype const &new_type)
 {
-  for(CachedDieIterator struc_iter(dbg, tag);
-      *struc_iter != NULL; ++struc_iter)
+  MemberTypes::Members const *members = member_types.get(ordinal);
+
+  for(size_t idx = 0; members != NULL && idx < members->size(); ++idx)
   {
-    DieHolder *struc_holder = *struc_iter;
-    uint32 struc_ordinal = 0;
-    bool ok = struc_holder->get_ordinal(&struc_ordinal);
+    MemberTypes::Member const &member = (*members)[idx];
+    struc_t *sptr = get_struc(member.first);
+    member_t *mptr = get_member_by_id(member.second);
 
-    if(ok)
+    // struct/union and member still there?
+    if(sptr != NULL && mptr != NULL)
     {
-      char const *type_name = get_numbered_type_name(idati, struc_ordinal);
+      qtype member_type;
+      bool const ok = get_member_tinfo(mptr, &member_type, NULL);
 
-      if(type_name != NULL)
+      // if the member type is the old modified one
+      if(ok && typcmp(old_type.c_str(), member_type.c_str()) == 0)
       {
-        tid_t struc_id = get_struc_id(type_name);
-        struc_t *sptr = get_struc(struc_id);
-
-        for(DieChildIterator child_iter(*struc_holder, DW_TAG_member);
-            *child_iter != NULL; ++child_iter)
-        {
-          DieHolder *member_holder = *child_iter;
-          char const *member_name = member_holder->get_name();
-          member_t *mptr = get_member_by_name(sptr, member_name);
-
-          // really a member with this name?
-          if(mptr != NULL)
-          {
-            qtype member_type;
-
-            ok = get_member_tinfo(mptr, &member_type, NULL);
-            if(ok)
-            {
-              // if the member type is the old modified one
-              if(typcmp(old_type.c_str(), member_type.c_str()) == 0)
-              {
-                set_member_tinfo(idati, sptr, mptr, 0, new_type.c_str(), NULL, 0);
-                DEBUG("struct/union member changed name='%s' ordinal=%u\n", member_name, struc_ordinal);
-              }
-            }
-          }
-        }
+        set_member_tinfo(idati, sptr, mptr, 0, new_type.c_str(), NULL, 0);
+        DEBUG("struct/union member changed ordinal=%u\n", static_cast<uint32>(sptr->ordinal));
       }
     }
   }
 }
 
 // update pointers to function with (old) unknown return/parameters
-static void update_ptr_types(Dwarf_Debug dbg)
+// the changed pointer ordinals are added to the vector
+static void update_ptr_types(qvector<uint32> &ptr_ordinals)
 {
   for(CacheIterator iter(DIE_TYPE); *iter != NULL; ++iter)
   {
     die_cache const *cache = *iter;
     type_t const *type = NULL;
-    bool ok = get_numbered_type(idati, cache->ordinal, &type);
+    bool ok = type_stage.get_type(cache->ordinal, &type);
 
     if(ok && is_type_ptr(type[0]) && cache->base_ordinal != 0)
     {
       type_t const *func_type = NULL;
-      ok = get_numbered_type(idati, cache->base_ordinal, &func_type);
+      ok = type_stage.get_type(cache->base_ordinal, &func_type);
 
       // function pointer?
       if(ok && is_type_func(func_type[0]))
@@ -1136,28 +1485,15 @@ static void update_ptr_types(Dwarf_Debug dbg)
           type_t const *base_type = get_ptrs_base_type(type);
           type_pair_t type_pair(base_type, func_type);
           type_pair_vec_t vector_pair;
-          // backup used when old type is replaced
-          qtype const old_type(type);
-          qstring const old_name(type_name);
           qtype new_type(type);
 
           vector_pair.push_back(type_pair);
           replace_subtypes(new_type, vector_pair);
 
-          ok = del_numbered_type(idati, cache->ordinal);
-          if(ok)
-          {
-            // we replace a pointer type, so we only need the type_t, not the fields
-            ok = set_numbered_type(idati, cache->ordinal, NTF_REPLACE, old_name.c_str(), new_type.c_str());
-            if(ok)
-            {
-              DEBUG("pointer type changed ordinal=%u\n", cache->ordinal);
-
-              // propagate the new type in the aggregate types
-              update_structure_member(dbg, DW_TAG_structure_type, old_type, new_type);
-              update_structure_member(dbg, DW_TAG_union_type, old_type, new_type);
-            }
-          }
+          // we replace a pointer type, so we only need the type_t, not the fields
+          type_stage.replace(cache->ordinal, type_name, new_type.c_str());
+          ptr_ordinals.push_back(cache->ordinal);
+          DEBUG("pointer type changed ordinal=%u\n", cache->ordinal);
         }
       }
     }
@@ -1176,11 +1512,68 @@ static void update_ptr_types(Dwarf_Debug dbg)
   }
 }
 
-void retrieve_types(CUsHolder const &cus_holder)
+// propagate the new pointer types in the aggregate types
+static void update_ptr_members(qvector<uint32> const &ptr_ordinals)
 {
-  Dwarf_Debug dbg = cus_holder.get_dbg();
+  for(size_t idx = 0; idx < ptr_ordinals.size(); ++idx)
+  {
+    TypeStage::StagedType const *staged = type_stage.find(ptr_ordinals[idx]);
 
-  do_dies_traversal(cus_holder, try_visit_type_die);
-  do_second_pass(dbg);
-  update_ptr_types(dbg);
+    if(staged != NULL && staged->written)
+    {
+      update_structure_members(ptr_ordinals[idx], staged->old_type, staged->type);
+    }
+  }
+}
+
+static void finish_types(Dwarf_Debug dbg)
+{
+  qvector<uint32> ptr_ordinals;
+
+  {
+    ProfileScope const scope(TIMER_SECOND_PASS);
+
+    do_second_pass(dbg);
+  }
+
+  {
+    // the staged second pass writes are timed with the pointers
+    ProfileScope const scope(TIMER_PTR_TYPES);
+
+    update_ptr_types(ptr_ordinals);
+    // one write per type changed by the second pass or a pointer update
+    type_stage.flush();
+    update_ptr_members(ptr_ordinals);
+  }
+
+  // the staged types are written, their old types are only valid once
+  type_stage.clear();
+}
+
+void add_type_visitors(DieTraversal &traversal, bool const dedupe)
+{
+  Dwarf_Half const tags[] = { DW_TAG_enumeration_type, DW_TAG_base_type,
+                              DW_TAG_unspecified_type, DW_TAG_volatile_type,
+                              DW_TAG_const_type, DW_TAG_pointer_type,
+                              DW_TAG_typedef, DW_TAG_array_type,
+                              DW_TAG_structure_type, DW_TAG_union_type,
+                              DW_TAG_subroutine_type };
+
+  for(size_t idx = 0; idx < qnumber(tags); ++idx)
+  {
+    traversal.add_visitor(PHASE_TYPES, tags[idx], try_visit_type_die);
+  }
+
+  dedupe_mode = dedupe;
+  traversal.add_finisher(PHASE_TYPES, finish_types);
+}
+
+void clear_type_state(void) throw()
+{
+  type_stage.clear();
+  member_types.clear();
+  type_graph.clear();
+  dedup_types.clear();
+  dedupe_mode = false;
+  clear_compared_names();
 }
@@ -5,11 +5,23 @@
 #define BTMT_SHRTFLT BTMT_SPECFLT 
 
 #include "die_utils.hpp"
+#include "traversal.hpp"
+#include "type_decoder.hpp"
 
 void visit_type_die(DieHolder &die_holder);
 
+// the types decoded by the worker threads (see TypeDecoder)
+// get their nodes before their DIEs are visited
+void import_decoded_types(DecodedTypes const &types);
+
 TRY_VISIT_DIE(visit_type_die)
 
-void retrieve_types(CUsHolder const &cus_holder);
+// in dedupe mode, the same types from all the CUs get the same ordinal
+void add_type_visitors(DieTraversal &traversal, bool const dedupe=false);
+
+// the type nodes, struct/union members and dedupe types are kept
+// between the traversals (like the DIE cache, a lazy import needs them),
+// until they are cleared with the DIE cache
+void clear_type_state(void) throw();
 
 #endif // IDADWARF_TYPE_RETRIEVAL_HPP
@@ -3,19 +3,17 @@
 // local headers
 #include "die_cache.hpp"
 #include "ida_utils.hpp"
-#include "iterators.hpp"
 
 extern DieCache diecache;
 
+// names of the IDA constants/members and of the DIE children they are compared to
+static StringPool compared_names;
+
 EnumCmp::EnumCmp(enum_t enum_id) throw()
   : m_enum_id(enum_id)
 {
   // find the enum by its id
   // should only be used for debug purpose
-  if(m_enum_id != BADNODE)
-  {
-    for_all_consts(m_enum_id, *this);
-  }
 }
 
 EnumCmp::EnumCmp(char const *enum_name) throw()
@@ -25,62 +23,42 @@ EnumCmp::EnumCmp(char const *enum_name) throw()
   if(enum_name != NULL)
   {
     m_enum_id = get_enum(enum_name);
-
-    if(m_enum_id != BADNODE)
-    {
-      for_all_consts(m_enum_id, *this);
-    }
   }
 }
 
-EnumCmp::EnumCmp(DieHolder &enumeration_holder)
+EnumCmp::EnumCmp(TypeGraph const &type_graph, TypeNode const &enumeration_node)
   : m_enum_id(BADNODE)
 {
   // find the enum by its first constant name
-  DieChildIterator iter(enumeration_holder, DW_TAG_enumerator);
-
-  if(*iter != NULL)
+  if(enumeration_node.nb_members != 0)
   {
-    DieHolder *const_holder = *iter;
-    const_t const_id = get_const_by_name(const_holder->get_name());
+    TypeMember const first_const = type_graph.get_member(enumeration_node, 0);
+    const_t const_id = get_const_by_name(first_const.name);
 
     m_enum_id = get_const_enum(const_id);
-
-    if(m_enum_id != BADNODE)
-    {
-      for_all_consts(m_enum_id, *this);
-    }
   }
 }
 
 EnumCmp::~EnumCmp(void) throw()
 {
-  while(!m_consts.empty())
-  {
-    MapConsts::iterator iter = m_consts.begin();
-    char *str = const_cast<char *>(iter->first);
 
-    m_consts.erase(iter);
-    qfree(str), str = NULL;
-  }
 }
 
-bool EnumCmp::equal(DieHolder &enumeration_holder)
+bool EnumCmp::equal(TypeGraph const &type_graph, TypeNode const &enumeration_node)
 {
   bool ret = false;
 
-  if(m_enum_id != BADNODE)
+  // only get the constants if the hashes match
+  if(m_enum_id != BADNODE &&
+     type_graph.may_be_equal(get_enum_type_ordinal(m_enum_id), enumeration_node))
   {
-    for(DieChildIterator iter(enumeration_holder, DW_TAG_enumerator);
-        *iter != NULL; ++iter)
+    for_all_consts(m_enum_id, *this);
+
+    for(uint32 idx = 0; idx < enumeration_node.nb_members; ++idx)
     {
-      DieHolder *child_holder = *iter;
-      char const *child_name = NULL;
-      Dwarf_Signed value = 0;
+      TypeMember const child = type_graph.get_member(enumeration_node, idx);
 
-      child_name = child_holder->get_name();
-      value = child_holder->get_attr_small_val(DW_AT_const_value);
-      if(!find(child_name, static_cast<uval_t>(value)))
+      if(!find(compared_names.intern(child.name), static_cast<uval_t>(child.value)))
       {
         break;
       }
@@ -95,16 +73,15 @@ bool EnumCmp::equal(DieHolder &enumeration_holder)
 int idaapi EnumCmp::visit_const(const_t cid, uval_t value) throw()
 {
   int ret = 1;
-  // '\0' character is included in len
-  ssize_t len = get_const_name(cid, NULL, 0);
+  char buf[MAXNAMELEN];
 
-  if(len != -1)
+  if(get_const_name(cid, buf, sizeof(buf)) != -1)
   {
-    char *buf = static_cast<char *>(qalloc(len));
-    if(buf != NULL)
+    uint32 const name_id = compared_names.intern(buf);
+
+    if(name_id != StringPool::NO_STRING)
     {
-      get_const_name(cid, buf, len);
-      m_consts[buf] = value;
+      m_consts[name_id] = value;
       ret = 0;
     }
   }
@@ -112,17 +89,14 @@ int idaapi EnumCmp::visit_const(const_t cid, uval_t value) throw()
   return ret;
 }
 
-bool EnumCmp::find(char const *name, uval_t const value)
+bool EnumCmp::find(uint32 const name_id, uval_t const value)
 {
   bool ret = false;
-  MapConsts::iterator iter = m_consts.find(name);
+  MapConsts::iterator iter = m_consts.find(name_id);
 
   if(iter != m_consts.end() && iter->second == value)
   {
-    char *str = const_cast<char *>(iter->first);
-
     m_consts.erase(iter);
-    qfree(str), str = NULL;
     ret = true;
   }
 
@@ -137,8 +111,6 @@ StrucCmp::StrucCmp(tid_t struc_id) throw()
   if(struc_id != BADNODE)
   {
     m_is_union = is_union(struc_id);
-
-    add_all_members();
   }
 }
 
@@ -153,42 +125,37 @@ StrucCmp::StrucCmp(char const *struc_name) throw()
     if(m_struc_id != BADNODE)
     {
       m_is_union = is_union(m_struc_id);
-
-      add_all_members();
     }
   }
 }
 
 StrucCmp::~StrucCmp(void) throw()
 {
-  while(!m_members.empty())
-  {
-    MapMembers::iterator iter = m_members.begin();
-    char *str = const_cast<char *>(iter->first);
 
-    m_members.erase(iter);
-    qfree(str), str = NULL;
-  }
 }
 
-bool StrucCmp::equal(DieHolder &structure_holder)
+bool StrucCmp::equal(TypeGraph const &type_graph, TypeNode const &structure_node)
 {
-  bool const is_union = structure_holder.get_tag() == DW_TAG_union_type;
+  bool const is_union = (structure_node.kind == NODE_UNION);
+  struc_t *sptr = (m_struc_id == BADNODE) ? NULL : get_struc(m_struc_id);
   bool ret = false;
 
-  if(!m_members.empty() &&
-     m_is_union == is_union &&
-     m_struc_id != BADNODE)
+  // only get the members if the hashes match
+  if(sptr != NULL && m_is_union == is_union &&
+     type_graph.may_be_equal(static_cast<uint32>(sptr->ordinal), structure_node))
+  {
+    add_all_members();
+  }
+
+  if(!m_members.empty())
   {
-    for(DieChildIterator iter(structure_holder, DW_TAG_member);
-        *iter != NULL; ++iter)
+    for(uint32 idx = 0; idx < structure_node.nb_members; ++idx)
     {
-      DieHolder *member_holder =  *iter;
-      char const *member_name = member_holder->get_name();
-      ea_t moffset = m_is_union ? 0 : static_cast<ea_t>(member_holder->get_member_offset());
+      TypeMember const member = type_graph.get_member(structure_node, idx);
+      ea_t moffset = m_is_union ? 0 : static_cast<ea_t>(member.member_offset);
 
       // continue even if the name is not erased
-      try_erase(member_name, moffset);
+      try_erase(compared_names.intern(member.name), moffset);
     }
 
     ret = m_members.empty();
@@ -202,49 +169,43 @@ void StrucCmp::add_all_members(void) throw()
   if(m_struc_id != BADNODE)
   {
     struc_t *sptr = get_struc(m_struc_id);
-    ssize_t const struc_len = get_struc_name(m_struc_id, NULL, 0);
 
     for(size_t idx = 0; idx < sptr->memqty; ++idx)
     {
       member_t *mptr = &(sptr->members[idx]);
+      char buf[MAXNAMELEN];
 
-      // get_member_name crashes when given a NULL pointer...
-      // we need to get the "struct.field" name and
-      // substract the "struct." part
-      // len is without the '\0' character
-      ssize_t len = get_member_fullname(mptr->id, NULL, 0);
-
-      if(len != -1)
+      if(get_member_name(mptr->id, buf, sizeof(buf)) != -1)
       {
-        len -= struc_len;
+        uint32 const name_id = compared_names.intern(buf);
 
-        char *buf = static_cast<char *>(qalloc(len));
-        if(buf != NULL)
+        if(name_id != StringPool::NO_STRING)
         {
-          get_member_name(mptr->id, buf, len);
-          m_members[buf] = m_is_union ? 0 : mptr->soff;
+          m_members[name_id] = m_is_union ? 0 : mptr->soff;
         }
       }
     }
   }
 }
 
-void StrucCmp::try_erase(char const *name, ea_t const offset)
+void StrucCmp::try_erase(uint32 const name_id, ea_t const offset)
 {
-  MapMembers::iterator iter = m_members.find(name);
+  MapMembers::iterator iter = m_members.find(name_id);
 
   if(iter != m_members.end() && iter->second == offset)
   {
-    char *str = const_cast<char *>(iter->first);
-
     m_members.erase(iter);
-    qfree(str), str = NULL;
   }
 }
 
+void clear_compared_names(void) throw()
+{
+  compared_names.clear();
+}
+
 // add an enum even if its name already exists
-enum_t add_dup_enum(DieHolder &enumeration_holder, char const *name,
-                    flags_t flag)
+enum_t add_dup_enum(TypeGraph const &type_graph, TypeNode const &enumeration_node,
+                    char const *name, flags_t flag)
 {
   enum_t enum_id = add_enum(BADADDR, name, flag);
 
@@ -260,7 +221,7 @@ enum_t add_dup_enum(DieHolder &enumeration_holder, char const *name,
 
       // check if there is an existing equal enum
       // with the same new name
-      if(enum_cmp.equal(enumeration_holder))
+      if(enum_cmp.equal(type_graph, enumeration_node))
       {
         enum_id = enum_cmp.get_enum_id();
       }
@@ -275,10 +236,10 @@ enum_t add_dup_enum(DieHolder &enumeration_holder, char const *name,
 }
 
 // add a struct/union even if its name already exists
-tid_t add_dup_struc(DieHolder &structure_holder, char const *name,
-                    uint32 *ordinal)
+tid_t add_dup_struc(TypeGraph const &type_graph, TypeNode const &structure_node,
+                    char const *name, uint32 *ordinal)
 {
-  bool const is_union = structure_holder.get_tag() == DW_TAG_union_type;
+  bool const is_union = (structure_node.kind == NODE_UNION);
   tid_t struc_id = add_struc(BADADDR, name, is_union);
 
   // failed to add?
@@ -293,7 +254,7 @@ tid_t add_dup_struc(DieHolder &structure_holder, char const *name,
 
       // check if there is an existing equal struct/union
       // with the same new name
-      if(struc_cmp.equal(structure_holder))
+      if(struc_cmp.equal(type_graph, structure_node))
       {
         struc_id = struc_cmp.get_struc_id();
         *ordinal = struc_cmp.get_ordinal();
@@ -326,13 +287,23 @@ bool apply_die_type(DieHolder &die_holder, ea_t const addr)
   return ok;
 }
 
+// node of the DIE which gave a type ordinal (NO_NODE if not found)
+// the DIE is read again if its CU was restored without nodes
+static uint32 get_type_node(TypeGraph &type_graph, Dwarf_Debug dbg, uint32 const ordinal)
+{
+  Dwarf_Off offset = 0;
+  bool const ok = diecache.get_type_offset(ordinal, &offset);
+
+  return ok ? type_graph.find_or_build_node(dbg, offset) : NO_NODE;
+}
+
 // check if there is a typedef with a given name and equivalent content in the db
 // equivalent content means e.g. structures, unions and enums have the same members
 // return its ordinal if the typedef is found. (0 otherwise)
-uint32 get_equivalent_typedef_ordinal(DieHolder &typedef_holder, uint32 const type_ordinal)
+uint32 get_equivalent_typedef_ordinal(TypeGraph &type_graph, Dwarf_Debug dbg,
+                                      char const *typedef_name, uint32 const type_ordinal)
 {
   uint32 ordinal = 0;
-  char const *typedef_name = typedef_holder.get_name();
   type_t const *type = NULL;
   char const *name = NULL;
   bool ok = get_numbered_type(idati, type_ordinal, &type);
@@ -360,15 +331,14 @@ uint32 get_equivalent_typedef_ordinal(DieHolder &typedef_holder, uint32 const ty
             ok = (struc_id != BADNODE);
             if(ok)
             {
-              Dwarf_Off offset = 0;
+              uint32 const node_idx = get_type_node(type_graph, dbg, type_ordinal);
 
-              ok = diecache.get_type_offset(type_ordinal, &offset);
+              ok = (node_idx != NO_NODE);
               if(ok)
               {
-                DieHolder structure_holder(typedef_holder.get_dbg(), offset);
                 StrucCmp struc_cmp(name);
 
-                ok = struc_cmp.equal(structure_holder);
+                ok = struc_cmp.equal(type_graph, type_graph[node_idx]);
               }
             }
           }
@@ -385,15 +355,14 @@ uint32 get_equivalent_typedef_ordinal(DieHolder &typedef_holder, uint32 const ty
             ok = (enum_id != BADNODE);
             if(ok)
             {
-              Dwarf_Off offset = 0;
+              uint32 const node_idx = get_type_node(type_graph, dbg, type_ordinal);
 
-              ok = diecache.get_type_offset(type_ordinal, &offset);
+              ok = (node_idx != NO_NODE);
               if(ok)
               {
-                DieHolder enumeration_holder(typedef_holder.get_dbg(), offset);
                 EnumCmp enum_cmp(name);
 
-                ok = enum_cmp.equal(enumeration_holder);
+                ok = enum_cmp.equal(type_graph, type_graph[node_idx]);
               }
             }
           }
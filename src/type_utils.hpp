@@ -12,15 +12,10 @@
 
 // local headers
 #include "die_utils.hpp"
+#include "type_graph.hpp"
 
-struct less_strcmp
-{
-  bool operator()(char const *s1, char const *s2) const throw()
-  {
-    return strcmp(s1, s2) < 0;
-  }
-};
-
+// enum comparison
+// the constants are only compared when the members hashes match
 class EnumCmp : public const_visitor_t
 {
 public:
@@ -28,7 +23,7 @@ public:
 
   EnumCmp(char const *enum_name) throw();
 
-  EnumCmp(DieHolder &enumeration_holder);
+  EnumCmp(TypeGraph const &type_graph, TypeNode const &enumeration_node);
 
   virtual ~EnumCmp(void) throw();
 
@@ -37,12 +32,13 @@ public:
     return m_enum_id;
   }
 
-  bool equal(DieHolder &enumeration_holder);
+  bool equal(TypeGraph const &type_graph, TypeNode const &enumeration_node);
 
   typedef auto_ptr<EnumCmp> Ptr;
 
 private:
-  typedef map<char const *, uval_t, less_strcmp> MapConsts;
+  // constant name id (in the compared names pool), constant value
+  typedef map<uint32, uval_t> MapConsts;
   MapConsts m_consts;
   enum_t m_enum_id; // can be BADNODE
 
@@ -52,14 +48,15 @@ private:
 
   virtual int idaapi visit_const(const_t cid, uval_t value) throw();
 
-  bool find(char const *name, uval_t const value);
+  bool find(uint32 const name_id, uval_t const value);
 };
 
 // struct/union comparison
 // we consider 2 structures equal if they have the same (processed) member
 // names at the same offset
 // we consider 2 unions equal if they have the same (processed) member names
-// TODO: might be possible to do some member typechecking? (difficult)
+// the members are only compared when the members hashes match
+// (see TypeGraph::may_be_equal)
 class StrucCmp
 {
 public:
@@ -81,28 +78,33 @@ public:
     return (sptr == NULL) ? 0 : sptr->ordinal;
   }
 
-  bool equal(DieHolder &structure_holder);
+  bool equal(TypeGraph const &type_graph, TypeNode const &structure_node);
 
 private:
   tid_t m_struc_id;
   bool m_is_union;
-  // (unique) member name, member offset (0 for unions)
-  typedef map<char const *, ea_t, less_strcmp> MapMembers;
+  // (unique) member name id (in the compared names pool), member offset (0 for unions)
+  typedef map<uint32, ea_t> MapMembers;
   MapMembers m_members;
 
   void add_all_members(void) throw();
 
-  void try_erase(char const *name, ea_t const offset);
+  void try_erase(uint32 const name_id, ea_t const offset);
 };
 
-enum_t add_dup_enum(DieHolder &enumeration_holder, char const *name,
-                    flags_t flag);
+// forget the names interned by the comparisons
+// (they have their own pool, not the DIE names one)
+void clear_compared_names(void) throw();
+
+enum_t add_dup_enum(TypeGraph const &type_graph, TypeNode const &enumeration_node,
+                    char const *name, flags_t flag);
 
-tid_t add_dup_struc(DieHolder &structure_holder, char const *name,
-                    uint32 *ordinal);
+tid_t add_dup_struc(TypeGraph const &type_graph, TypeNode const &structure_node,
+                    char const *name, uint32 *ordinal);
 
 bool apply_die_type(DieHolder &die_holder, ea_t const addr);
 
-uint32 get_equivalent_typedef_ordinal(DieHolder &typedef_holder, uint32 const type_ordinal);
+uint32 get_equivalent_typedef_ordinal(TypeGraph &type_graph, Dwarf_Debug dbg,
+                                      char const *typedef_name, uint32 const type_ordinal);
 
 #endif // IDADWARF_TYPE_UTILS_HPP
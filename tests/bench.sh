@@ -0,0 +1,93 @@
+#!/bin/sh
+# idadwarf benchmark harness
+# runs the plugin headlessly (idag -A) on each given binary, in each mode,
+# and keeps the profile of each run (the phase timers and counters, in JSON).
+#
+# usage: bench.sh <results dir> <binary>...
+# IDAG: command line of the batch IDA (default: idag)
+# MODES: modes to run (default: plain dedupe index lazy)
+#   plain: types, functions, globals (no macros in batch mode)
+#   dedupe: the same with the cross-CU type dedupe
+#   index: two runs on the same database with the persistent index,
+#          the second one should restore all the CUs
+#   lazy: the lazy mode startup (only the address index, nothing imported)
+
+IDAG=${IDAG:-idag}
+MODES=${MODES:-plain dedupe index lazy}
+
+# plugin flags (see src/defs.hpp)
+ARG_DEDUPE=1
+ARG_INDEX=2
+ARG_BATCH=4
+ARG_PROFILE=64
+ARG_LAZY=128
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 <results dir> <binary>..." >&2
+  exit 1
+fi
+
+results=$1
+shift
+mkdir -p "$results" || exit 1
+results=$(cd "$results" && pwd)
+
+# run_plugin <input file> <plugin arg> <run name> [idag options]
+run_plugin()
+{
+  input=$1
+  arg=$2
+  run=$3
+  shift 3
+  script="$results/$run.idc"
+  profile="$results/$run.json"
+
+  cat > "$script" <<END
+static main()
+{
+  Wait();
+  RunPlugin("idadwarf", $arg);
+  Exit(0);
+}
+END
+
+  # the plugin writes the profile itself
+  rm -f "${profile:?}"
+  start=$(date +%s)
+  IDADWARF_PROFILE_JSON="$profile" $IDAG -A "$@" -L"$results/$run.log" -S"$script" "$input"
+  end=$(date +%s)
+
+  if [ -r "$profile" ]; then
+    echo "$run: $((end - start)) s (profile in $run.json)"
+  else
+    echo "$run: no profile written, see $run.log" >&2
+  fi
+}
+
+for bin in "$@"; do
+  name=$(basename "$bin")
+  base_arg=$((ARG_BATCH | ARG_PROFILE))
+
+  for mode in $MODES; do
+    db="$results/$name-$mode"
+
+    case $mode in
+      plain)
+        run_plugin "$bin" $base_arg "$name-plain" -c -o"$db"
+        ;;
+      dedupe)
+        run_plugin "$bin" $((base_arg | ARG_DEDUPE)) "$name-dedupe" -c -o"$db"
+        ;;
+      index)
+        run_plugin "$bin" $((base_arg | ARG_INDEX)) "$name-index-cold" -c -o"$db"
+        run_plugin "$db.idb" $((base_arg | ARG_INDEX)) "$name-index-warm"
+        ;;
+      lazy)
+        run_plugin "$bin" $((base_arg | ARG_LAZY)) "$name-lazy" -c -o"$db"
+        ;;
+      *)
+        echo "unknown mode '$mode'" >&2
+        ;;
+    esac
+  done
+done
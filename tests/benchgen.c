@@ -0,0 +1,309 @@
+/* benchgen
+ * writes a synthetic C corpus for the idadwarf benchmarks:
+ * - a chain of shared headers (each one includes the previous one),
+ *   with deep struct graphs, function pointer callback tables,
+ *   enums, unions, bitfields and many macros
+ * - many compilation units, each one using a header,
+ *   filling a callback table and calling the previous unit
+ * - a main file calling all the units through a table
+ *
+ * usage: benchgen <dir> [nb_cus] [nb_headers] [depth]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEFAULT_NB_CUS 1000
+#define DEFAULT_NB_HEADERS 32
+#define DEFAULT_DEPTH 8
+#define NB_HEADER_MACROS 32
+#define NB_CU_MACROS 8
+
+static FILE *open_file(char const *dir, char const *name, int const idx)
+{
+  char path[4096];
+  FILE *file = NULL;
+
+  snprintf(path, sizeof(path), "%s/%s_%04d.%c", dir, name, idx,
+           (name[0] == 'h') ? 'h' : 'c');
+  file = fopen(path, "w");
+
+  if(file == NULL)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  return file;
+}
+
+static void write_header(char const *dir, int const idx, int const depth)
+{
+  FILE *file = open_file(dir, "hdr", idx);
+  int macro = 0;
+  int level = 0;
+
+  fprintf(file, "#ifndef HDR_%04d_H\n#define HDR_%04d_H\n\n", idx, idx);
+
+  if(idx != 0)
+  {
+    fprintf(file, "#include \"hdr_%04d.h\"\n\n", idx - 1);
+  }
+
+  for(macro = 0; macro < NB_HEADER_MACROS; ++macro)
+  {
+    if(macro % 2 == 0)
+    {
+      fprintf(file, "#define HDR_%04d_CONST_%02d 0x%x\n", idx, macro, idx * 256 + macro);
+    }
+    else
+    {
+      fprintf(file, "#define HDR_%04d_MACRO_%02d(x) (((x) << %d) ^ HDR_%04d_CONST_%02d)\n",
+              idx, macro, macro % 8, idx, macro - 1);
+    }
+  }
+
+  fprintf(file,
+          "\nenum hdr_%04d_state\n{\n"
+          "  HDR_%04d_IDLE,\n  HDR_%04d_BUSY,\n  HDR_%04d_DONE = %d\n};\n\n",
+          idx, idx, idx, idx, idx + 2);
+
+  /* callback table */
+  fprintf(file,
+          "struct hdr_%04d_node;\n\n"
+          "typedef int (*hdr_%04d_cb)(struct hdr_%04d_node *node, int arg);\n\n"
+          "struct hdr_%04d_ops\n{\n"
+          "  hdr_%04d_cb open;\n"
+          "  hdr_%04d_cb close;\n"
+          "  void (*release)(struct hdr_%04d_node *node);\n"
+          "  int (*compare)(struct hdr_%04d_node const *, struct hdr_%04d_node const *);\n"
+          "};\n\n",
+          idx, idx, idx, idx, idx, idx, idx, idx, idx);
+
+  /* the node points to itself, to its table and to the previous header node */
+  fprintf(file,
+          "struct hdr_%04d_node\n{\n"
+          "  int id;\n"
+          "  enum hdr_%04d_state state;\n"
+          "  struct hdr_%04d_node *next;\n",
+          idx, idx, idx);
+
+  if(idx != 0)
+  {
+    fprintf(file, "  struct hdr_%04d_node *parent;\n", idx - 1);
+  }
+
+  fprintf(file,
+          "  struct hdr_%04d_ops const *ops;\n"
+          "  union\n  {\n    int ival;\n    double dval;\n    char name[16];\n  } u;\n"
+          "  unsigned int flags : 3;\n"
+          "  unsigned int kind : 5;\n"
+          "  short levels[4];\n"
+          "};\n\n",
+          idx);
+
+  /* nested structs, each level embeds the previous one */
+  fprintf(file,
+          "struct hdr_%04d_lvl_00\n{\n"
+          "  struct hdr_%04d_node node;\n"
+          "  struct hdr_%04d_node *back;\n"
+          "  int v;\n"
+          "};\n\n",
+          idx, idx, idx);
+
+  for(level = 1; level <= depth; ++level)
+  {
+    fprintf(file,
+            "struct hdr_%04d_lvl_%02d\n{\n"
+            "  struct hdr_%04d_lvl_%02d inner;\n"
+            "  struct hdr_%04d_lvl_%02d *back;\n"
+            "  int v;\n"
+            "};\n\n",
+            idx, level, idx, level - 1, idx, level - 1);
+  }
+
+  fprintf(file, "typedef struct hdr_%04d_lvl_%02d hdr_%04d_top;\n\n#endif\n",
+          idx, depth, idx);
+  fclose(file);
+}
+
+static void write_cu(char const *dir, int const idx, int const nb_headers, int const depth)
+{
+  FILE *file = open_file(dir, "cu", idx);
+  int const hdr = idx % nb_headers;
+  int macro = 0;
+
+  fprintf(file, "#include \"hdr_%04d.h\"\n\n", hdr);
+
+  for(macro = 0; macro < NB_CU_MACROS; ++macro)
+  {
+    fprintf(file, "#define CU_%04d_ADD_%d(a, b) ((a) + (b) * %d + HDR_%04d_CONST_%02d)\n",
+            idx, macro, macro + 1, hdr, (macro * 2) % NB_HEADER_MACROS);
+  }
+
+  fprintf(file, "\nstatic int cu_%04d_counter;\nint cu_%04d_global[4];\n\n", idx, idx);
+
+  if(idx != 0)
+  {
+    fprintf(file, "extern int cu_%04d_entry(int arg, int depth);\n\n", idx - 1);
+  }
+
+  /* a loop with values living in registers, then on the stack (location lists at -O2) */
+  fprintf(file,
+          "static int cu_%04d_open(struct hdr_%04d_node *node, int arg)\n{\n"
+          "  int idx = 0;\n  int sum = 0;\n\n"
+          "  for(idx = 0; idx < arg; ++idx)\n  {\n"
+          "    sum += CU_%04d_ADD_0(node->levels[idx & 3], idx);\n"
+          "    node = (node->next != 0) ? node->next : node;\n"
+          "  }\n\n"
+          "  cu_%04d_counter += sum;\n\n  return sum;\n}\n\n",
+          idx, hdr, idx, idx);
+
+  fprintf(file,
+          "static int cu_%04d_close(struct hdr_%04d_node *node, int arg)\n{\n"
+          "  node->state = HDR_%04d_DONE;\n\n"
+          "  return HDR_%04d_MACRO_01(arg ^ node->id);\n}\n\n",
+          idx, hdr, hdr, hdr);
+
+  fprintf(file,
+          "static void cu_%04d_release(struct hdr_%04d_node *node)\n{\n"
+          "  node->next = 0;\n  node->flags = 0;\n}\n\n",
+          idx, hdr);
+
+  fprintf(file,
+          "static int cu_%04d_compare(struct hdr_%04d_node const *a, struct hdr_%04d_node const *b)\n{\n"
+          "  return a->id - b->id;\n}\n\n"
+          "static struct hdr_%04d_ops const cu_%04d_ops =\n{\n"
+          "  cu_%04d_open, cu_%04d_close, cu_%04d_release, cu_%04d_compare\n};\n\n",
+          idx, hdr, hdr, hdr, idx, idx, idx, idx, idx);
+
+  fprintf(file,
+          "int cu_%04d_entry(int arg, int depth)\n{\n"
+          "  struct hdr_%04d_node nodes[2];\n"
+          "  hdr_%04d_top top;\n"
+          "  int res = 0;\n"
+          "  int idx = 0;\n\n"
+          "  for(idx = 0; idx < 2; ++idx)\n  {\n"
+          "    nodes[idx].id = arg + idx;\n"
+          "    nodes[idx].state = HDR_%04d_IDLE;\n"
+          "    nodes[idx].next = &nodes[1 - idx];\n"
+          "    nodes[idx].ops = &cu_%04d_ops;\n"
+          "    nodes[idx].u.ival = CU_%04d_ADD_1(arg, idx);\n"
+          "    nodes[idx].levels[0] = nodes[idx].levels[1] = (short)idx;\n"
+          "    nodes[idx].levels[2] = nodes[idx].levels[3] = (short)arg;\n"
+          "  }\n\n"
+          "  res = nodes[0].ops->open(&nodes[0], arg & 3);\n"
+          "  res += nodes[1].ops->close(&nodes[1], res);\n"
+          "  res += nodes[0].ops->compare(&nodes[0], &nodes[1]);\n"
+          "  nodes[0].ops->release(&nodes[0]);\n"
+          "  top.v = res;\n"
+          "  top.back = 0;\n",
+          idx, hdr, hdr, hdr, idx, idx);
+
+  if(depth > 0)
+  {
+    fprintf(file, "  top.inner.v = res >> 1;\n");
+  }
+
+  fprintf(file, "  cu_%04d_global[arg & 3] = res;\n", idx);
+
+  if(idx != 0)
+  {
+    fprintf(file, "\n  if(depth > 0)\n  {\n"
+            "    res += cu_%04d_entry(res, depth - 1);\n  }\n", idx - 1);
+  }
+
+  fprintf(file, "\n  return res + top.v;\n}\n");
+  fclose(file);
+}
+
+static void write_main(char const *dir, int const nb_cus)
+{
+  char path[4096];
+  FILE *file = NULL;
+  int idx = 0;
+
+  snprintf(path, sizeof(path), "%s/main.c", dir);
+  file = fopen(path, "w");
+
+  if(file == NULL)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(file, "#include <stdio.h>\n\n");
+
+  for(idx = 0; idx < nb_cus; ++idx)
+  {
+    fprintf(file, "extern int cu_%04d_entry(int arg, int depth);\n", idx);
+  }
+
+  fprintf(file, "\nstatic int (* const entries[])(int, int) =\n{\n");
+
+  for(idx = 0; idx < nb_cus; ++idx)
+  {
+    fprintf(file, "  cu_%04d_entry,\n", idx);
+  }
+
+  fprintf(file,
+          "};\n\n"
+          "int main(int argc, char **argv)\n{\n"
+          "  unsigned int idx = 0;\n  int res = 0;\n\n"
+          "  (void)argv;\n\n"
+          "  for(idx = 0; idx < sizeof(entries) / sizeof(entries[0]); ++idx)\n  {\n"
+          "    res += entries[idx](argc, 2);\n  }\n\n"
+          "  printf(\"res: %%d\\n\", res);\n\n  return 0;\n}\n");
+  fclose(file);
+}
+
+static int get_arg(int const argc, char **argv, int const idx, int const default_val)
+{
+  int val = default_val;
+
+  if(idx < argc)
+  {
+    val = atoi(argv[idx]);
+  }
+
+  return val;
+}
+
+int main(int argc, char **argv)
+{
+  int nb_cus = 0;
+  int nb_headers = 0;
+  int depth = 0;
+  int idx = 0;
+
+  if(argc < 2)
+  {
+    fprintf(stderr, "usage: %s <dir> [nb_cus] [nb_headers] [depth]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  nb_cus = get_arg(argc, argv, 2, DEFAULT_NB_CUS);
+  nb_headers = get_arg(argc, argv, 3, DEFAULT_NB_HEADERS);
+  depth = get_arg(argc, argv, 4, DEFAULT_DEPTH);
+
+  if(nb_cus < 1 || nb_cus > 9999 || nb_headers < 1 || nb_headers > 9999 ||
+     depth < 0 || depth > 99)
+  {
+    fprintf(stderr, "%s: bad corpus size\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for(idx = 0; idx < nb_headers; ++idx)
+  {
+    write_header(argv[1], idx, depth);
+  }
+
+  for(idx = 0; idx < nb_cus; ++idx)
+  {
+    write_cu(argv[1], idx, nb_headers, depth);
+  }
+
+  write_main(argv[1], nb_cus);
+
+  return EXIT_SUCCESS;
+}
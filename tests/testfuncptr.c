@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+/* both callbacks take a pointer to the struct being defined:
+   their function types have the same placeholders at first pass,
+   but the pointers must keep their own ordinals */
+
+typedef struct s_list
+{
+  int value;
+  int (*visit)(struct s_list *list);
+  struct s_list *next;
+} list;
+
+typedef struct s_tree
+{
+  int value;
+  int (*visit)(struct s_tree *tree);
+  struct s_tree *left;
+  struct s_tree *right;
+} tree;
+
+static int visit_list(list *l)
+{
+  return l->value;
+}
+
+static int visit_tree(tree *t)
+{
+  return t->value;
+}
+
+int main(void)
+{
+  list l = { 1, visit_list, NULL };
+  tree t = { 2, visit_tree, NULL, NULL };
+
+  printf("%d %d\n", l.visit(&l), t.visit(&t));
+
+  return 0;
+}